@@ -0,0 +1,18 @@
+//
+//  arena.cpp
+//  cloxpp
+//
+
+#include "arena.hpp"
+#include <algorithm>
+
+void* Arena::allocateSlow(size_t size, size_t alignment) {
+    auto blockSize = std::max(static_cast<size_t>(ARENA_BLOCK_SIZE), size + alignment);
+    blocks.emplace_back(new char[blockSize]);
+    top = blocks.back().get();
+    end = top + blockSize;
+
+    auto start = align(top, alignment);
+    top = start + size;
+    return start;
+}
@@ -0,0 +1,79 @@
+//
+//  arena.hpp
+//  cloxpp
+//
+
+#ifndef arena_hpp
+#define arena_hpp
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+// A bump allocator for data that all dies at the same time. Nothing is freed
+// until the arena itself goes away, and destructors of the objects placed in
+// it are never run, so only use it for types that own nothing but arena
+// memory.
+class Arena {
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char* top = nullptr;
+    char* end = nullptr;
+
+    static char* align(char* pointer, size_t alignment) {
+        auto address = reinterpret_cast<uintptr_t>(pointer);
+        return pointer + ((alignment - address % alignment) % alignment);
+    }
+
+    void* allocateSlow(size_t size, size_t alignment);
+
+public:
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t size, size_t alignment) {
+        auto start = align(top, alignment);
+        if (top == nullptr || start + size > end) return allocateSlow(size, alignment);
+        top = start + size;
+        return start;
+    }
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+};
+
+// Lets standard containers take their storage from an arena. Memory given
+// back when they grow is simply dropped.
+template <typename T>
+struct ArenaAllocator {
+    using value_type = T;
+    Arena* arena;
+
+    explicit ArenaAllocator(Arena& arena): arena(&arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other): arena(other.arena) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) {}
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+};
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+template <typename K, typename V, typename Hash>
+using ArenaMap = std::unordered_map<K, V, Hash, std::equal_to<K>, ArenaAllocator<std::pair<const K, V>>>;
+
+#endif /* arena_hpp */
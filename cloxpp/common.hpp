@@ -14,10 +14,29 @@
 
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
+#define DEBUG_STRESS_GC
+#define DEBUG_LOG_GC
+#define DEBUG_PRINT_ESCAPES
+#define DEBUG_PROFILE_OPCODES
 
 #undef DEBUG_PRINT_CODE
 #undef DEBUG_TRACE_EXECUTION
+#undef DEBUG_STRESS_GC
+#undef DEBUG_LOG_GC
+#undef DEBUG_PRINT_ESCAPES
+#undef DEBUG_PROFILE_OPCODES
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// Direct threaded dispatch needs the labels-as-values extension.
+#if defined(__GNUC__) || defined(__clang__)
+#define COMPUTED_GOTO
+#endif
+
+// The JIT only emits x86-64, and tracing and profiling need to see every
+// instruction the interpreter would have run.
+#if defined(__x86_64__) && !defined(DEBUG_TRACE_EXECUTION) && !defined(DEBUG_PROFILE_OPCODES)
+#define X86_64_JIT
+#endif
+
 #endif /* common_h */
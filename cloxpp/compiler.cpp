@@ -7,24 +7,31 @@
 //
 
 #include "compiler.hpp"
-
-Compiler::Compiler(Parser* parser, FunctionType type, std::unique_ptr<Compiler> enclosing)
-    : parser(parser), type(type), function(std::make_shared<FunctionObject>(0, "")), enclosing(std::move(enclosing)) {
+#include <algorithm>
+
+Compiler::Compiler(Parser* parser, FunctionType type, Compiler* enclosing)
+    : parser(parser), type(type), function(parser->heap.allocate<FunctionObject>(0, "")), enclosing(enclosing),
+      code(ArenaAllocator<uint8_t>(parser->arena)), lines(ArenaAllocator<int>(parser->arena)),
+      instructions(ArenaAllocator<int>(parser->arena)),
+      locals(ArenaAllocator<Local>(parser->arena)), upvalues(ArenaAllocator<Upvalue>(parser->arena)),
+      identifiers(0, StringObject::Hash(), std::equal_to<StringObject*>(),
+                  ArenaAllocator<std::pair<StringObject* const, uint8_t>>(parser->arena)) {
         locals.emplace_back(Local(type == TYPE_FUNCTION ? "" : "this", 0));
         if (type != TYPE_SCRIPT) {
             function->name = parser->previous.text();
         }
 };
 
-void Compiler::addLocal(const std::string& name) {
+void Compiler::addLocal(std::string_view name) {
     if (locals.size() == UINT8_COUNT) {
         parser->error("Too many local variables in function.");
         return;
     }
     locals.emplace_back(Local(name, -1));
+    locals.back().start = static_cast<int>(code.size());
 }
 
-void Compiler::declareVariable(const std::string& name) {
+void Compiler::declareVariable(std::string_view name) {
     if (scopeDepth == 0) return;
     
     for (long i = locals.size() - 1; i >= 0; i--) {
@@ -42,7 +49,7 @@ void Compiler::markInitialized() {
     locals.back().depth = scopeDepth;
 }
 
-int Compiler::resolveLocal(const std::string& name) {
+int Compiler::resolveLocal(std::string_view name) {
     for (long i = locals.size() - 1; i >=0; i--) {
         if (locals[i].name == name) {
             if (locals[i].depth == -1) {
@@ -55,7 +62,7 @@ int Compiler::resolveLocal(const std::string& name) {
     return -1;
 }
 
-int Compiler::resolveUpvalue(const std::string& name) {
+int Compiler::resolveUpvalue(std::string_view name) {
     if (enclosing == nullptr) return -1;
     
     int local = enclosing->resolveLocal(name);
@@ -66,6 +73,7 @@ int Compiler::resolveUpvalue(const std::string& name) {
     
     int upvalue = enclosing->resolveUpvalue(name);
     if (upvalue != -1) {
+        enclosing->passesUpvalues = true;
         return addUpvalue(static_cast<uint8_t>(upvalue), false);
     }
     
@@ -90,11 +98,22 @@ int Compiler::addUpvalue(uint8_t index, bool isLocal) {
     return upvalueCount - 1;
 }
 
+// Marks the local that `upvalue` ends up at as assigned.
+void Compiler::markAssigned(int upvalue) {
+    auto& captured = upvalues[upvalue];
+    if (captured.isLocal) {
+        enclosing->locals[captured.index].isAssigned = true;
+    } else {
+        enclosing->markAssigned(captured.index);
+    }
+}
+
 void Compiler::beginScope() { scopeDepth++; }
 
 void Compiler::endScope() {
     scopeDepth--;
     while (!locals.empty() && locals.back().depth > scopeDepth) {
+        retireLocal(static_cast<int>(locals.size()) - 1);
         if (locals.back().isCaptured) {
             parser->emit(OpCode::CLOSE_UPVALUE);
         } else {
@@ -104,24 +123,171 @@ void Compiler::endScope() {
     }
 }
 
+// Calls `visit` with the kind and index operands of each upvalue the
+// CLOSURE at `closureOffset` captures.
+template <typename F>
+void Compiler::forEachCapture(int closureOffset, F visit) {
+    auto closed = function->getChunk().getConstant(code[closureOffset + 1]).as<FunctionObject>();
+    for (int i = 0; i < closed->getUpvalueCount(); i++) {
+        visit(code[closureOffset + 2 + 2 * i], code[closureOffset + 3 + 2 * i]);
+    }
+}
+
+// Settles what the code that used a variable can do, now that all of it has
+// been compiled.
+void Compiler::retireLocal(int slot) {
+    auto& local = locals[slot];
+#ifdef DEBUG_PRINT_ESCAPES
+    auto name = type == TYPE_SCRIPT ? "<script>" : function->getName();
+#endif
+
+    // A variable nothing assigns has the same value in every closure, so
+    // each can have its own copy.
+    if (local.isCaptured && !local.isAssigned) {
+        auto copies = 0;
+        for (auto offset : instructions) {
+            if (offset < local.start || OpCode(code[offset]) != OpCode::CLOSURE) continue;
+            forEachCapture(offset, [slot, &copies](uint8_t& kind, uint8_t index) {
+                if (index != slot || Capture(kind) == Capture::UPVALUE) return;
+                kind = static_cast<uint8_t>(Capture::VALUE);
+                copies++;
+            });
+        }
+#ifdef DEBUG_PRINT_ESCAPES
+        if (copies > 0) {
+            std::cout << name << ": '" << local.name << "' copied into " << copies << " closures" << std::endl;
+        }
+#endif
+    }
+
+    // A closure that is only ever called through its variable is gone by
+    // the time the locals it captures are, so it can use them in place.
+    if (local.closureOffset != -1 && !local.escapes && !local.isCaptured) {
+        auto inFrame = 0;
+        forEachCapture(local.closureOffset, [&inFrame](uint8_t& kind, uint8_t) {
+            if (Capture(kind) != Capture::LOCAL) return;
+            kind = static_cast<uint8_t>(Capture::IN_FRAME);
+            inFrame++;
+        });
+#ifdef DEBUG_PRINT_ESCAPES
+        if (inFrame > 0) {
+            std::cout << name << ": '" << local.name << "' captures in its frame [line "
+                      << lines[local.closureOffset] << "]" << std::endl;
+        }
+#endif
+    }
+
+    // A bound method that is only ever called through the variable it was
+    // stored in cannot outlive its frame, so the VM can keep it in the
+    // frame's stack slot instead of allocating it.
+    if (local.bindOffset == -1 || local.escapes || local.isCaptured) return;
+
+    auto& op = code[local.bindOffset];
+    op = static_cast<uint8_t>(OpCode(op) == OpCode::GET_SUPER ? OpCode::GET_SUPER_IN_FRAME
+                                                              : OpCode::GET_PROPERTY_IN_FRAME);
+
+#ifdef DEBUG_PRINT_ESCAPES
+    std::cout << name << ": '" << local.name << "' bound in its frame [line " << lines[local.bindOffset] << "]"
+              << std::endl;
+#endif
+}
+
+// Turns the first instruction of each run that matches a superinstruction
+// into it, preferring the longest match. Runs only once nothing else is going
+// to rewrite the code, since the parts it covers are skipped over.
+void Compiler::fuseInstructions() {
+    auto count = instructions.size();
+    for (size_t i = 0; i < count; i++) {
+        const Superinstruction* longest = nullptr;
+        for (auto& superinstruction : superinstructions) {
+            auto length = static_cast<size_t>(superinstruction.length);
+            if (i + length > count) continue;
+            if (longest != nullptr && superinstruction.length <= longest->length) continue;
+
+            auto matches = true;
+            for (size_t part = 0; part < length && matches; part++) {
+                matches = OpCode(code[instructions[i + part]]) == superinstruction.parts[part];
+            }
+            if (matches) longest = &superinstruction;
+        }
+
+        if (longest != nullptr) {
+            code[instructions[i]] = static_cast<uint8_t>(longest->op);
+            i += longest->length - 1;
+        }
+    }
+}
+
+// How many stack slots a call to the function can fill at most, counting
+// from the callee's. Follows every path through the code, since the
+// compiler leaves the stack as deep at a jump target whichever way it is
+// reached.
+int Compiler::maxStackDepth() {
+    auto size = static_cast<int>(code.size());
+    auto constants = function->getChunk().getConstants();
+    std::vector<int> depths(code.size(), -1);
+    std::vector<int> worklist;
+    auto deepest = 0;
+    auto reach = [&](int offset, int depth) {
+        deepest = std::max(deepest, depth);
+        if (offset >= size || depths[offset] != -1) return;
+        depths[offset] = depth;
+        worklist.push_back(offset);
+    };
+
+    reach(0, function->getArity() + 1);
+    while (!worklist.empty()) {
+        auto offset = worklist.back();
+        worklist.pop_back();
+        auto op = OpCode(code[offset]);
+        auto depth = depths[offset] + stackEffect(op, &code[offset]);
+        auto next = offset + instructionLength(op, &code[offset], constants);
+        auto jump = code[offset + 1] << 8 | code[offset + 2];
+        switch (op) {
+            case OpCode::JUMP_IF_FALSE:
+                reach(next, depth);
+                // Fall through.
+            case OpCode::JUMP:
+                reach(next + jump, depth);
+                break;
+            case OpCode::LOOP:
+                reach(next - jump, depth);
+                break;
+            case OpCode::RETURN:
+                break;
+            default:
+                reach(next, depth);
+        }
+    }
+    return deepest;
+}
+
 bool Compiler::isLocal() {
     return scopeDepth > 0;
 }
 
-ClassCompiler::ClassCompiler(std::unique_ptr<ClassCompiler> enclosing)
-    : enclosing(std::move(enclosing)), hasSuperclass(false) {};
+ClassCompiler::ClassCompiler(ClassCompiler* enclosing)
+    : enclosing(enclosing), hasSuperclass(false) {};
 
-Parser::Parser(const std::string& source) :
+Parser::Parser(const std::string& source, Heap& heap, GlobalTable& globals, SelectorTable& selectors) :
     previous(Token(TokenType::_EOF, source, 0)),
     current(Token(TokenType::_EOF, source, 0)),
     scanner(Scanner(source)),
+    heap(heap),
+    globals(globals),
+    selectors(selectors),
     classCompiler(nullptr),
     hadError(false), panicMode(false)
 {
-    compiler = std::make_unique<Compiler>(this, TYPE_SCRIPT, nullptr);
+    heap.pause();
+    compiler = arena.make<Compiler>(this, TYPE_SCRIPT, nullptr);
     advance();
 }
 
+Parser::~Parser() {
+    heap.resume();
+}
+
 std::optional<Function> Parser::compile() {
     while (!match(TokenType::_EOF)) {
         declaration();
@@ -142,11 +308,11 @@ void Parser::advance() {
         current = scanner.scanToken();
         if (current.type() != TokenType::ERROR) break;
         
-        errorAtCurrent(std::string(current.text()));
+        errorAtCurrent(current.text());
     }
 }
 
-void Parser::consume(TokenType type, const std::string& message) {
+void Parser::consume(TokenType type, std::string_view message) {
     if (current.type() == type) {
         advance();
         return;
@@ -166,11 +332,13 @@ bool Parser::match(TokenType type) {
 }
 
 void Parser::emit(uint8_t byte) {
-    currentChunk().write(byte, previous.line());
+    compiler->code.push_back(byte);
+    compiler->lines.push_back(previous.line());
 }
 
 void Parser::emit(OpCode op) {
-    currentChunk().write(op, previous.line());
+    compiler->instructions.push_back(currentOffset());
+    emit(static_cast<uint8_t>(op));
 }
 
 void Parser::emit(OpCode op, uint8_t byte) {
@@ -183,10 +351,25 @@ void Parser::emit(OpCode op1, OpCode op2) {
     emit(op2);
 }
 
+// Gives the instruction just emitted an inline cache of its own.
+void Parser::emitCache() {
+    auto cache = compiler->cacheCount++;
+    if (cache > UINT16_MAX) { error("Too many property accesses in one chunk."); }
+
+    emit((cache >> 8) & 0xff);
+    emit(cache & 0xff);
+}
+
+void Parser::emitShort(OpCode op, uint16_t operand) {
+    emit(op);
+    emit((operand >> 8) & 0xff);
+    emit(operand & 0xff);
+}
+
 void Parser::emitLoop(int loopStart) {
     emit(OpCode::LOOP);
     
-    int offset = currentChunk().count() - loopStart + 2;
+    int offset = currentOffset() - loopStart + 2;
     if (offset > UINT16_MAX) { error("Loop body too large."); }
     
     emit((offset >> 8) & 0xff);
@@ -197,7 +380,7 @@ int Parser::emitJump(OpCode op) {
     emit(op);
     emit(0xff);
     emit(0xff);
-    return currentChunk().count() - 2;
+    return currentOffset() - 2;
 }
 
 void Parser::emitReturn() {
@@ -225,20 +408,31 @@ void Parser::emitConstant(Value value) {
 
 void Parser::patchJump(int offset) {
     // -2 to adjust for the bytecode for the jump offset itself.
-    int jump = currentChunk().count() - offset - 2;
+    int jump = currentOffset() - offset - 2;
     
     if (jump > UINT16_MAX) {
         error("Too much code to jump over.");
     }
     
-    currentChunk().setCode(offset, (jump >> 8) & 0xff);
-    currentChunk().setCode(offset + 1, jump & 0xff);
+    compiler->code[offset] = (jump >> 8) & 0xff;
+    compiler->code[offset + 1] = jump & 0xff;
 }
 
 Function Parser::endCompiler() {
     emitReturn();
+    if (!hadError) compiler->function->stackSize = compiler->maxStackDepth();
+    // The function's outermost scope is never ended.
+    for (size_t slot = 0; slot < compiler->locals.size(); slot++) {
+        compiler->retireLocal(static_cast<int>(slot));
+    }
     
+#ifndef DEBUG_PROFILE_OPCODES
+    compiler->fuseInstructions();
+#endif
+
     auto function = compiler->function;
+    currentChunk().assign(compiler->code.data(), compiler->lines.data(), compiler->code.size());
+    currentChunk().setCacheCount(compiler->cacheCount);
     
 #ifdef DEBUG_PRINT_CODE
     if (!hadError) {
@@ -255,7 +449,7 @@ void Parser::binary(bool canAssign) {
     auto operatorType = previous.type();
     
     // Compile the right operand.
-    auto rule = getRule(operatorType);
+    auto& rule = getRule(operatorType);
     parsePrecedence(Precedence(static_cast<int>(rule.precedence) + 1));
     
     // Emit the operator instruction.
@@ -276,23 +470,30 @@ void Parser::binary(bool canAssign) {
 }
 
 void Parser::call(bool canAssign) {
+    auto callee = lastCalleeEnd == currentOffset() ? lastCalleeLocal : -1;
     auto argCount = argumentList();
+    lastCallLocal = callee;
     emit(OpCode::CALL, argCount);
 }
 
 void Parser::dot(bool canAssign) {
     consume(TokenType::IDENTIFIER, "Expect property name after '.'.");
-    auto name = identifierConstant(std::string(previous.text()));
+    auto name = identifierConstant(previous.text());
     
     if (canAssign && match(TokenType::EQUAL)) {
         expression();
         emit(OpCode::SET_PROPERTY, name);
+        emitCache();
     } else if (match(TokenType::LEFT_PAREN)) {
         auto argCount = argumentList();
         emit(OpCode::INVOKE, name);
         emit(argCount);
+        emitCache();
     } else {
+        lastBindOffset = currentOffset();
         emit(OpCode::GET_PROPERTY, name);
+        emitCache();
+        lastBindEnd = currentOffset();
     }
 }
 
@@ -312,7 +513,7 @@ void Parser::grouping(bool canAssign) {
 }
 
 void Parser::number(bool canAssign) {
-    Value value = std::stod(std::string(previous.text()));
+    auto value = std::stod(std::string(previous.text()));
     emitConstant(value);
 }
 
@@ -331,11 +532,12 @@ void Parser::string(bool canAssign) {
     auto str = previous.text();
     str.remove_prefix(1);
     str.remove_suffix(1);
-    emitConstant(std::string(str));
+    emitConstant(heap.copyString(str));
 }
 
-void Parser::namedVariable(const std::string& name, bool canAssign) {
+void Parser::namedVariable(std::string_view name, bool canAssign) {
     OpCode getOp, setOp;
+    auto isGlobal = false;
     auto arg = compiler->resolveLocal(name);
     if (arg != -1) {
         getOp = OpCode::GET_LOCAL;
@@ -344,21 +546,39 @@ void Parser::namedVariable(const std::string& name, bool canAssign) {
         getOp = OpCode::GET_UPVALUE;
         setOp = OpCode::SET_UPVALUE;
     } else {
-        arg = identifierConstant(name);
-        getOp = OpCode::GET_GLOBAL;
-        setOp = OpCode::SET_GLOBAL;
+        arg = globalSlot(name);
+        getOp = OpCode::GET_GLOBAL_SLOT;
+        setOp = OpCode::SET_GLOBAL_SLOT;
+        isGlobal = true;
     }
     
+    auto op = getOp;
     if (canAssign && match(TokenType::EQUAL)) {
         expression();
-        emit(setOp, (uint8_t)arg);
+        op = setOp;
+        if (setOp == OpCode::SET_LOCAL) {
+            compiler->locals[arg].isAssigned = true;
+        } else if (setOp == OpCode::SET_UPVALUE) {
+            compiler->markAssigned(arg);
+        }
+    } else if (getOp == OpCode::GET_LOCAL && !check(TokenType::LEFT_PAREN)) {
+        compiler->locals[arg].escapes = true;
+    }
+
+    if (isGlobal) {
+        emitShort(op, static_cast<uint16_t>(arg));
     } else {
-        emit(getOp, (uint8_t)arg);
+        emit(op, (uint8_t)arg);
+    }
+
+    if (op == OpCode::GET_LOCAL) {
+        lastCalleeLocal = arg;
+        lastCalleeEnd = currentOffset();
     }
 }
 
 void Parser::variable(bool canAssign) {
-    namedVariable(std::string(previous.text()), canAssign);
+    namedVariable(previous.text(), canAssign);
 }
 
 void Parser::super_(bool canAssign) {
@@ -370,11 +590,20 @@ void Parser::super_(bool canAssign) {
     
     consume(TokenType::DOT, "Expect '.' after 'super'.");
     consume(TokenType::IDENTIFIER, "Expect superclass method name.");
-    auto name = identifierConstant(std::string(previous.text()));
+    auto name = selector(previous.text());
     
     namedVariable("this", false);
-    namedVariable("super", false);
-    emit(OpCode::GET_SUPER, name);
+    if (match(TokenType::LEFT_PAREN)) {
+        auto argCount = argumentList();
+        namedVariable("super", false);
+        emitShort(OpCode::SUPER_INVOKE, name);
+        emit(argCount);
+    } else {
+        namedVariable("super", false);
+        lastBindOffset = currentOffset();
+        emitShort(OpCode::GET_SUPER, name);
+        lastBindEnd = currentOffset();
+    }
 }
 
 void Parser::this_(bool canAssign) {
@@ -410,62 +639,48 @@ void Parser::unary(bool canAssign) {
     }
 }
 
-ParseRule& Parser::getRule(TokenType type) {
-    auto grouping = [this](bool canAssign) { this->grouping(canAssign); };
-    auto unary = [this](bool canAssign) { this->unary(canAssign); };
-    auto binary = [this](bool canAssign) { this->binary(canAssign); };
-    auto call = [this](bool canAssign) { this->call(canAssign); };
-    auto dot = [this](bool canAssign) { this->dot(canAssign); };
-    auto number = [this](bool canAssign) { this->number(canAssign); };
-    auto string = [this](bool canAssign) { this->string(canAssign); };
-    auto literal = [this](bool canAssign) { this->literal(canAssign); };
-    auto variable = [this](bool canAssign) { this->variable(canAssign); };
-    auto super_ = [this](bool canAssign) { this->super_(canAssign); };
-    auto this_ = [this](bool canAssign) { this->this_(canAssign); };
-    auto and_ = [this](bool canAssign) { this->and_(canAssign); };
-    auto or_ = [this](bool canAssign) { this->or_(canAssign); };
-    
-    static ParseRule rules[] = {
-        { grouping,    call,       Precedence::CALL },       // TOKEN_LEFT_PAREN
-        { nullptr,     nullptr,    Precedence::NONE },       // TOKEN_RIGHT_PAREN
-        { nullptr,     nullptr,    Precedence::NONE },       // TOKEN_LEFT_BRACE
-        { nullptr,     nullptr,    Precedence::NONE },       // TOKEN_RIGHT_BRACE
-        { nullptr,     nullptr,    Precedence::NONE },       // TOKEN_COMMA
-        { nullptr,     dot,        Precedence::CALL },       // TOKEN_DOT
-        { unary,       binary,     Precedence::TERM },       // TOKEN_MINUS
-        { nullptr,     binary,     Precedence::TERM },       // TOKEN_PLUS
-        { nullptr,     nullptr,    Precedence::NONE },       // TOKEN_SEMICOLON
-        { nullptr,     binary,     Precedence::FACTOR },     // TOKEN_SLASH
-        { nullptr,     binary,     Precedence::FACTOR },     // TOKEN_STAR
-        { unary,       nullptr,    Precedence::NONE },       // TOKEN_BANG
-        { nullptr,     binary,     Precedence::EQUALITY },   // TOKEN_BANG_EQUAL
-        { nullptr,     nullptr,    Precedence::NONE },       // TOKEN_EQUAL
-        { nullptr,     binary,     Precedence::EQUALITY },   // TOKEN_EQUAL_EQUAL
-        { nullptr,     binary,     Precedence::COMPARISON }, // TOKEN_GREATER
-        { nullptr,     binary,     Precedence::COMPARISON }, // TOKEN_GREATER_EQUAL
-        { nullptr,     binary,     Precedence::COMPARISON }, // TOKEN_LESS
-        { nullptr,     binary,     Precedence::COMPARISON }, // TOKEN_LESS_EQUAL
-        { variable,    nullptr,    Precedence::NONE },       // TOKEN_IDENTIFIER
-        { string,      nullptr,    Precedence::NONE },       // TOKEN_STRING
-        { number,      nullptr,    Precedence::NONE },       // TOKEN_NUMBER
-        { nullptr,     and_,       Precedence::AND },        // TOKEN_AND
-        { nullptr,     nullptr,    Precedence::NONE },       // TOKEN_CLASS
-        { nullptr,     nullptr,    Precedence::NONE },       // TOKEN_ELSE
-        { literal,     nullptr,    Precedence::NONE },       // TOKEN_FALSE
-        { nullptr,     nullptr,    Precedence::NONE },       // TOKEN_FUN
-        { nullptr,     nullptr,    Precedence::NONE },       // TOKEN_FOR
-        { nullptr,     nullptr,    Precedence::NONE },       // TOKEN_IF
-        { literal,     nullptr,    Precedence::NONE },       // TOKEN_NIL
-        { nullptr,     or_,        Precedence::OR },         // TOKEN_OR
-        { nullptr,     nullptr,    Precedence::NONE },       // TOKEN_PRINT
-        { nullptr,     nullptr,    Precedence::NONE },       // TOKEN_RETURN
-        { super_,      nullptr,    Precedence::NONE },       // TOKEN_SUPER
-        { this_,       nullptr,    Precedence::NONE },       // TOKEN_THIS
-        { literal,     nullptr,    Precedence::NONE },       // TOKEN_TRUE
-        { nullptr,     nullptr,    Precedence::NONE },       // TOKEN_VAR
-        { nullptr,     nullptr,    Precedence::NONE },       // TOKEN_WHILE
-        { nullptr,     nullptr,    Precedence::NONE },       // TOKEN_ERROR
-        { nullptr,     nullptr,    Precedence::NONE },       // TOKEN_EOF
+const ParseRule& Parser::getRule(TokenType type) {
+    static const ParseRule rules[] = {
+        { &Parser::grouping, &Parser::call,     Precedence::CALL },            // TOKEN_LEFT_PAREN
+        { nullptr,           nullptr,           Precedence::NONE },            // TOKEN_RIGHT_PAREN
+        { nullptr,           nullptr,           Precedence::NONE },            // TOKEN_LEFT_BRACE
+        { nullptr,           nullptr,           Precedence::NONE },            // TOKEN_RIGHT_BRACE
+        { nullptr,           nullptr,           Precedence::NONE },            // TOKEN_COMMA
+        { nullptr,           &Parser::dot,      Precedence::CALL },            // TOKEN_DOT
+        { &Parser::unary,    &Parser::binary,   Precedence::TERM },            // TOKEN_MINUS
+        { nullptr,           &Parser::binary,   Precedence::TERM },            // TOKEN_PLUS
+        { nullptr,           nullptr,           Precedence::NONE },            // TOKEN_SEMICOLON
+        { nullptr,           &Parser::binary,   Precedence::FACTOR },          // TOKEN_SLASH
+        { nullptr,           &Parser::binary,   Precedence::FACTOR },          // TOKEN_STAR
+        { &Parser::unary,    nullptr,           Precedence::NONE },            // TOKEN_BANG
+        { nullptr,           &Parser::binary,   Precedence::EQUALITY },        // TOKEN_BANG_EQUAL
+        { nullptr,           nullptr,           Precedence::NONE },            // TOKEN_EQUAL
+        { nullptr,           &Parser::binary,   Precedence::EQUALITY },        // TOKEN_EQUAL_EQUAL
+        { nullptr,           &Parser::binary,   Precedence::COMPARISON },      // TOKEN_GREATER
+        { nullptr,           &Parser::binary,   Precedence::COMPARISON },      // TOKEN_GREATER_EQUAL
+        { nullptr,           &Parser::binary,   Precedence::COMPARISON },      // TOKEN_LESS
+        { nullptr,           &Parser::binary,   Precedence::COMPARISON },      // TOKEN_LESS_EQUAL
+        { &Parser::variable, nullptr,           Precedence::NONE },            // TOKEN_IDENTIFIER
+        { &Parser::string,   nullptr,           Precedence::NONE },            // TOKEN_STRING
+        { &Parser::number,   nullptr,           Precedence::NONE },            // TOKEN_NUMBER
+        { nullptr,           &Parser::and_,     Precedence::AND },             // TOKEN_AND
+        { nullptr,           nullptr,           Precedence::NONE },            // TOKEN_CLASS
+        { nullptr,           nullptr,           Precedence::NONE },            // TOKEN_ELSE
+        { &Parser::literal,  nullptr,           Precedence::NONE },            // TOKEN_FALSE
+        { nullptr,           nullptr,           Precedence::NONE },            // TOKEN_FUN
+        { nullptr,           nullptr,           Precedence::NONE },            // TOKEN_FOR
+        { nullptr,           nullptr,           Precedence::NONE },            // TOKEN_IF
+        { &Parser::literal,  nullptr,           Precedence::NONE },            // TOKEN_NIL
+        { nullptr,           &Parser::or_,      Precedence::OR },              // TOKEN_OR
+        { nullptr,           nullptr,           Precedence::NONE },            // TOKEN_PRINT
+        { nullptr,           nullptr,           Precedence::NONE },            // TOKEN_RETURN
+        { &Parser::super_,   nullptr,           Precedence::NONE },            // TOKEN_SUPER
+        { &Parser::this_,    nullptr,           Precedence::NONE },            // TOKEN_THIS
+        { &Parser::literal,  nullptr,           Precedence::NONE },            // TOKEN_TRUE
+        { nullptr,           nullptr,           Precedence::NONE },            // TOKEN_VAR
+        { nullptr,           nullptr,           Precedence::NONE },            // TOKEN_WHILE
+        { nullptr,           nullptr,           Precedence::NONE },            // TOKEN_ERROR
+        { nullptr,           nullptr,           Precedence::NONE },            // TOKEN_EOF
     };
     
     return rules[static_cast<int>(type)];
@@ -480,12 +695,12 @@ void Parser::parsePrecedence(Precedence precedence) {
     }
     
     auto canAssign = precedence <= Precedence::ASSIGNMENT;
-    prefixRule(canAssign);
+    (this->*prefixRule)(canAssign);
     
     while (precedence <= getRule(current.type()).precedence) {
         advance();
         auto infixRule = getRule(previous.type()).infix;
-        infixRule(canAssign);
+        (this->*infixRule)(canAssign);
     }
     
     if (canAssign && match(TokenType::EQUAL)) {
@@ -494,26 +709,58 @@ void Parser::parsePrecedence(Precedence precedence) {
     }
 }
 
-int Parser::identifierConstant(const std::string& name) {
-    return makeConstant(name);
+int Parser::identifierConstant(std::string_view name) {
+    auto string = heap.copyString(name);
+    auto found = compiler->identifiers.find(string);
+    if (found != compiler->identifiers.end()) return found->second;
+
+    auto constant = makeConstant(string);
+    compiler->identifiers[string] = constant;
+    return constant;
+}
+
+uint16_t Parser::globalSlot(std::string_view name) {
+    auto string = heap.copyString(name);
+    auto slot = globals.resolve(string);
+    if (slot == -1) {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    // The table's names are only marked when a cycle begins.
+    heap.rootBarrier(string);
+    return static_cast<uint16_t>(slot);
+}
+
+uint16_t Parser::selector(std::string_view name) {
+    auto string = heap.copyString(name);
+    auto selector = selectors.resolve(string);
+    if (selector == -1) {
+        error("Too many method names.");
+        return 0;
+    }
+
+    // Like the globals' names, only marked when a cycle begins.
+    heap.rootBarrier(string);
+    return static_cast<uint16_t>(selector);
 }
 
-uint8_t Parser::parseVariable(const std::string& errorMessage) {
+uint16_t Parser::parseVariable(std::string_view errorMessage) {
     consume(TokenType::IDENTIFIER, errorMessage);
     
-    compiler->declareVariable(std::string(previous.text()));
+    compiler->declareVariable(previous.text());
     if (compiler->isLocal()) return 0;
     
-    return identifierConstant(std::string(previous.text()));
+    return globalSlot(previous.text());
 }
 
-void Parser::defineVariable(uint8_t global) {
+void Parser::defineVariable(uint16_t global) {
     if (compiler->isLocal()) {
         compiler->markInitialized();
         return;
     }
     
-    emit(OpCode::DEFINE_GLOBAL, global);
+    emitShort(OpCode::DEFINE_GLOBAL_SLOT, global);
 }
 
 uint8_t Parser::argumentList() {
@@ -544,7 +791,7 @@ void Parser::block() {
 }
 
 void Parser::function(FunctionType type) {
-    compiler = std::make_unique<Compiler>(this, type, std::move(compiler));
+    compiler = arena.make<Compiler>(this, type, compiler);
     compiler->beginScope();
 
     consume(TokenType::LEFT_PAREN, "Expect '(' after function name.");
@@ -563,35 +810,36 @@ void Parser::function(FunctionType type) {
     block();
     
     auto function = endCompiler();
-    auto newCompiler = std::move(compiler);
-    compiler = std::move(newCompiler->enclosing);
+    auto newCompiler = compiler;
+    compiler = newCompiler->enclosing;
 
+    lastClosureOffset = newCompiler->passesUpvalues ? -1 : currentOffset();
     emit(OpCode::CLOSURE, makeConstant(function));
     
     for (const auto& upvalue : newCompiler->upvalues) {
-        emit(upvalue.isLocal ? 1 : 0);
+        emit(static_cast<uint8_t>(upvalue.isLocal ? Capture::LOCAL : Capture::UPVALUE));
         emit(upvalue.index);
     }
 }
 
 void Parser::method() {
     consume(TokenType::IDENTIFIER, "Expect method name.");
-    auto constant = identifierConstant(std::string(previous.text()));
+    auto name = selector(previous.text());
     auto type = previous.text() == "init" ? TYPE_INITIALIZER : TYPE_METHOD;
     function(type);
-    emit(OpCode::METHOD, constant);
+    emitShort(OpCode::METHOD, name);
 }
 
 void Parser::classDeclaration() {
     consume(TokenType::IDENTIFIER, "Expect class name.");
-    auto className = std::string(previous.text());
+    auto className = previous.text();
     auto nameConstant = identifierConstant(className);
-    compiler->declareVariable(std::string(previous.text()));
+    compiler->declareVariable(className);
     
     emit(OpCode::CLASS, nameConstant);
-    defineVariable(nameConstant);
+    defineVariable(compiler->isLocal() ? 0 : globalSlot(className));
     
-    classCompiler = std::make_unique<ClassCompiler>(std::move(classCompiler));
+    classCompiler = arena.make<ClassCompiler>(classCompiler);
     
     if (match(TokenType::LESS)) {
         consume(TokenType::IDENTIFIER, "Expect superclass name.");
@@ -622,13 +870,19 @@ void Parser::classDeclaration() {
         compiler->endScope();
     }
     
-    classCompiler = std::move(classCompiler->enclosing);
+    classCompiler = classCompiler->enclosing;
 }
 
 void Parser::funDeclaration() {
     auto global = parseVariable("Expect function name.");
     compiler->markInitialized();
     function(TYPE_FUNCTION);
+    if (compiler->isLocal()) {
+        auto& local = compiler->locals.back();
+        local.closureOffset = lastClosureOffset;
+        // It cannot capture a copy of itself before it exists.
+        local.start = currentOffset();
+    }
     defineVariable(global);
 }
 
@@ -637,6 +891,11 @@ void Parser::varDeclaration() {
 
     if (match(TokenType::EQUAL)) {
         expression();
+        // Whatever the last instruction of the initializer pushes is what
+        // ends up in the variable.
+        if (compiler->isLocal() && lastBindEnd == currentOffset()) {
+            compiler->locals.back().bindOffset = lastBindOffset;
+        }
     } else {
         emit(OpCode::NIL);
     }
@@ -663,7 +922,7 @@ void Parser::forStatement() {
         expressionStatement();
     }
     
-    int loopStart = currentChunk().count();
+    int loopStart = currentOffset();
     
     int exitJump = -1;
     if (!match(TokenType::SEMICOLON)) {
@@ -678,7 +937,7 @@ void Parser::forStatement() {
     if (!match(TokenType::RIGHT_PAREN)) {
         int bodyJump = emitJump(OpCode::JUMP);
         
-        int incrementStart = currentChunk().count();
+        int incrementStart = currentOffset();
         expression();
         emit(OpCode::POP);
         consume(TokenType::RIGHT_PAREN, "Expect ')' after for clauses.");
@@ -770,12 +1029,25 @@ void Parser::returnStatement() {
         
         expression();
         consume(TokenType::SEMICOLON, "Expect ';' after return value.");
+
+        // A call the value comes straight from can reuse this frame.
+        if (!hadError) {
+            auto& last = compiler->code[compiler->instructions.back()];
+            if (OpCode(last) == OpCode::CALL) {
+                last = static_cast<uint8_t>(OpCode::TAIL_CALL);
+                // Its frame takes the place of this one, so a closure in
+                // a local here cannot use the locals of this one in place.
+                if (lastCallLocal != -1) compiler->locals[lastCallLocal].escapes = true;
+            } else if (OpCode(last) == OpCode::INVOKE) {
+                last = static_cast<uint8_t>(OpCode::TAIL_INVOKE);
+            }
+        }
         emit(OpCode::RETURN);
     }
 }
 
 void Parser::whileStatement() {
-    int loopStart = currentChunk().count();
+    int loopStart = currentOffset();
     
     consume(TokenType::LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
@@ -816,7 +1088,7 @@ void Parser::synchronize() {
     }
 }
 
-void Parser::errorAt(const Token& token, const std::string& message) {
+void Parser::errorAt(const Token& token, std::string_view message) {
     if (panicMode) return;
     
     panicMode = true;
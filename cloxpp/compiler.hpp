@@ -9,11 +9,13 @@
 #ifndef compiler_hpp
 #define compiler_hpp
 
+#include "arena.hpp"
 #include "scanner.hpp"
 #include "value.hpp"
+#include "memory.hpp"
 #include <iostream>
-#include <memory>
 #include <optional>
+#include <string_view>
 
 enum class Precedence {
     NONE,
@@ -34,16 +36,29 @@ class Parser;
 typedef void (Parser::*ParseFn)(bool canAssign);
 
 struct ParseRule {
-    std::function<void(bool)> prefix;
-    std::function<void(bool)> infix;
+    ParseFn prefix;
+    ParseFn infix;
     Precedence precedence;
 };
 
+// Names point into the source, which outlives the Parser.
 struct Local {
-    std::string name;
+    std::string_view name;
     int depth;
     bool isCaptured;
-    Local(std::string name, int depth): name(name), depth(depth), isCaptured(false) {};
+    // Where the GET_PROPERTY or GET_SUPER that initialized the variable is,
+    // if that was the last thing its initializer did.
+    int bindOffset = -1;
+    // Set once the variable is read for anything but calling it.
+    bool escapes = false;
+    // Set once the variable is assigned, here or in a closure.
+    bool isAssigned = false;
+    // Where the code that can capture a copy of the variable starts.
+    int start = 0;
+    // Where the CLOSURE that initialized the variable is, if it was declared
+    // with `fun` and the function passes none of its upvalues on.
+    int closureOffset = -1;
+    Local(std::string_view name, int depth): name(name), depth(depth), isCaptured(false) {};
 };
 
 class Upvalue {
@@ -60,38 +75,55 @@ typedef enum {
     TYPE_FUNCTION, TYPE_INITIALIZER, TYPE_METHOD, TYPE_SCRIPT
 } FunctionType;
 
+// Compilers and everything they own live in the Parser's arena.
 class Compiler {
     Parser* parser;
 
     FunctionType type;
     Function function;
 
-    std::unique_ptr<Compiler> enclosing;
+    Compiler* enclosing;
     
-    std::vector<Local> locals;
-    std::vector<Upvalue> upvalues;
+    // Bytecode is emitted here and copied into the function's chunk, at its
+    // final size, once the function is done.
+    ArenaVector<uint8_t> code;
+    ArenaVector<int> lines;
+    // Where each instruction in `code` starts.
+    ArenaVector<int> instructions;
+    ArenaVector<Local> locals;
+    ArenaVector<Upvalue> upvalues;
+    ArenaMap<StringObject*, uint8_t, StringObject::Hash> identifiers;
     int scopeDepth = 0;
+    int cacheCount = 0;
+    // Whether a function nested in this one captures one of its upvalues.
+    bool passesUpvalues = false;
 
 public:
-    explicit Compiler(Parser* parser, FunctionType type, std::unique_ptr<Compiler> enclosing);
-    void addLocal(const std::string& name);
-    void declareVariable(const std::string& name);
+    explicit Compiler(Parser* parser, FunctionType type, Compiler* enclosing);
+    void addLocal(std::string_view name);
+    void declareVariable(std::string_view name);
     void markInitialized();
-    int resolveLocal(const std::string& name);
-    int resolveUpvalue(const std::string& name);
+    int resolveLocal(std::string_view name);
+    int resolveUpvalue(std::string_view name);
     int addUpvalue(uint8_t index, bool isLocal);
+    void markAssigned(int upvalue);
     void beginScope();
     void endScope();
+    void retireLocal(int slot);
+    template <typename F>
+    void forEachCapture(int closureOffset, F visit);
+    void fuseInstructions();
+    int maxStackDepth();
     bool isLocal();
 
     friend Parser;
 };
 
 class ClassCompiler {
-    std::unique_ptr<ClassCompiler> enclosing;
+    ClassCompiler* enclosing;
     bool hasSuperclass;
 public:
-    explicit ClassCompiler(std::unique_ptr<ClassCompiler> enclosing);
+    explicit ClassCompiler(ClassCompiler* enclosing);
     friend Parser;
 };
 
@@ -99,14 +131,33 @@ class Parser {
     Token previous;
     Token current;
     Scanner scanner;
-    std::unique_ptr<Compiler> compiler;
-    std::unique_ptr<ClassCompiler> classCompiler;
+    Heap& heap;
+    GlobalTable& globals;
+    SelectorTable& selectors;
+    // Holds all the compiler's bookkeeping, which is thrown away in one go
+    // when compilation is done.
+    Arena arena;
+    Compiler* compiler;
+    ClassCompiler* classCompiler;
     
     bool hadError;
     bool panicMode;
+    // Offset of the last GET_PROPERTY or GET_SUPER emitted, and of the
+    // instruction after it.
+    int lastBindOffset = -1;
+    int lastBindEnd = -1;
+    // The local that the last CALL emitted called, if it called one.
+    // Likewise for the last local read just to be called, and the
+    // instruction after it.
+    int lastCallLocal = -1;
+    int lastCalleeLocal = -1;
+    int lastCalleeEnd = -1;
+    // Where the last CLOSURE emitted is, or -1 if its function passes its
+    // upvalues on.
+    int lastClosureOffset = -1;
     
     void advance();
-    void consume(TokenType type, const std::string& message);
+    void consume(TokenType type, std::string_view message);
     bool check(TokenType type);
     bool match(TokenType type);
     
@@ -114,6 +165,8 @@ class Parser {
     void emit(OpCode op);
     void emit(OpCode op, uint8_t byte);
     void emit(OpCode op1, OpCode op2);
+    void emitShort(OpCode op, uint16_t operand);
+    void emitCache();
     void emitLoop(int loopStart);
     int emitJump(OpCode op);
     void emitReturn();
@@ -131,17 +184,19 @@ class Parser {
     void number(bool canAssign);
     void or_(bool canAssign);
     void string(bool canAssign);
-    void namedVariable(const std::string& name, bool canAssign);
+    void namedVariable(std::string_view name, bool canAssign);
     void variable(bool canAssign);
     void super_(bool canAssign);
     void this_(bool canAssign);
     void and_(bool canAssign);
     void unary(bool canAssign);
-    ParseRule& getRule(TokenType type);
+    static const ParseRule& getRule(TokenType type);
     void parsePrecedence(Precedence precedence);
-    int identifierConstant(const std::string& name);
-    uint8_t parseVariable(const std::string& errorMessage);
-    void defineVariable(uint8_t global);
+    int identifierConstant(std::string_view name);
+    uint16_t globalSlot(std::string_view name);
+    uint16_t selector(std::string_view name);
+    uint16_t parseVariable(std::string_view errorMessage);
+    void defineVariable(uint16_t global);
     uint8_t argumentList();
     void expression();
     void block();
@@ -160,21 +215,23 @@ class Parser {
     void whileStatement();
     void synchronize();
 
-    void errorAt(const Token& token, const std::string& message);
+    void errorAt(const Token& token, std::string_view message);
     
-    void error(const std::string& message) {
+    void error(std::string_view message) {
         errorAt(previous, message);
     };
     
-    void errorAtCurrent(const std::string& message) {
+    void errorAtCurrent(std::string_view message) {
         errorAt(current, message);
     };
     
     friend Compiler;
     
 public:
-    Parser(const std::string& source);
+    Parser(const std::string& source, Heap& heap, GlobalTable& globals, SelectorTable& selectors);
+    ~Parser();
     Chunk& currentChunk() { return compiler->function->getChunk(); }
+    int currentOffset() { return static_cast<int>(compiler->code.size()); }
     std::optional<Function> compile();
 };
 
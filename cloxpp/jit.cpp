@@ -0,0 +1,1224 @@
+//
+//  jit.cpp
+//  cloxpp
+//
+
+#include "jit.hpp"
+#include "vm.hpp"
+#include "x86.hpp"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+
+NativeCode::~NativeCode() {
+    if (code != nullptr) munmap(code, size);
+}
+
+void Jit::printStats(std::ostream& os) const {
+    size_t bytecode = 0;
+    size_t native = 0;
+    std::chrono::microseconds time{0};
+    for (auto& function : stats) {
+        bytecode += function.bytecodeSize;
+        native += function.nativeSize;
+        time += function.time;
+    }
+
+    os << "jit: compiled " << stats.size() << " functions, " << bytecode << " bytes of bytecode into "
+       << native << " bytes of machine code in " << time.count() << "us" << std::endl;
+    for (auto& function : stats) {
+        os << "  " << (function.name.empty() ? "script" : function.name) << ": "
+           << function.bytecodeSize << " -> " << function.nativeSize << " bytes in "
+           << function.time.count() << "us after " << function.hotness << " calls and loops, "
+           << function.interpreted << " instructions left to the interpreter" << std::endl;
+    }
+
+    if (traceStats.empty() && traceAborts == 0) return;
+    os << "jit: compiled " << traceStats.size() << " traces, " << traceAborts << " recordings abandoned" << std::endl;
+    for (auto& trace : traceStats) {
+        os << "  " << (trace.function.empty() ? "script" : trace.function) << " line " << trace.line << ": "
+           << trace.length << " instructions -> " << trace.nativeSize << " bytes in " << trace.time.count()
+           << "us, left " << trace.exits << " times" << std::endl;
+    }
+}
+
+#ifndef X86_64_JIT
+
+void Jit::setEnabled(bool enabled) {}
+
+bool Jit::compile(FunctionObject* function) {
+    return false;
+}
+
+bool Jit::run() {
+    return true;
+}
+
+const uint8_t* Jit::recordTrace(NativeLoop& loop, const uint8_t* ip) {
+    return nullptr;
+}
+
+#else
+
+bool mapCode(const Assembler& as, NativeCode& native) {
+    auto pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    auto size = (as.position() + pageSize - 1) & ~(pageSize - 1);
+    auto mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) return false;
+
+    std::memcpy(mapped, as.bytes().data(), as.position());
+    if (mprotect(mapped, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mapped, size);
+        return false;
+    }
+
+    native.code = static_cast<uint8_t*>(mapped);
+    native.size = size;
+    return true;
+}
+
+// The helpers native code calls for whatever it does not do inline. Each
+// takes the JitState first and starts by bringing the VM's stack top up to
+// date from it; native code reads it back afterwards. Those that can fail
+// take the address just past their instruction's opcode, so the error is
+// reported on its line, and return false once they have reported it.
+struct JitRuntime {
+    static VM& enter(JitState* state) {
+        auto& vm = *state->vm;
+        vm.stack.truncate(static_cast<size_t>(state->top - vm.stack.begin()));
+        return vm;
+    }
+
+    static VM& enter(JitState* state, const uint8_t* ip) {
+        auto& vm = enter(state);
+        vm.frames.back().ip = const_cast<uint8_t*>(ip);
+        return vm;
+    }
+
+    static bool leave(JitState* state) {
+        state->top = state->vm->stack.end();
+        return true;
+    }
+
+    static bool undefinedVariable(JitState* state, const uint8_t* ip, int slot) {
+        auto& vm = enter(state, ip);
+        vm.runtimeError("Undefined variable '%s'.", vm.globals.names[slot]->chars.c_str());
+        return false;
+    }
+
+    static void defineGlobal(JitState* state, int slot) {
+        auto& vm = enter(state);
+        vm.globals.values[slot] = vm.peek(0);
+        vm.heap.rootBarrier(vm.peek(0));
+        vm.pop();
+        leave(state);
+    }
+
+    static bool setGlobal(JitState* state, const uint8_t* ip, int slot) {
+        auto& vm = enter(state, ip);
+        auto& value = vm.globals.values[slot];
+        if (value.isUndefined()) return undefinedVariable(state, ip, slot);
+        value = vm.peek(0);
+        vm.heap.rootBarrier(vm.peek(0));
+        return leave(state);
+    }
+
+    static void getUpvalue(JitState* state, int slot) {
+        auto& vm = enter(state);
+        vm.push(vm.frames.back().closure->upvalue(slot));
+        leave(state);
+    }
+
+    static void setUpvalue(JitState* state, int slot) {
+        auto& vm = enter(state);
+        auto upvalue = vm.frames.back().closure->upvalues[slot].as<UpvalueObject>();
+        *upvalue->location = vm.peek(0);
+        if (!upvalue->isInFrame) vm.heap.writeBarrier(upvalue, vm.peek(0));
+        leave(state);
+    }
+
+    static bool getProperty(JitState* state, const uint8_t* ip, StringObject* name, InlineCache* cache,
+                            bool inFrame) {
+        auto& vm = enter(state, ip);
+        if (!vm.peek(0).is<InstanceObject>()) {
+            vm.runtimeError("Only instances have properties.");
+            return false;
+        }
+
+        auto property = vm.findProperty(*cache, vm.peek(0).as<InstanceObject>(), name);
+        if (property.field != nullptr) {
+            vm.stack.back() = *property.field;
+        } else if (property.method != nullptr) {
+            vm.pushBoundMethod(property.method, inFrame);
+        } else {
+            vm.runtimeError("Undefined property '%s'.", name->chars.c_str());
+            return false;
+        }
+        return leave(state);
+    }
+
+    static bool setProperty(JitState* state, const uint8_t* ip, StringObject* name, InlineCache* cache) {
+        auto& vm = enter(state, ip);
+        if (!vm.peek(1).is<InstanceObject>()) {
+            vm.runtimeError("Only instances have fields.");
+            return false;
+        }
+
+        vm.setProperty(*cache, vm.peek(1).as<InstanceObject>(), name, vm.peek(0));
+        auto value = vm.pop();
+        vm.stack.back() = value;
+        return leave(state);
+    }
+
+    static bool getSuper(JitState* state, const uint8_t* ip, uint16_t selector, bool inFrame) {
+        auto& vm = enter(state, ip);
+        auto superclass = vm.pop().as<ClassObject>();
+        if (!vm.bindMethod(superclass, selector, inFrame)) return false;
+        return leave(state);
+    }
+
+    // Needs no JitState, since it cannot fail or allocate.
+    static Value* field(InstanceObject* instance, int slot) {
+        return &instance->field(slot);
+    }
+
+    // Likewise.
+    static Closure superMethod(ClassObject* superclass, int selector) {
+        return superclass->findMethod(selector);
+    }
+
+    // Likewise, since a pure native cannot fail.
+    static void callPure(NativeFunctionObject* native, Value* args) {
+        native->function(args, args[-1]);
+    }
+
+    static void equal(JitState* state) {
+        auto& vm = enter(state);
+        vm.popTwoAndPush(vm.peek(0) == vm.peek(1));
+        leave(state);
+    }
+
+    static bool add(JitState* state, const uint8_t* ip) {
+        auto& vm = enter(state, ip);
+        auto b = vm.peek(0);
+        auto a = vm.peek(1);
+        if (!a.is<StringObject>() || !b.is<StringObject>()) {
+            vm.runtimeError("Operands must be two numbers or two strings.");
+            return false;
+        }
+        vm.popTwoAndPush(vm.heap.concatenate(a.as<StringObject>(), b.as<StringObject>()));
+        return leave(state);
+    }
+
+    static bool operandsNotNumbers(JitState* state, const uint8_t* ip) {
+        enter(state, ip).runtimeError("Operands must be numbers.");
+        return false;
+    }
+
+    static bool operandNotNumber(JitState* state, const uint8_t* ip) {
+        enter(state, ip).runtimeError("Operand must be a number.");
+        return false;
+    }
+
+    static void print(JitState* state) {
+        auto& vm = enter(state);
+        std::cout << vm.pop() << std::endl;
+        leave(state);
+    }
+
+    static bool safepoint(VM& vm) {
+        if (vm.heap.safepoint()) return true;
+        vm.runtimeError("Out of memory.");
+        return false;
+    }
+
+    // Only called once native code has seen that the heap has work to do.
+    static bool loop(JitState* state, const uint8_t* ip) {
+        if (!safepoint(enter(state, ip))) return false;
+        return leave(state);
+    }
+
+    // Called when `loop`, the loop that `ip` is the LOOP of, gets hot. Goes
+    // on wherever the recording of its trace stopped.
+    static const uint8_t* record(JitState* state, const uint8_t* ip, NativeLoop* loop) {
+        auto& vm = enter(state);
+        auto next = vm.jit.recordTrace(*loop, ip);
+        state->slots = &vm.stack[vm.frames.back().stackOffset];
+        leave(state);
+        return next;
+    }
+
+    // `ip` is on the first of the upvalue operands.
+    static void closure(JitState* state, FunctionObject* function, const uint8_t* ip) {
+        auto& vm = enter(state);
+        auto& frame = vm.frames.back();
+        auto closure = vm.heap.allocate<ClosureObject>(function);
+        vm.push(closure);
+        vm.captureUpvalues(closure, ip, &vm.stack[frame.stackOffset], frame.closure);
+        leave(state);
+    }
+
+    static void closeUpvalue(JitState* state) {
+        auto& vm = enter(state);
+        vm.closeUpvalues(&vm.stack.back());
+        vm.pop();
+        leave(state);
+    }
+
+    // The helpers below change frames. They return where native code goes
+    // on from there, or null after an error: into the native code of the
+    // frame that runs next, with its slots in the JitState, or else to the
+    // way out, with its ip there.
+    static const uint8_t* resume(JitState* state) {
+        auto& vm = *state->vm;
+        auto& frame = vm.frames.back();
+        auto function = frame.closure->function;
+        leave(state);
+        if (auto native = function->getNativeCode()) {
+            auto offset = native->offsets[frame.ip - function->getChunk().getCodeStart()];
+            if (offset != NATIVE_NO_OFFSET) {
+                state->slots = &vm.stack[frame.stackOffset];
+                return native->code + offset;
+            }
+        }
+        state->ip = frame.ip;
+        return state->leave;
+    }
+
+    // Goes on in the frame a call has just pushed, if it pushed one, and
+    // lets it return to the native code of the caller without a helper. A
+    // call in tail position moves the frame over the caller's instead.
+    static const uint8_t* resumeCallee(JitState* state, size_t frameCount, bool tail) {
+        auto& vm = *state->vm;
+        if (vm.frames.size() > frameCount && tail) {
+            vm.replaceCaller();
+        } else if (vm.frames.size() > frameCount) {
+            auto& caller = vm.frames[frameCount - 1];
+            auto function = caller.closure->function;
+            auto native = function->getNativeCode();
+            auto offset = native->offsets[caller.ip - function->getChunk().getCodeStart()];
+            vm.frames.back().nativeReturn = native->code + offset;
+        }
+        return resume(state);
+    }
+
+    // `next` is the instruction after the call, where the caller goes on.
+    static const uint8_t* call(JitState* state, const uint8_t* next, int argCount, bool tail) {
+        auto& vm = enter(state, next);
+        if (!safepoint(vm)) return nullptr;
+        auto frameCount = vm.frames.size();
+        auto callee = vm.peek(argCount);
+        if (callee.is<ClosureObject>()) {
+            if (!vm.call(callee.as<ClosureObject>(), argCount)) return nullptr;
+        } else if (!vm.callValue(callee, argCount)) {
+            return nullptr;
+        }
+        return resumeCallee(state, frameCount, tail);
+    }
+
+    static const uint8_t* invoke(JitState* state, const uint8_t* next, StringObject* name, int argCount,
+                                 InlineCache* cache, bool tail) {
+        auto& vm = enter(state, next);
+        if (!safepoint(vm)) return nullptr;
+        auto frameCount = vm.frames.size();
+        if (!vm.invoke(name, argCount, *cache)) return nullptr;
+        return resumeCallee(state, frameCount, tail);
+    }
+
+    static const uint8_t* superInvoke(JitState* state, const uint8_t* next, uint16_t selector, int argCount) {
+        auto& vm = enter(state, next);
+        if (!safepoint(vm)) return nullptr;
+        auto frameCount = vm.frames.size();
+        auto superclass = vm.pop().as<ClassObject>();
+        if (!vm.invokeFromClass(superclass, selector, argCount)) return nullptr;
+        return resumeCallee(state, frameCount, false);
+    }
+
+    // `ip` is on the RETURN. The interpreter runs the script's own, which
+    // finishes it.
+    static const uint8_t* ret(JitState* state, uint8_t* ip) {
+        auto& vm = enter(state);
+        if (vm.frames.size() == 1) {
+            state->ip = ip;
+            return state->leave;
+        }
+
+        auto result = vm.pop();
+        auto offset = vm.frames.back().stackOffset;
+        vm.closeUpvalues(&vm.stack[offset]);
+        vm.frames.pop();
+        vm.stack.truncate(offset);
+        vm.push(result);
+        return resume(state);
+    }
+};
+
+namespace {
+
+// Superinstructions are compiled part by part, and quickened instructions
+// as the generic ones, with the check for their fast path inline.
+OpCode normalize(OpCode op) {
+    if (auto superinstruction = findSuperinstruction(op)) return superinstruction->parts[0];
+    switch (op) {
+        case OpCode::GREATER_NUM: return OpCode::GREATER;
+        case OpCode::LESS_NUM: return OpCode::LESS;
+        case OpCode::ADD_NUM: return OpCode::ADD;
+        case OpCode::SUBTRACT_NUM: return OpCode::SUBTRACT;
+        case OpCode::MULTIPLY_NUM: return OpCode::MULTIPLY;
+        case OpCode::DIVIDE_NUM: return OpCode::DIVIDE;
+        case OpCode::CALL_CLOSURE: return OpCode::CALL;
+        case OpCode::CALL_NATIVE: return OpCode::CALL;
+        default: return op;
+    }
+}
+
+using Entry = bool (*)(JitState* state, Value* slots, const uint8_t* target);
+
+// Entering native code saves the registers it uses and sets them up, then
+// jumps to `target`. It returns from the `exit` stub with the ip to go on
+// at in RAX, from `leave` with the ip already in the JitState, or from
+// `error`.
+struct Stubs {
+    size_t exit;
+    size_t leave;
+    size_t error;
+};
+
+Stubs assembleStubs(Assembler& as) {
+    // Five pushes keep the stack aligned for calls.
+    as.push(RBX);
+    as.push(R12);
+    as.push(R13);
+    as.push(R14);
+    as.push(R15);
+    as.mov(STATE, RDI);
+    as.mov(SLOTS, RSI);
+    as.load(TOP, STATE, offsetof(JitState, top));
+    as.movImmediate(QNAN, JitLayout::QNAN);
+    as.movImmediate(NIL, JitLayout::NIL);
+    as.jump(RDX);
+
+    Stubs stubs;
+    stubs.exit = as.position();
+    as.store(STATE, offsetof(JitState, ip), RAX);
+    stubs.leave = as.position();
+    as.store(STATE, offsetof(JitState, top), TOP);
+    as.movImmediate(RAX, 1);
+    auto epilogue = as.jump();
+
+    stubs.error = as.position();
+    as.xorRegister(RAX, RAX);
+
+    as.bind(epilogue);
+    as.pop(R15);
+    as.pop(R14);
+    as.pop(R13);
+    as.pop(R12);
+    as.pop(RBX);
+    as.ret();
+    return stubs;
+}
+
+// Assembles the instructions in order, each with only its fast path inline.
+// The slow paths come after all of them, so that the code a loop actually
+// runs stays small, and after those a table of the addresses of the helpers
+// and stubs the code calls and jumps to, which are too far away to reach
+// directly.
+class CodeGenerator {
+    Chunk& chunk;
+    uint8_t* start;
+    Assembler as;
+    const uint8_t* sharedExit;
+    const uint8_t* sharedError;
+    bool tracing;
+    NativeCode* native = nullptr;
+    // Where each instruction starts, and the jumps to patch once they all
+    // have, by the offset of the instruction they go to, or ERROR or EXIT.
+    std::vector<uint32_t> offsets;
+    struct Jump {
+        size_t at;
+        int target;
+    };
+    std::vector<Jump> jumps;
+    static constexpr int ERROR = -1;
+    static constexpr int EXIT = -2;
+    // Assembled once every instruction has been.
+    std::vector<std::function<void()>> slowPaths;
+    // The calls and jumps that go through the table of addresses.
+    std::vector<Assembler::Indirect> indirects;
+    int interpreted = 0;
+
+    uint16_t shortAt(int offset) { return static_cast<uint16_t>(start[offset] << 8 | start[offset + 1]); }
+    int length(int offset);
+
+    void push(Reg reg) {
+        as.store(TOP, 0, reg);
+        as.addImmediate(TOP, VALUE_SIZE);
+    }
+    // Stores `reg` over the second value from the top, and pops the top.
+    void replaceTwo(Reg reg) {
+        as.store(TOP, -2 * VALUE_SIZE, reg);
+        as.subImmediate(TOP, VALUE_SIZE);
+    }
+    // Turns the flag in the low byte of RAX into a boolean.
+    void boolean() {
+        as.movzx8(RAX, RAX);
+        as.lea(RAX, NIL, RAX, static_cast<int8_t>(JitLayout::FALSE - JitLayout::NIL));
+    }
+    // Sets the flags so that BELOW_OR_EQUAL means `reg` is falsey. Clobbers it.
+    void testFalsey(Reg reg) {
+        as.sub(reg, NIL);
+        as.cmpImmediate(reg, static_cast<int32_t>(JitLayout::FALSE - JitLayout::NIL));
+    }
+    // Jumps if `reg` does not hold a number. Clobbers RCX.
+    size_t jumpIfNotNumber(Reg reg) {
+        as.mov(RCX, reg);
+        as.andRegister(RCX, QNAN);
+        as.cmp(RCX, QNAN);
+        return as.jump(Condition::EQUAL);
+    }
+    // Jumps if `reg` holds an object, or if it does not. Clobbers RCX.
+    size_t jumpIfObject(Reg reg, bool object) {
+        as.mov(RCX, reg);
+        as.shift(7, RCX, 64 - 14);
+        as.cmpImmediate(RCX, -1);
+        return as.jump(object ? Condition::EQUAL : Condition::NOT_EQUAL);
+    }
+    // Leaves the address of the object in `reg` there instead.
+    void untag(Reg reg) {
+        as.shift(4, reg, 14);
+        as.shift(5, reg, 14);
+    }
+    void jumpTo(int target) { jumps.push_back({ as.jump(), target }); }
+    void jumpTo(Condition condition, int target) { jumps.push_back({ as.jump(condition), target }); }
+
+    // Runs `path` after the jumps at `from`, out of line. It gets where to
+    // go back to, which is whatever comes next here.
+    void slowPath(std::vector<size_t> jumps, std::function<void(size_t)> path) {
+        auto back = as.position();
+        slowPaths.push_back([this, jumps, back, path] {
+            for (auto jump : jumps) as.bind(jump);
+            path(back);
+        });
+    }
+    void jumpBack(size_t back) { as.patch(as.jump(), back); }
+
+    void call(const void* helper, std::initializer_list<uint64_t> arguments);
+    void callChecked(const void* helper, std::initializer_list<uint64_t> arguments) {
+        call(helper, arguments);
+        as.test8(RAX);
+        jumpTo(Condition::EQUAL, ERROR);
+    }
+    // Calls a helper that always reports an error.
+    void fail(const void* helper, std::initializer_list<uint64_t> arguments) {
+        call(helper, arguments);
+        jumpTo(ERROR);
+    }
+    // Calls a helper that changes frames and goes wherever it says.
+    void transfer(const void* helper, std::initializer_list<uint64_t> arguments) {
+        call(helper, arguments);
+        as.test(RAX);
+        jumpTo(Condition::EQUAL, ERROR);
+        as.load(SLOTS, STATE, offsetof(JitState, slots));
+        as.jump(RAX);
+    }
+    void interpret(const uint8_t* ip) {
+        as.movImmediate(RAX, reinterpret_cast<uint64_t>(ip));
+        jumpTo(EXIT);
+        interpreted++;
+    }
+
+    void arithmetic(const uint8_t* ip, uint8_t opcode, const void* slowPath);
+    void comparison(const uint8_t* ip, bool less);
+    void equal();
+    void getProperty(const uint8_t* ip, bool inFrame);
+    void setProperty(const uint8_t* ip);
+    void loop(const uint8_t* ip, int target);
+    std::vector<size_t> safepointDue();
+    std::vector<size_t> callNative(const uint8_t* next, int argCount, bool cacheHit, bool tail);
+    void callValue(const uint8_t* ip, bool tail);
+    void invoke(const uint8_t* ip, bool tail);
+    void superInvoke(const uint8_t* ip);
+    void ret(const uint8_t* ip);
+    void instruction(int offset);
+
+public:
+    explicit CodeGenerator(FunctionObject* function, const uint8_t* exit, const uint8_t* error, bool tracing)
+        : chunk(function->getChunk()), start(chunk.getCodeStart()), sharedExit(exit), sharedError(error),
+          tracing(tracing) {}
+
+    bool run(NativeCode& native);
+    size_t codeSize() const { return as.position(); }
+    int getInterpreted() const { return interpreted; }
+};
+
+template <typename F>
+uint64_t address(F* pointer) {
+    return reinterpret_cast<uint64_t>(pointer);
+}
+
+template <typename F>
+const void* helper(F* function) {
+    return reinterpret_cast<const void*>(function);
+}
+
+// CLOSURE is as long as the function it closes over has upvalues.
+int CodeGenerator::length(int offset) {
+    switch (normalize(OpCode(start[offset]))) {
+        case OpCode::CONSTANT:
+        case OpCode::GET_LOCAL:
+        case OpCode::SET_LOCAL:
+        case OpCode::GET_UPVALUE:
+        case OpCode::SET_UPVALUE:
+        case OpCode::CALL:
+        case OpCode::TAIL_CALL:
+        case OpCode::CLASS:
+            return 2;
+        case OpCode::GET_GLOBAL_SLOT:
+        case OpCode::DEFINE_GLOBAL_SLOT:
+        case OpCode::SET_GLOBAL_SLOT:
+        case OpCode::GET_SUPER:
+        case OpCode::GET_SUPER_IN_FRAME:
+        case OpCode::JUMP:
+        case OpCode::JUMP_IF_FALSE:
+        case OpCode::LOOP:
+        case OpCode::METHOD:
+            return 3;
+        case OpCode::GET_PROPERTY:
+        case OpCode::SET_PROPERTY:
+        case OpCode::GET_PROPERTY_IN_FRAME:
+        case OpCode::SUPER_INVOKE:
+            return 4;
+        case OpCode::INVOKE:
+        case OpCode::TAIL_INVOKE:
+            return 5;
+        case OpCode::CLOSURE: {
+            auto function = chunk.getConstant(start[offset + 1]).as<FunctionObject>();
+            return 2 + 2 * function->getUpvalueCount();
+        }
+        default:
+            return 1;
+    }
+}
+
+void CodeGenerator::call(const void* helper, std::initializer_list<uint64_t> arguments) {
+    static constexpr Reg registers[] = { RSI, RDX, RCX, R8, R9 };
+
+    as.store(STATE, offsetof(JitState, top), TOP);
+    as.mov(RDI, STATE);
+    auto reg = registers;
+    for (auto argument : arguments) as.movImmediate(*reg++, argument);
+    indirects.push_back({ as.callIndirect(), helper });
+    as.load(TOP, STATE, offsetof(JitState, top));
+}
+
+// `slowPath` is for operands that are not both numbers.
+void CodeGenerator::arithmetic(const uint8_t* ip, uint8_t opcode, const void* slowPath) {
+    as.load(RAX, TOP, -2 * VALUE_SIZE);
+    as.load(RDX, TOP, -VALUE_SIZE);
+    auto aNotNumber = jumpIfNotNumber(RAX);
+    auto bNotNumber = jumpIfNotNumber(RDX);
+    as.movq(XMM0, RAX);
+    as.movq(XMM1, RDX);
+    as.arithmetic(opcode, XMM0, XMM1);
+    as.movq(RAX, XMM0);
+    replaceTwo(RAX);
+
+    this->slowPath({ aNotNumber, bNotNumber }, [this, ip, slowPath](size_t back) {
+        callChecked(slowPath, { address(ip + 1) });
+        jumpBack(back);
+    });
+}
+
+// GREATER, or LESS, which is GREATER with its operands the other way round.
+void CodeGenerator::comparison(const uint8_t* ip, bool less) {
+    as.load(RAX, TOP, -2 * VALUE_SIZE);
+    as.load(RDX, TOP, -VALUE_SIZE);
+    auto aNotNumber = jumpIfNotNumber(RAX);
+    auto bNotNumber = jumpIfNotNumber(RDX);
+    as.movq(less ? XMM1 : XMM0, RAX);
+    as.movq(less ? XMM0 : XMM1, RDX);
+    as.ucomisd(XMM0, XMM1);
+    as.setcc(Condition::ABOVE, RAX);
+    boolean();
+    replaceTwo(RAX);
+
+    slowPath({ aNotNumber, bNotNumber }, [this, ip](size_t) {
+        fail(helper(JitRuntime::operandsNotNumbers), { address(ip + 1) });
+    });
+}
+
+// Numbers inline, so that NaN is not equal to itself. Any other two values
+// with the same bits are the same, and only those that differ need the
+// helper, which knows when they are still equal.
+void CodeGenerator::equal() {
+    as.load(RAX, TOP, -2 * VALUE_SIZE);
+    as.load(RDX, TOP, -VALUE_SIZE);
+    auto aNotNumber = jumpIfNotNumber(RAX);
+    auto bNotNumber = jumpIfNotNumber(RDX);
+    as.movq(XMM0, RAX);
+    as.movq(XMM1, RDX);
+    as.ucomisd(XMM0, XMM1);
+    as.setcc(Condition::EQUAL, RAX);
+    as.setcc(Condition::NOT_PARITY, RCX);
+    as.and8(RAX, RCX);
+    auto result = as.position();
+    boolean();
+    replaceTwo(RAX);
+
+    slowPath({ aNotNumber, bNotNumber }, [this, result](size_t back) {
+        as.cmp(RAX, RDX);
+        as.setcc(Condition::EQUAL, RAX);
+        as.patch(as.jump(Condition::EQUAL), result);
+        call(helper(JitRuntime::equal), {});
+        jumpBack(back);
+    });
+}
+
+// A hit in the first entry of the inline cache on a field is handled
+// inline, leaving the instance's address in RAX and the field's slot in
+// RCX. Fields that are not kept in the instance itself are found by a
+// helper that does not need the JitState. Everything else goes to the
+// helper for the instruction.
+void CodeGenerator::getProperty(const uint8_t* ip, bool inFrame) {
+    auto name = chunk.getConstant(ip[1]).as<StringObject>();
+    auto cache = chunk.getCaches() + shortAt(static_cast<int>(ip - start) + 2);
+
+    as.load(RAX, TOP, -VALUE_SIZE);
+    auto notObject = jumpIfObject(RAX, false);
+    untag(RAX);
+    as.cmp8(RAX, JitLayout::OBJ_TYPE, static_cast<uint8_t>(ObjType::INSTANCE));
+    auto notInstance = as.jump(Condition::NOT_EQUAL);
+    as.movImmediate(RDX, address(cache));
+    as.cmp8(RDX, offsetof(InlineCache, count), 0);
+    auto empty = as.jump(Condition::EQUAL);
+    as.load(RCX, RAX, JitLayout::INSTANCE_SHAPE);
+    as.cmp(RCX, RDX, offsetof(InlineCache::Entry, shape));
+    auto miss = as.jump(Condition::NOT_EQUAL);
+    as.load32(RCX, RDX, offsetof(InlineCache::Entry, slot));
+    as.cmpImmediate(RCX, INSTANCE_INLINE_FIELDS);
+    auto notInline = as.jump(Condition::ABOVE_OR_EQUAL);
+    as.load(RAX, RAX, RCX, JitLayout::INSTANCE_FIELDS);
+    auto found = as.position();
+    as.store(TOP, -VALUE_SIZE, RAX);
+    as.load(RCX, STATE, offsetof(JitState, cacheHits));
+    as.increment(RCX, 0);
+
+    slowPath({ notInline }, [=](size_t back) {
+        as.test(RCX);
+        auto method = as.jump(Condition::SIGN);
+        as.mov(RDI, RAX);
+        as.mov(RSI, RCX);
+        indirects.push_back({ as.callIndirect(), helper(JitRuntime::field) });
+        as.load(RAX, RAX, 0);
+        as.patch(as.jump(), found);
+
+        for (auto jump : { notObject, notInstance, empty, miss, method }) as.bind(jump);
+        callChecked(helper(JitRuntime::getProperty),
+                    { address(ip + 1), address(name), address(cache), inFrame });
+        jumpBack(back);
+    });
+}
+
+// The same for storing a value that is not an object into a field the
+// instance already has, which needs no write barrier.
+void CodeGenerator::setProperty(const uint8_t* ip) {
+    auto name = chunk.getConstant(ip[1]).as<StringObject>();
+    auto cache = chunk.getCaches() + shortAt(static_cast<int>(ip - start) + 2);
+
+    as.load(RAX, TOP, -2 * VALUE_SIZE);
+    as.load(R8, TOP, -VALUE_SIZE);
+    auto valueObject = jumpIfObject(R8, true);
+    auto notObject = jumpIfObject(RAX, false);
+    untag(RAX);
+    as.cmp8(RAX, JitLayout::OBJ_TYPE, static_cast<uint8_t>(ObjType::INSTANCE));
+    auto notInstance = as.jump(Condition::NOT_EQUAL);
+    as.movImmediate(RDX, address(cache));
+    as.cmp8(RDX, offsetof(InlineCache, count), 0);
+    auto empty = as.jump(Condition::EQUAL);
+    as.load(RCX, RAX, JitLayout::INSTANCE_SHAPE);
+    as.cmp(RCX, RDX, offsetof(InlineCache::Entry, shape));
+    auto miss = as.jump(Condition::NOT_EQUAL);
+    as.load(RCX, RDX, offsetof(InlineCache::Entry, transition));
+    as.test(RCX);
+    auto transition = as.jump(Condition::NOT_EQUAL);
+    as.load32(RCX, RDX, offsetof(InlineCache::Entry, slot));
+    as.cmpImmediate(RCX, INSTANCE_INLINE_FIELDS);
+    auto notInline = as.jump(Condition::ABOVE_OR_EQUAL);
+    as.store(RAX, RCX, JitLayout::INSTANCE_FIELDS, R8);
+    auto stored = as.position();
+    replaceTwo(R8);
+    as.load(RCX, STATE, offsetof(JitState, cacheHits));
+    as.increment(RCX, 0);
+
+    slowPath({ notInline }, [=](size_t back) {
+        as.mov(RDI, RAX);
+        as.mov(RSI, RCX);
+        indirects.push_back({ as.callIndirect(), helper(JitRuntime::field) });
+        as.load(R8, TOP, -VALUE_SIZE);
+        as.store(RAX, 0, R8);
+        as.patch(as.jump(), stored);
+
+        for (auto jump : { valueObject, notObject, notInstance, empty, miss, transition }) as.bind(jump);
+        callChecked(helper(JitRuntime::setProperty), { address(ip + 1), address(name), address(cache) });
+        jumpBack(back);
+    });
+}
+
+// Only calls the helper for the safepoint when the heap has work to do.
+// With tracing on, goes to the loop's trace if it has one, and otherwise
+// counts the iteration and has the loop traced once it is hot.
+void CodeGenerator::loop(const uint8_t* ip, int target) {
+    auto due = safepointDue();
+    if (tracing) {
+        auto loop = &native->loops.emplace_back();
+        as.movImmediate(RCX, address(loop));
+        as.load(RDX, RCX, JitLayout::LOOP_ENTRY);
+        as.test(RDX);
+        auto traced = as.jump(Condition::NOT_EQUAL);
+        as.increment(RCX, JitLayout::LOOP_COUNT);
+        as.load(RAX, RCX, JitLayout::LOOP_COUNT);
+        as.cmpImmediate(RAX, JIT_TRACE_THRESHOLD);
+        auto hot = as.jump(Condition::EQUAL);
+        jumpTo(target);
+
+        slowPath({ traced }, [=](size_t) { as.jump(RDX); });
+        slowPath({ hot }, [=](size_t) { transfer(helper(JitRuntime::record), { address(ip), address(loop) }); });
+    } else {
+        jumpTo(target);
+    }
+
+    slowPath({ due[0], due[1] }, [=](size_t) {
+        callChecked(helper(JitRuntime::loop), { address(ip + 1) });
+        jumpTo(target);
+    });
+}
+
+// Jumps if the heap has work to do at a safepoint. Clobbers RCX and RDX.
+std::vector<size_t> CodeGenerator::safepointDue() {
+    as.load(RCX, STATE, offsetof(JitState, safepoint) + offsetof(Heap::SafepointTrigger, pending));
+    as.cmp8(RCX, 0, 0);
+    auto pending = as.jump(Condition::NOT_EQUAL);
+    as.load(RCX, STATE, offsetof(JitState, safepoint) + offsetof(Heap::SafepointTrigger, bytes));
+    as.load(RCX, RCX, 0);
+    as.load(RDX, STATE, offsetof(JitState, safepoint) + offsetof(Heap::SafepointTrigger, limit));
+    as.cmp(RCX, RDX, 0);
+    auto over = as.jump(Condition::ABOVE);
+    return { pending, over };
+}
+
+// Calls the closure whose address is in RAX the way `VM::call` does, but
+// without leaving native code: pushes its frame and jumps to its native
+// code, which returns to `next` in this one. Returns the jumps it takes when
+// it cannot, because the heap has work to do, the closure has no native code
+// or takes a different number of arguments, or there is no room for
+// another frame or for the slots it can fill.
+std::vector<size_t> CodeGenerator::callNative(const uint8_t* next, int argCount, bool cacheHit, bool tail) {
+    auto due = safepointDue();
+    as.load(RDX, RAX, JitLayout::CLOSURE_FUNCTION);
+    as.cmp32(RDX, JitLayout::FUNCTION_ARITY, argCount);
+    auto arity = as.jump(Condition::NOT_EQUAL);
+    as.load32(RCX, RDX, JitLayout::FUNCTION_STACK_SIZE);
+    as.shift(4, RCX, 3);
+    if (tail) {
+        as.add(RCX, SLOTS);
+    } else {
+        as.add(RCX, TOP);
+        as.subImmediate(RCX, (argCount + 1) * VALUE_SIZE);
+    }
+    as.cmp(RCX, STATE, offsetof(JitState, stackLimit));
+    auto full = as.jump(Condition::ABOVE);
+    as.load(RDX, RDX, JitLayout::FUNCTION_ENTRY);
+    as.test(RDX);
+    auto notNative = as.jump(Condition::EQUAL);
+    as.load(R8, STATE, offsetof(JitState, frames));
+    as.load(R9, R8, JitLayout::CALL_STACK_TOP);
+
+    constexpr auto frameSize = static_cast<int32_t>(sizeof(CallFrame));
+    if (tail) {
+        // The callee takes over the running frame, as long as no upvalues
+        // are open over its slots, like a return and a call in one.
+        as.load(RCX, STATE, offsetof(JitState, openUpvalues));
+        as.load(RCX, RCX, 0);
+        as.test(RCX);
+        auto closed = as.jump(Condition::EQUAL);
+        as.cmp(SLOTS, RCX, JitLayout::UPVALUE_LOCATION);
+        auto open = as.jump(Condition::BELOW_OR_EQUAL);
+        as.bind(closed);
+
+        as.store(R9, static_cast<int32_t>(offsetof(CallFrame, closure)) - frameSize, RAX);
+        for (auto slot = 0; slot <= argCount; slot++) {
+            as.load(RCX, TOP, (slot - argCount - 1) * VALUE_SIZE);
+            as.store(SLOTS, slot * VALUE_SIZE, RCX);
+        }
+        as.lea(TOP, SLOTS, (argCount + 1) * VALUE_SIZE);
+        if (cacheHit) {
+            as.load(RCX, STATE, offsetof(JitState, cacheHits));
+            as.increment(RCX, 0);
+        }
+        as.jump(RDX);
+        return { due[0], due[1], arity, full, notNative, open };
+    }
+
+    as.cmp(R9, R8, JitLayout::CALL_STACK_LIMIT);
+    auto overflow = as.jump(Condition::EQUAL);
+    as.movImmediate(RCX, address(next));
+    as.store(R9, static_cast<int32_t>(offsetof(CallFrame, ip)) - frameSize, RCX);
+    as.store(R9, offsetof(CallFrame, closure), RAX);
+    as.lea(R10, TOP, -(argCount + 1) * VALUE_SIZE);
+    as.mov(RCX, R10);
+    as.load(R11, STATE, offsetof(JitState, stack));
+    as.sub(RCX, R11);
+    as.shift(5, RCX, 3);
+    as.store(R9, offsetof(CallFrame, stackOffset), RCX);
+    jumps.push_back({ as.leaRip(RCX), static_cast<int>(next - start) });
+    as.store(R9, offsetof(CallFrame, nativeReturn), RCX);
+    as.addImmediate(R9, frameSize);
+    as.store(R8, JitLayout::CALL_STACK_TOP, R9);
+    if (cacheHit) {
+        as.load(RCX, STATE, offsetof(JitState, cacheHits));
+        as.increment(RCX, 0);
+    }
+    as.mov(SLOTS, R10);
+    as.jump(RDX);
+    return { due[0], due[1], arity, full, notNative, overflow };
+}
+
+void CodeGenerator::callValue(const uint8_t* ip, bool tail) {
+    auto argCount = ip[1];
+    as.load(RAX, TOP, -(argCount + 1) * VALUE_SIZE);
+    auto notObject = jumpIfObject(RAX, false);
+    untag(RAX);
+    as.cmp8(RAX, JitLayout::OBJ_TYPE, static_cast<uint8_t>(ObjType::CLOSURE));
+    auto notClosure = as.jump(Condition::NOT_EQUAL);
+    auto slow = callNative(ip + 2, argCount, false, tail);
+    slow.push_back(notObject);
+
+    slowPath(slow, [=](size_t) { transfer(helper(JitRuntime::call), { address(ip + 2), argCount, tail }); });
+
+    // A pure native function is called right here, with its result left in
+    // the callee's slot, and the code goes on after the call.
+    slowPath({ notClosure }, [=](size_t back) {
+        as.cmp8(RAX, JitLayout::OBJ_TYPE, static_cast<uint8_t>(ObjType::NATIVE));
+        auto notNative = as.jump(Condition::NOT_EQUAL);
+        as.cmp32(RAX, JitLayout::NATIVE_ARITY, argCount);
+        auto arity = as.jump(Condition::NOT_EQUAL);
+        as.cmp8(RAX, JitLayout::NATIVE_IS_PURE, 0);
+        auto impure = as.jump(Condition::EQUAL);
+        as.mov(RDI, RAX);
+        as.lea(RSI, TOP, -argCount * VALUE_SIZE);
+        indirects.push_back({ as.callIndirect(), helper(JitRuntime::callPure) });
+        as.lea(TOP, TOP, -argCount * VALUE_SIZE);
+        jumpBack(back);
+
+        for (auto jump : { notNative, arity, impure }) as.bind(jump);
+        transfer(helper(JitRuntime::call), { address(ip + 2), argCount, tail });
+    });
+}
+
+// Calls the method in the first entry of the inline cache natively when
+// the receiver is an instance it has the shape of.
+void CodeGenerator::invoke(const uint8_t* ip, bool tail) {
+    auto name = chunk.getConstant(ip[1]).as<StringObject>();
+    auto argCount = ip[2];
+    auto cache = chunk.getCaches() + shortAt(static_cast<int>(ip - start) + 3);
+
+    as.load(RAX, TOP, -(argCount + 1) * VALUE_SIZE);
+    auto notObject = jumpIfObject(RAX, false);
+    untag(RAX);
+    as.cmp8(RAX, JitLayout::OBJ_TYPE, static_cast<uint8_t>(ObjType::INSTANCE));
+    auto notInstance = as.jump(Condition::NOT_EQUAL);
+    as.movImmediate(RDX, address(cache));
+    as.cmp8(RDX, offsetof(InlineCache, count), 0);
+    auto empty = as.jump(Condition::EQUAL);
+    as.load(RCX, RAX, JitLayout::INSTANCE_SHAPE);
+    as.cmp(RCX, RDX, offsetof(InlineCache::Entry, shape));
+    auto miss = as.jump(Condition::NOT_EQUAL);
+    as.load(RAX, RDX, offsetof(InlineCache::Entry, method));
+    as.test(RAX);
+    auto field = as.jump(Condition::EQUAL);
+    auto slow = callNative(ip + 5, argCount, true, tail);
+    for (auto jump : { notObject, notInstance, empty, miss, field }) slow.push_back(jump);
+
+    slowPath(slow, [=](size_t) {
+        transfer(helper(JitRuntime::invoke), { address(ip + 5), address(name), argCount, address(cache), tail });
+    });
+}
+
+// Calls the superclass's method natively. The superclass is known to be a
+// class, and its method table does not change once code can run, so all
+// that can go wrong is that the method is not there.
+void CodeGenerator::superInvoke(const uint8_t* ip) {
+    auto selector = shortAt(static_cast<int>(ip - start) + 1);
+    auto argCount = ip[3];
+
+    as.load(RDI, TOP, -VALUE_SIZE);
+    untag(RDI);
+    as.movImmediate(RSI, selector);
+    indirects.push_back({ as.callIndirect(), helper(JitRuntime::superMethod) });
+    as.test(RAX);
+    auto missing = as.jump(Condition::EQUAL);
+    as.subImmediate(TOP, VALUE_SIZE);
+    auto slow = callNative(ip + 4, argCount, false, false);
+
+    slowPath(slow, [=](size_t) {
+        // Puts the superclass back, which nothing has overwritten yet.
+        as.addImmediate(TOP, VALUE_SIZE);
+        as.bind(missing);
+        transfer(helper(JitRuntime::superInvoke), { address(ip + 4), selector, argCount });
+    });
+}
+
+// Returns natively to a caller that called natively, when no upvalues are
+// open over the returning frame's slots.
+void CodeGenerator::ret(const uint8_t* ip) {
+    constexpr auto frameSize = static_cast<int32_t>(sizeof(CallFrame));
+    as.load(R8, STATE, offsetof(JitState, frames));
+    as.load(R9, R8, JitLayout::CALL_STACK_TOP);
+    as.load(RDX, R9, static_cast<int32_t>(offsetof(CallFrame, nativeReturn)) - frameSize);
+    as.test(RDX);
+    auto notNative = as.jump(Condition::EQUAL);
+    as.load(RCX, STATE, offsetof(JitState, openUpvalues));
+    as.load(RCX, RCX, 0);
+    as.test(RCX);
+    auto closed = as.jump(Condition::EQUAL);
+    as.cmp(SLOTS, RCX, JitLayout::UPVALUE_LOCATION);
+    auto open = as.jump(Condition::BELOW_OR_EQUAL);
+    as.bind(closed);
+
+    as.load(RAX, TOP, -VALUE_SIZE);
+    as.store(SLOTS, 0, RAX);
+    as.lea(TOP, SLOTS, VALUE_SIZE);
+    as.subImmediate(R9, frameSize);
+    as.store(R8, JitLayout::CALL_STACK_TOP, R9);
+    as.load(SLOTS, R9, static_cast<int32_t>(offsetof(CallFrame, stackOffset)) - frameSize);
+    as.shift(4, SLOTS, 3);
+    as.load(RCX, STATE, offsetof(JitState, stack));
+    as.add(SLOTS, RCX);
+    as.jump(RDX);
+
+    slowPath({ notNative, open }, [=](size_t) { transfer(helper(JitRuntime::ret), { address(ip) }); });
+}
+
+void CodeGenerator::instruction(int offset) {
+    auto ip = start + offset;
+    auto after = address(ip + 1);
+    auto op = normalize(OpCode(*ip));
+    switch (op) {
+        case OpCode::CONSTANT:
+            as.movImmediate(RAX, JitLayout::of(chunk.getConstant(ip[1])));
+            push(RAX);
+            break;
+        case OpCode::NIL: push(NIL); break;
+        case OpCode::TRUE:
+            as.lea(RAX, NIL, static_cast<int32_t>(JitLayout::TRUE - JitLayout::NIL));
+            push(RAX);
+            break;
+        case OpCode::FALSE:
+            as.lea(RAX, NIL, static_cast<int32_t>(JitLayout::FALSE - JitLayout::NIL));
+            push(RAX);
+            break;
+        case OpCode::POP: as.subImmediate(TOP, VALUE_SIZE); break;
+
+        case OpCode::GET_LOCAL:
+            as.load(RAX, SLOTS, ip[1] * VALUE_SIZE);
+            push(RAX);
+            break;
+        case OpCode::SET_LOCAL:
+            as.load(RAX, TOP, -VALUE_SIZE);
+            as.store(SLOTS, ip[1] * VALUE_SIZE, RAX);
+            break;
+
+        case OpCode::GET_GLOBAL_SLOT: {
+            auto slot = shortAt(offset + 1);
+            as.load(RAX, STATE, offsetof(JitState, globals));
+            as.load(RAX, RAX, slot * VALUE_SIZE);
+            as.lea(RCX, NIL, static_cast<int32_t>(JitLayout::UNDEFINED - JitLayout::NIL));
+            as.cmp(RAX, RCX);
+            auto undefined = as.jump(Condition::EQUAL);
+            push(RAX);
+            slowPath({ undefined }, [this, after, slot](size_t) {
+                fail(helper(JitRuntime::undefinedVariable), { after, slot });
+            });
+            break;
+        }
+        case OpCode::DEFINE_GLOBAL_SLOT:
+            call(helper(JitRuntime::defineGlobal), { shortAt(offset + 1) });
+            break;
+        case OpCode::SET_GLOBAL_SLOT:
+            callChecked(helper(JitRuntime::setGlobal), { after, shortAt(offset + 1) });
+            break;
+        case OpCode::GET_UPVALUE:
+            call(helper(JitRuntime::getUpvalue), { ip[1] });
+            break;
+        case OpCode::SET_UPVALUE:
+            call(helper(JitRuntime::setUpvalue), { ip[1] });
+            break;
+
+        case OpCode::GET_PROPERTY: getProperty(ip, false); break;
+        case OpCode::GET_PROPERTY_IN_FRAME: getProperty(ip, true); break;
+        case OpCode::SET_PROPERTY: setProperty(ip); break;
+        case OpCode::GET_SUPER:
+        case OpCode::GET_SUPER_IN_FRAME:
+            callChecked(helper(JitRuntime::getSuper), { after, shortAt(offset + 1), op == OpCode::GET_SUPER_IN_FRAME });
+            break;
+
+        case OpCode::EQUAL: equal(); break;
+        case OpCode::GREATER: comparison(ip, false); break;
+        case OpCode::LESS: comparison(ip, true); break;
+        case OpCode::ADD: arithmetic(ip, 0x58, helper(JitRuntime::add)); break;
+        case OpCode::SUBTRACT: arithmetic(ip, 0x5c, helper(JitRuntime::operandsNotNumbers)); break;
+        case OpCode::MULTIPLY: arithmetic(ip, 0x59, helper(JitRuntime::operandsNotNumbers)); break;
+        case OpCode::DIVIDE: arithmetic(ip, 0x5e, helper(JitRuntime::operandsNotNumbers)); break;
+
+        case OpCode::NOT:
+            as.load(RAX, TOP, -VALUE_SIZE);
+            testFalsey(RAX);
+            as.setcc(Condition::BELOW_OR_EQUAL, RAX);
+            boolean();
+            as.store(TOP, -VALUE_SIZE, RAX);
+            break;
+
+        case OpCode::NEGATE: {
+            as.load(RAX, TOP, -VALUE_SIZE);
+            auto notNumber = jumpIfNotNumber(RAX);
+            as.btc(RAX, 63);
+            as.store(TOP, -VALUE_SIZE, RAX);
+            slowPath({ notNumber }, [this, after](size_t) {
+                fail(helper(JitRuntime::operandNotNumber), { after });
+            });
+            break;
+        }
+
+        case OpCode::PRINT:
+            call(helper(JitRuntime::print), {});
+            break;
+
+        case OpCode::JUMP:
+            jumpTo(offset + 3 + shortAt(offset + 1));
+            break;
+        case OpCode::JUMP_IF_FALSE:
+            as.load(RAX, TOP, -VALUE_SIZE);
+            testFalsey(RAX);
+            jumpTo(Condition::BELOW_OR_EQUAL, offset + 3 + shortAt(offset + 1));
+            break;
+        case OpCode::LOOP: loop(ip, offset + 3 - shortAt(offset + 1)); break;
+
+        case OpCode::CLOSURE: {
+            auto function = chunk.getConstant(ip[1]).as<FunctionObject>();
+            call(helper(JitRuntime::closure), { address(function), address(ip + 2) });
+            break;
+        }
+        case OpCode::CLOSE_UPVALUE:
+            call(helper(JitRuntime::closeUpvalue), {});
+            break;
+
+        case OpCode::CALL: callValue(ip, false); break;
+        case OpCode::TAIL_CALL: callValue(ip, true); break;
+        case OpCode::INVOKE: invoke(ip, false); break;
+        case OpCode::TAIL_INVOKE: invoke(ip, true); break;
+        case OpCode::SUPER_INVOKE:
+            superInvoke(ip);
+            break;
+        case OpCode::RETURN: ret(ip); break;
+
+        // The instructions of class declarations, which only run once.
+        default:
+            interpret(ip);
+            break;
+    }
+}
+
+bool CodeGenerator::run(NativeCode& native) {
+    this->native = &native;
+    auto count = chunk.count();
+    offsets.assign(count, NATIVE_NO_OFFSET);
+
+    // The way out, for the jumps to EXIT and ERROR.
+    auto exit = as.position();
+    indirects.push_back({ as.jumpIndirect(), sharedExit });
+    auto error = as.position();
+    indirects.push_back({ as.jumpIndirect(), sharedError });
+
+    for (auto offset = 0; offset < count; offset += length(offset)) {
+        offsets[offset] = static_cast<uint32_t>(as.position());
+        instruction(offset);
+    }
+    for (auto& path : slowPaths) path();
+
+    for (auto& jump : jumps) {
+        if (jump.target == ERROR) {
+            as.patch(jump.at, error);
+        } else if (jump.target == EXIT) {
+            as.patch(jump.at, exit);
+        } else if (jump.target >= count || offsets[jump.target] == NATIVE_NO_OFFSET) {
+            return false;
+        } else {
+            as.patch(jump.at, offsets[jump.target]);
+        }
+    }
+
+    as.table(indirects);
+    if (!mapCode(as, native)) return false;
+    native.offsets.assign(offsets.begin(), offsets.end());
+    return true;
+}
+
+}
+
+void Jit::setEnabled(bool enabled) {
+    this->enabled = enabled;
+}
+
+bool Jit::compile(FunctionObject* function) {
+    if (function->native != nullptr) return true;
+
+    if (stubs.code == nullptr) {
+        Assembler as;
+        auto offsets = assembleStubs(as);
+        if (!mapCode(as, stubs)) return false;
+        exitStub = stubs.code + offsets.exit;
+        state.leave = stubs.code + offsets.leave;
+        errorStub = stubs.code + offsets.error;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto native = std::make_unique<NativeCode>();
+    CodeGenerator generator(function, exitStub, errorStub, tracing);
+    if (!generator.run(*native)) return false;
+    function->nativeEntry = native->code + native->offsets[0];
+
+    auto time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    stats.push_back({ std::string(function->getName()), static_cast<size_t>(function->chunk.count()),
+                      generator.codeSize(), function->hotness, generator.getInterpreted(), time });
+    function->native = std::move(native);
+    return true;
+}
+
+bool Jit::run() {
+    auto& frame = vm.frames.back();
+    auto function = frame.closure->function;
+    auto native = function->native.get();
+    auto offset = native->offsets[frame.ip - function->chunk.getCodeStart()];
+    if (offset == NATIVE_NO_OFFSET) return true;
+
+    state.top = vm.stack.end();
+    state.globals = vm.globals.values.data();
+    state.frames = &vm.frames;
+    state.stack = vm.stack.begin();
+    state.stackLimit = vm.stack.begin() + vm.stack.getCapacity();
+    state.openUpvalues = &vm.openUpvalues;
+    state.cacheHits = &vm.cacheStats.hits;
+    state.safepoint = vm.heap.safepointTrigger();
+    auto entry = reinterpret_cast<Entry>(stubs.code);
+    if (!entry(&state, &vm.stack[frame.stackOffset], native->code + offset)) return false;
+
+    vm.stack.truncate(static_cast<size_t>(state.top - vm.stack.begin()));
+    vm.frames.back().ip = state.ip;
+    return true;
+}
+
+#endif
@@ -0,0 +1,157 @@
+//
+//  jit.hpp
+//  cloxpp
+//
+
+#ifndef jit_hpp
+#define jit_hpp
+
+#include "common.hpp"
+#include "memory.hpp"
+#include "stack.hpp"
+#include "value.hpp"
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// How many calls and loop iterations a function gets in the interpreter
+// before the JIT compiles it.
+#define JIT_THRESHOLD 1000
+
+// How many times a loop in native code goes around before the JIT records
+// a trace of it, and how many recordings of one loop can fail before it
+// stops trying.
+#define JIT_TRACE_THRESHOLD 50
+#define JIT_TRACE_ATTEMPTS 3
+// The longest trace the JIT records, in instructions.
+#define JIT_TRACE_LENGTH_MAX 500
+
+// What native code keeps in a register while it runs. It holds the running
+// frame's slots and the top of the stack in two more, and writes the top
+// here before it calls back into the VM or leaves.
+struct JitState {
+    VM* vm;
+    Value* top;
+    Value* slots;
+    // Where the values of the globals are. They only move when the compiler
+    // adds one, never while native code runs.
+    Value* globals;
+    // Where in its chunk the running frame goes on in the interpreter, once
+    // native code has left.
+    uint8_t* ip;
+    // Where a helper sends native code to leave once `ip` is set.
+    const uint8_t* leave;
+    // What native code needs to call and return without the VM: the VM's
+    // frames, the bottom and the end of its stack, and its open upvalues.
+    CallStack* frames;
+    Value* stack;
+    Value* stackLimit;
+    UpvalueValue* openUpvalues;
+    // For native code to count the inline cache hits it takes itself.
+    size_t* cacheHits;
+    Heap::SafepointTrigger safepoint;
+};
+
+// One function the JIT has compiled.
+struct JitStats {
+    std::string name;
+    size_t bytecodeSize;
+    size_t nativeSize;
+    uint32_t hotness;
+    // Instructions it leaves to the interpreter, calls and returns included.
+    int interpreted;
+    std::chrono::microseconds time;
+};
+
+// One trace the JIT has compiled.
+struct TraceStats {
+    std::string function;
+    // Of the loop's first instruction.
+    int line;
+    // In instructions.
+    int length;
+    size_t nativeSize;
+    std::chrono::microseconds time;
+    // How many times the trace has left at a guard. The trace counts them
+    // itself.
+    uint64_t exits = 0;
+};
+
+// A baseline compiler from a function's stack bytecode to x86-64. Each
+// instruction becomes a fixed template of machine code that works on the
+// same stack slots the interpreter does, with the common case of arithmetic,
+// comparisons, jumps and inline cache hits inline and everything else
+// (globals that go through barriers, allocation, cache misses) a call to a
+// helper.
+//
+// Calls of closures that have native code, and returns to native code, push
+// and pop the frame inline and jump straight there. Other calls and returns
+// go through helpers, which carry on in the native code of the function
+// that runs next if it has any. Only when that function has none, and at
+// the instructions of class declarations, which run once anyway, does
+// native code hand over to the interpreter, which goes back into native
+// code when it next loads a frame or loops. Since every instruction boundary is a way back in, a function
+// can start running natively in the middle of a loop.
+//
+// Loops in native code count their iterations, and once one gets hot the
+// JIT records a trace of it: it runs the loop's instructions itself, from
+// where the loop starts until it gets back there, noting the types it sees
+// and the way each branch goes. Only numbers, booleans and nil can be on a
+// trace, and nothing that calls or allocates, so a recording that runs into
+// anything else stops there and native code goes on from that instruction.
+// A trace that makes it around is compiled to code that keeps the numbers
+// it works on unboxed in registers, with guards where the types or the
+// branches could turn out differently. A guard that fails writes the
+// trace's state back to the stack and leaves for the native code of the
+// instruction the trace was at.
+class Jit {
+    VM& vm;
+    JitState state;
+    // Entering and leaving native code, shared by every function.
+    NativeCode stubs;
+    const uint8_t* exitStub = nullptr;
+    const uint8_t* errorStub = nullptr;
+    bool enabled = false;
+    bool tracing = true;
+    uint32_t threshold = JIT_THRESHOLD;
+    std::vector<JitStats> stats;
+    // A deque because traces count their exits in place.
+    std::deque<TraceStats> traceStats;
+    size_t traceAborts = 0;
+
+public:
+    explicit Jit(VM& vm): vm(vm), state() { state.vm = &vm; }
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    // Only does anything in builds that have a JIT.
+    void setEnabled(bool enabled);
+    void setThreshold(uint32_t threshold) { this->threshold = threshold; }
+    // Only affects functions compiled from then on.
+    void setTracing(bool tracing) { this->tracing = tracing; }
+
+    // Called every time `function` is called or goes around a loop.
+    void countUse(FunctionObject* function) {
+        if (enabled && ++function->hotness == threshold) compile(function);
+    }
+    bool compile(FunctionObject* function);
+
+    // Runs the top frame natively from its ip on, for as long as there is
+    // native code to run. Leaves the frame that is running by then with its
+    // ip on where the interpreter is to go on. Returns false if it ran into
+    // a runtime error.
+    bool run();
+
+    // Records and compiles a trace of the loop whose LOOP instruction `ip`
+    // is on, in the running frame, which is at the loop's start. Leaves the
+    // frame wherever the recording stopped, and returns where its native
+    // code goes on from there: the trace, or the function's own.
+    const uint8_t* recordTrace(NativeLoop& loop, const uint8_t* ip);
+
+    void printStats(std::ostream& os) const;
+};
+
+#endif /* jit_hpp */
@@ -6,6 +6,8 @@
 //  Copyright © 2018 Ahmad Alhashemi. All rights reserved.
 //
 
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include "common.hpp"
 #include "value.hpp"
@@ -40,34 +42,115 @@ static std::string readFile(const std::string& path) {
     return str;
 }
 
-static void runFile(VM& vm, const std::string& path) {
+static int runFile(VM& vm, const std::string& path) {
     auto source = readFile(path);
     auto result = vm.interpret(source);
     
     switch (result) {
-        case InterpretResult::OK: break;
-        case InterpretResult::COMPILE_ERROR: exit(65);
-        case InterpretResult::RUNTIME_ERROR: exit(70);
+        case InterpretResult::OK: return 0;
+        case InterpretResult::COMPILE_ERROR: return 65;
+        case InterpretResult::RUNTIME_ERROR: return 70;
     }
+    return 0;
 }
 
 static void runCommand(VM& vm, const std::string& command) {
     vm.interpret(command);
 }
 
+static void usage() {
+    std::cerr << "Usage: cloxpp [options] [path]" << std::endl;
+    std::cerr << "  --gc-pause=<us>         Collect incrementally in pauses of about this long." << std::endl;
+    std::cerr << "  --gc-background-sweep   Sweep on a background thread." << std::endl;
+    std::cerr << "  --gc-stats              Print collection, pause and allocator statistics on exit." << std::endl;
+    std::cerr << "  --cache-stats           Print inline cache hit and miss counts on exit." << std::endl;
+    std::cerr << "  --huge-pages            Back the object pools with transparent huge pages." << std::endl;
+    std::cerr << "  --heap-soft-limit=<n>   Collect fully and warn when the heap grows past n bytes." << std::endl;
+    std::cerr << "  --heap-limit=<n>        Fail with a runtime error when the heap cannot fit in n bytes." << std::endl;
+    std::cerr << "  --max-frames=<n>        Let calls nest n deep before overflowing the stack." << std::endl;
+    std::cerr << "  --registers             Run on the register machine instead of the stack machine, unless" << std::endl;
+    std::cerr << "                          a function needs more registers than it has." << std::endl;
+    std::cerr << "  --instruction-count     Print how many instructions the interpreter dispatched on exit." << std::endl;
+    std::cerr << "                          Code the JIT compiled is not counted; pass --no-jit to count it all." << std::endl;
+    std::cerr << "  --jit, --no-jit         Compile hot functions to machine code, or never (default: --jit)." << std::endl;
+    std::cerr << "  --jit-threshold=<n>     Compile functions once they have been called or looped n times." << std::endl;
+    std::cerr << "  --traces, --no-traces   Compile traces of hot loops in compiled functions, or not (default: --traces)." << std::endl;
+    std::cerr << "  --jit-stats             Print what the JIT compiled on exit." << std::endl;
+    exit(64);
+}
+
 int main(int argc, const char * argv[]) {
     auto vm = VM();
-    
-    if (argc == 1) {
+    auto printGCStats = false;
+    auto printCacheStats = false;
+    auto printInstructionCount = false;
+    auto printJitStats = false;
+
+    auto arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strncmp(argv[arg], "--gc-pause=", 11) == 0) {
+            vm.getHeap().setPauseBudget(std::chrono::microseconds(atol(argv[arg] + 11)));
+        } else if (strcmp(argv[arg], "--gc-background-sweep") == 0) {
+            vm.getHeap().setBackgroundSweep(true);
+        } else if (strcmp(argv[arg], "--gc-stats") == 0) {
+            printGCStats = true;
+        } else if (strcmp(argv[arg], "--cache-stats") == 0) {
+            printCacheStats = true;
+        } else if (strcmp(argv[arg], "--huge-pages") == 0) {
+            vm.getHeap().setHugePages(true);
+        } else if (strncmp(argv[arg], "--heap-soft-limit=", 18) == 0) {
+            vm.getHeap().setSoftLimit(strtoull(argv[arg] + 18, nullptr, 10), [](size_t bytes) {
+                std::cerr << "Heap is over its soft limit at " << bytes << " bytes." << std::endl;
+            });
+        } else if (strncmp(argv[arg], "--heap-limit=", 13) == 0) {
+            vm.getHeap().setHardLimit(strtoull(argv[arg] + 13, nullptr, 10));
+        } else if (strncmp(argv[arg], "--max-frames=", 13) == 0) {
+            auto frames = strtoull(argv[arg] + 13, nullptr, 10);
+            if (frames == 0) usage();
+            vm.setMaxFrames(frames);
+        } else if (strcmp(argv[arg], "--registers") == 0) {
+            vm.setBackend(Backend::REGISTERS);
+        } else if (strcmp(argv[arg], "--instruction-count") == 0) {
+            printInstructionCount = true;
+        } else if (strcmp(argv[arg], "--jit") == 0) {
+            vm.setJitEnabled(true);
+        } else if (strcmp(argv[arg], "--no-jit") == 0) {
+            vm.setJitEnabled(false);
+        } else if (strncmp(argv[arg], "--jit-threshold=", 16) == 0) {
+            auto threshold = strtoul(argv[arg] + 16, nullptr, 10);
+            if (threshold == 0 || threshold > UINT32_MAX) usage();
+            vm.setJitThreshold(static_cast<uint32_t>(threshold));
+        } else if (strcmp(argv[arg], "--traces") == 0) {
+            vm.setTracing(true);
+        } else if (strcmp(argv[arg], "--no-traces") == 0) {
+            vm.setTracing(false);
+        } else if (strcmp(argv[arg], "--jit-stats") == 0) {
+            printJitStats = true;
+        } else {
+            usage();
+        }
+    }
+
+    auto status = 0;
+    auto rest = argc - arg;
+    if (rest == 0) {
         repl(vm);
-    } else if (argc == 2) {
-        runFile(vm, argv[1]);
-    } else if (argc == 3 && strcmp(argv[1], "-c") == 0) {
-        runCommand(vm, argv[2]);
+    } else if (rest == 1) {
+        status = runFile(vm, argv[arg]);
+    } else if (rest == 2 && strcmp(argv[arg], "-c") == 0) {
+        runCommand(vm, argv[arg + 1]);
     } else {
-        std::cerr << "Usage: cloxpp [path]" << std::endl;
-        exit(64);
+        usage();
     }
-    
-    return 0;
+
+    if (printGCStats) vm.getHeap().printStats(std::cerr);
+    if (printCacheStats) vm.printCacheStats(std::cerr);
+    if (printInstructionCount) {
+        std::cerr << "instructions: " << vm.getInstructionCount() << std::endl;
+    }
+    if (printJitStats) vm.printJitStats(std::cerr);
+#ifdef DEBUG_PROFILE_OPCODES
+    vm.printOpcodeProfile(std::cerr);
+#endif
+    return status;
 }
@@ -0,0 +1,562 @@
+//
+//  memory.cpp
+//  cloxpp
+//
+
+#include "memory.hpp"
+#include "vm.hpp"
+#include <algorithm>
+
+thread_local HeapUsage* currentHeapUsage = nullptr;
+
+template <typename F>
+void Heap::forEachYoung(F visit) {
+    auto cursor = nursery.get();
+    while (cursor < nurseryTop) {
+        auto object = reinterpret_cast<Obj*>(cursor);
+        switch (object->type) {
+            case ObjType::INSTANCE: cursor += youngSize(sizeof(InstanceObject)); break;
+            case ObjType::BOUND_METHOD: cursor += youngSize(sizeof(BoundMethodObject)); break;
+            default: return; // Only instances and bound methods start young.
+        }
+        visit(object);
+    }
+}
+
+Heap::~Heap() {
+    Scope scope(*this);
+    joinSweeper();
+
+    forEachYoung([](Obj* object) {
+        if (object->type == ObjType::INSTANCE) {
+            static_cast<InstanceObject*>(object)->~InstanceObject();
+        }
+    });
+
+    for (auto list : {objects, unswept}) {
+        auto object = list;
+        while (object != nullptr) {
+            auto next = object->next;
+            freeObject(object, pool);
+            object = next;
+        }
+    }
+}
+
+size_t Heap::sizeOf(Obj* object) {
+    switch (object->type) {
+        case ObjType::STRING: return sizeof(StringObject);
+        case ObjType::FUNCTION: return sizeof(FunctionObject);
+        case ObjType::NATIVE: return sizeof(NativeFunctionObject);
+        case ObjType::CLOSURE: return sizeof(ClosureObject);
+        case ObjType::UPVALUE: return sizeof(UpvalueObject);
+        case ObjType::CLASS: return sizeof(ClassObject);
+        case ObjType::INSTANCE: return sizeof(InstanceObject);
+        case ObjType::BOUND_METHOD: return sizeof(BoundMethodObject);
+    }
+    return 0;
+}
+
+template <typename T, typename Allocator>
+static void destroy(Obj* object, Allocator& allocator) {
+    static_cast<T*>(object)->~T();
+    allocator.free(object, sizeof(T));
+}
+
+template <typename Allocator>
+void Heap::freeObject(Obj* object, Allocator& allocator) {
+#ifdef DEBUG_LOG_GC
+    std::cout << object << " free type " << static_cast<int>(object->type) << std::endl;
+#endif
+
+    switch (object->type) {
+        case ObjType::STRING: destroy<StringObject>(object, allocator); break;
+        case ObjType::FUNCTION: destroy<FunctionObject>(object, allocator); break;
+        case ObjType::NATIVE: destroy<NativeFunctionObject>(object, allocator); break;
+        case ObjType::CLOSURE: destroy<ClosureObject>(object, allocator); break;
+        case ObjType::UPVALUE: destroy<UpvalueObject>(object, allocator); break;
+        case ObjType::CLASS: destroy<ClassObject>(object, allocator); break;
+        case ObjType::INSTANCE: destroy<InstanceObject>(object, allocator); break;
+        case ObjType::BOUND_METHOD: destroy<BoundMethodObject>(object, allocator); break;
+    }
+}
+
+Obj* Heap::promote(Obj* object) {
+    Obj* promoted;
+    switch (object->type) {
+        case ObjType::INSTANCE:
+            promoted = new (pool.allocate(sizeof(InstanceObject))) InstanceObject(std::move(*static_cast<InstanceObject*>(object)));
+            usage.allocated(sizeof(InstanceObject));
+            break;
+        case ObjType::BOUND_METHOD:
+            promoted = new (pool.allocate(sizeof(BoundMethodObject))) BoundMethodObject(std::move(*static_cast<BoundMethodObject*>(object)));
+            usage.allocated(sizeof(BoundMethodObject));
+            break;
+        default:
+            return object; // Only instances and bound methods start young.
+    }
+
+    promoted->next = objects;
+    objects = promoted;
+    survivors.push_back(promoted);
+    return promoted;
+}
+
+void Heap::evacuate(Value& value) {
+    if (!isYoung(value)) return;
+
+    auto object = value.asObj();
+    if (object->next == nullptr) {
+        object->next = promote(object);
+    }
+    value = object->next;
+}
+
+void Heap::scanYoungReferences(Obj* object) {
+    switch (object->type) {
+        case ObjType::INSTANCE:
+            static_cast<InstanceObject*>(object)->forEachField([this](Value& value) { evacuate(value); });
+            break;
+        case ObjType::BOUND_METHOD:
+            evacuate(static_cast<BoundMethodObject*>(object)->receiver);
+            break;
+        case ObjType::UPVALUE:
+            evacuate(static_cast<UpvalueObject*>(object)->closed);
+            break;
+        case ObjType::CLOSURE:
+            for (auto& upvalue : static_cast<ClosureObject*>(object)->upvalues) {
+                evacuate(upvalue);
+            }
+            break;
+        default:
+            break; // Nothing else can point at a young object.
+    }
+}
+
+void Heap::collectYoung() {
+    if (pauseCount > 0) return;
+
+#ifdef DEBUG_LOG_GC
+    std::cout << "-- minor gc begin" << std::endl;
+    auto before = usage.bytes;
+#endif
+
+    vm.evacuateRoots();
+    for (auto& slot : handleSlots) {
+        if (slot.refCount > 0) evacuate(slot.value);
+    }
+    for (auto object : rememberedSet) {
+        object->isRemembered = false;
+        scanYoungReferences(object);
+    }
+    rememberedSet.clear();
+
+    while (!survivors.empty()) {
+        auto object = survivors.back();
+        survivors.pop_back();
+        scanYoungReferences(object);
+    }
+
+    // Gray objects that were promoted are traced at their new address, the
+    // ones that were not are garbage.
+    if (phase == Phase::MARKING) {
+        for (auto& object : grayStack) {
+            if (isYoung(object)) object = object->next;
+        }
+        grayStack.erase(std::remove(grayStack.begin(), grayStack.end(), nullptr), grayStack.end());
+    }
+
+    // Whatever was not promoted is garbage. Promoted instances were moved
+    // out of, so destroying them frees nothing twice.
+    forEachYoung([](Obj* object) {
+        if (object->type == ObjType::INSTANCE) {
+            static_cast<InstanceObject*>(object)->~InstanceObject();
+        }
+    });
+    nurseryTop = nursery.get();
+    youngCollectionPending = false;
+    stats.minorCollections++;
+
+#ifdef DEBUG_LOG_GC
+    std::cout << "-- minor gc end" << std::endl;
+    std::cout << "   heap went from " << before << " to " << usage.bytes << " bytes" << std::endl;
+#endif
+}
+
+bool Heap::collect() {
+    if (pauseCount > 0) return true;
+
+    auto start = Clock::now();
+    if (youngCollectionPending) collectYoung();
+
+    // The pause budget is for the major collection; a minor one always runs
+    // to the end and should not eat into it.
+    auto deadline = pauseBudget.count() > 0 ? Clock::now() + pauseBudget : Clock::time_point::max();
+
+#ifdef DEBUG_STRESS_GC
+    if (phase == Phase::IDLE) {
+        joinSweeper();
+        beginCycle();
+    }
+#else
+    if (phase == Phase::IDLE && usage.bytes > nextGC) {
+        joinSweeper();
+        if (usage.bytes > nextGC) beginCycle();
+    }
+#endif
+
+    auto allocated = usage.bytes > sliceEndBytes ? usage.bytes - sliceEndBytes : 0;
+    sliceWork = allocated * GC_WORK_RATIO;
+    if (phase != Phase::IDLE && usage.bytes > nextGC * GC_FORCE_FACTOR) {
+        deadline = Clock::time_point::max();
+        stats.cyclesForced++;
+    }
+
+    if (phase == Phase::MARKING && traceReferences(deadline)) {
+        finishMarking();
+    }
+    if (phase == Phase::SWEEPING && sweep(deadline)) {
+        finishSweeping();
+    }
+
+    collectionPending = false;
+    sliceEndBytes = usage.bytes;
+    recordPause(start);
+
+    checkLimits();
+    setNextSlice();
+    return usage.bytes <= hardLimit;
+}
+
+// Finishes the cycle in progress, if there is one, and then runs a whole new
+// one without a pause budget, so everything that is unreachable right now has
+// been freed by the time it returns.
+void Heap::collectFully() {
+    auto start = Clock::now();
+    if (youngCollectionPending || nurseryTop != nursery.get()) collectYoung();
+
+    for (auto fresh : {false, true}) {
+        if (fresh) {
+            joinSweeper();
+            beginCycle();
+        }
+        if (phase == Phase::MARKING) {
+            traceReferences(Clock::time_point::max());
+            finishMarking();
+        }
+        if (phase == Phase::SWEEPING) {
+            sweep(Clock::time_point::max());
+            finishSweeping();
+        }
+    }
+    joinSweeper();
+
+    collectionPending = false;
+    recordPause(start);
+}
+
+// The soft limit tells the host once per crossing; it is armed again once a
+// collection finds the heap back under it.
+void Heap::checkLimits() {
+    if (usage.bytes > hardLimit || (usage.bytes > softLimit && !overSoftLimit)) {
+        collectFully();
+    }
+
+    if (usage.bytes <= softLimit) {
+        overSoftLimit = false;
+    } else if (!overSoftLimit) {
+        overSoftLimit = true;
+        if (softLimitCallback) softLimitCallback(usage.bytes);
+    }
+}
+
+void Heap::setNextSlice() {
+    nextSlice = phase == Phase::IDLE ? nextGC : usage.bytes + GC_STEP_SIZE;
+    nextSlice = std::min(nextSlice, overSoftLimit ? hardLimit : std::min(softLimit, hardLimit));
+}
+
+void Heap::recordPause(Clock::time_point start) {
+    auto pause = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+    stats.pauses++;
+    stats.totalPause += pause;
+    stats.maxPause = std::max(stats.maxPause, pause);
+}
+
+void Heap::beginCycle() {
+#ifdef DEBUG_LOG_GC
+    std::cout << "-- gc begin" << std::endl;
+#endif
+
+    phase = Phase::MARKING;
+    sliceEndBytes = usage.bytes;
+    stats.cyclesStarted++;
+    vm.markRoots();
+    markHandles();
+}
+
+// Also recycles the slots of handles that have all been destroyed.
+void Heap::markHandles() {
+    for (auto& slot : handleSlots) {
+        if (slot.refCount > 0) {
+            markValue(slot.value);
+        } else if (slot.refCount == 0) {
+            slot.value = Value();
+            slot.refCount = -1;
+            freeHandleSlots.push_back(&slot);
+        }
+    }
+}
+
+Handle Heap::makeHandle(Value value) {
+    HandleSlot* slot;
+    if (!freeHandleSlots.empty()) {
+        slot = freeHandleSlots.back();
+        freeHandleSlots.pop_back();
+        slot->refCount = 0;
+    } else {
+        slot = &handleSlots.emplace_back();
+    }
+
+    slot->value = value;
+    rootBarrier(value);
+    return Handle(slot);
+}
+
+// Ends the marking phase in one go. Only the stack has to be marked again,
+// every other store since the cycle began went through a write barrier.
+void Heap::finishMarking() {
+    vm.markStackRoots();
+    traceReferences(Clock::time_point::max());
+    removeWhiteStrings();
+
+    rememberedSet.erase(std::remove_if(rememberedSet.begin(), rememberedSet.end(),
+                                       [](Obj* object) { return !object->isMarked; }),
+                        rememberedSet.end());
+    forEachYoung([](Obj* object) { object->isMarked = false; });
+    stats.majorCollections++;
+
+#ifdef DEBUG_LOG_GC
+    std::cout << "-- gc marked, " << usage.bytes << " bytes before sweeping" << std::endl;
+#endif
+
+    // Everything allocated from now on is swept in the next cycle.
+    unswept = objects;
+    objects = nullptr;
+    if (backgroundSweep) {
+        startSweeper();
+        phase = Phase::IDLE;
+        // How much is left is only known once the sweeper has been joined,
+        // which happens when the heap has grown a little more. If that is
+        // still too much, the next cycle starts right away.
+        nextGC = usage.bytes + GC_INITIAL_THRESHOLD;
+    } else {
+        phase = Phase::SWEEPING;
+    }
+}
+
+void Heap::blackenObject(Obj* object) {
+    switch (object->type) {
+        case ObjType::STRING: {
+            auto string = static_cast<StringObject*>(object);
+            if (string->isRope()) {
+                markObject(string->left);
+                markObject(string->right);
+            }
+            break;
+        }
+        case ObjType::FUNCTION: {
+            auto function = static_cast<FunctionObject*>(object);
+            for (auto& constant : function->getChunk().constants) {
+                markValue(constant);
+            }
+            // Keeps cached classes from being freed and their memory reused
+            // by a class the cache would mistake them for.
+            for (auto& cache : function->getChunk().caches) {
+                for (int i = 0; i < cache.count; i++) {
+                    markObject(cache.entries[i].shape->klass);
+                    markObject(cache.entries[i].method);
+                }
+            }
+            break;
+        }
+        case ObjType::CLOSURE: {
+            auto closure = static_cast<ClosureObject*>(object);
+            markObject(closure->function);
+            for (auto upvalue : closure->upvalues) {
+                markValue(upvalue);
+            }
+            break;
+        }
+        case ObjType::UPVALUE:
+            markValue(static_cast<UpvalueObject*>(object)->closed);
+            break;
+        case ObjType::CLASS: {
+            auto klass = static_cast<ClassObject*>(object);
+            markObject(klass->name);
+            for (auto method : klass->methods) markObject(method);
+            klass->shape.forEach([this](Shape* shape) { markObject(shape->name); });
+            break;
+        }
+        case ObjType::INSTANCE: {
+            auto instance = static_cast<InstanceObject*>(object);
+            markObject(instance->klass);
+            if (instance->dictionary != nullptr) {
+                for (auto& [name, value] : *instance->dictionary) markObject(name);
+            }
+            instance->forEachField([this](Value& value) { markValue(value); });
+            break;
+        }
+        case ObjType::BOUND_METHOD: {
+            auto bound = static_cast<BoundMethodObject*>(object);
+            markValue(bound->receiver);
+            markObject(bound->method);
+            break;
+        }
+        case ObjType::NATIVE:
+            break;
+    }
+}
+
+// Returns true once there is nothing left to trace.
+bool Heap::traceReferences(Clock::time_point deadline) {
+    int work = 0;
+    while (!grayStack.empty()) {
+        if (++work % GC_CLOCK_INTERVAL == 0 && sliceWork == 0 && Clock::now() >= deadline) return false;
+
+        auto object = grayStack.back();
+        grayStack.pop_back();
+        spendWork(object);
+        blackenObject(object);
+    }
+    return true;
+}
+
+void Heap::removeWhiteStrings() {
+    for (auto it = strings.begin(); it != strings.end(); ) {
+        if (!it->second->isMarked) {
+            it = strings.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Returns true once every object left over from the last marking phase has
+// been either freed or unmarked.
+bool Heap::sweep(Clock::time_point deadline) {
+    int work = 0;
+    while (unswept != nullptr) {
+        if (++work % GC_CLOCK_INTERVAL == 0 && sliceWork == 0 && Clock::now() >= deadline) return false;
+
+        auto object = unswept;
+        unswept = object->next;
+        spendWork(object);
+        if (object->isMarked) {
+            object->isMarked = false;
+            object->next = objects;
+            objects = object;
+        } else {
+            usage.freed(sizeOf(object));
+            freeObject(object, pool);
+        }
+    }
+    return true;
+}
+
+// Sizes the next cycle off what survived this one.
+void Heap::finishSweeping() {
+    phase = Phase::IDLE;
+    nextGC = std::max(usage.bytes * GC_HEAP_GROW_FACTOR, static_cast<size_t>(GC_INITIAL_THRESHOLD));
+
+#ifdef DEBUG_LOG_GC
+    std::cout << "-- gc end, " << usage.bytes << " bytes left, next at " << nextGC << std::endl;
+#endif
+}
+
+// Sweeps the whole unswept list on another thread. It only touches objects
+// that were unreachable or are already marked, and the VM never looks at
+// mark bits outside of a marking phase, so the two can run side by side
+// until the next cycle joins the sweeper.
+void Heap::startSweeper() {
+    auto list = unswept;
+    unswept = nullptr;
+    sweeper = std::thread([this, list]() {
+        Scope scope(&sweptUsage);
+        auto object = list;
+        while (object != nullptr) {
+            auto next = object->next;
+            if (object->isMarked) {
+                object->isMarked = false;
+                if (sweptObjects == nullptr) lastSweptObject = object;
+                object->next = sweptObjects;
+                sweptObjects = object;
+            } else {
+                sweptUsage.freed(sizeOf(object));
+                freeObject(object, pendingFrees);
+            }
+            object = next;
+        }
+    });
+}
+
+void Heap::joinSweeper() {
+    if (!sweeper.joinable()) return;
+
+    sweeper.join();
+    pool.reclaim(pendingFrees);
+    if (sweptObjects != nullptr) {
+        lastSweptObject->next = objects;
+        objects = sweptObjects;
+    }
+    // Adding the wrapped-around total subtracts what was freed.
+    usage.bytes += sweptUsage.bytes;
+    sweptUsage = HeapUsage();
+    sweptObjects = nullptr;
+    lastSweptObject = nullptr;
+    finishSweeping();
+}
+
+void Heap::printStats(std::ostream& os) const {
+    pool.printStats(os);
+    os << "heap: " << usage.bytes << " bytes in use, peak " << usage.peak << std::endl;
+
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+
+    os << "gc: " << stats.majorCollections << " major and " << stats.minorCollections
+       << " minor collections in " << stats.pauses << " pauses" << std::endl;
+    os << "gc: " << stats.cyclesForced << " major collections forced to finish, "
+       << stats.cyclesStarted - stats.majorCollections << " left unfinished" << std::endl;
+    if (stats.pauses > 0) {
+        os << "gc: pause total " << duration_cast<microseconds>(stats.totalPause).count()
+           << "us, mean " << duration_cast<microseconds>(stats.totalPause / stats.pauses).count()
+           << "us, max " << duration_cast<microseconds>(stats.maxPause).count() << "us" << std::endl;
+    }
+}
+
+StringObject* Heap::copyString(std::string_view chars) {
+    auto found = strings.find(chars);
+    if (found != strings.end()) return found->second;
+
+    auto string = allocate<StringObject>(HeapString(chars));
+    string->isInterned = true;
+    strings.emplace(string->chars, string);
+    return string;
+}
+
+StringObject* Heap::takeString(HeapString&& chars) {
+    auto found = strings.find(chars);
+    if (found != strings.end()) return found->second;
+
+    auto string = allocate<StringObject>(std::move(chars));
+    string->isInterned = true;
+    strings.emplace(string->chars, string);
+    return string;
+}
+
+StringObject* Heap::concatenate(StringObject* a, StringObject* b) {
+    if (a->length + b->length < ROPE_MIN_LENGTH) {
+        return takeString(a->flatten() + b->flatten());
+    }
+    return allocate<StringObject>(a, b);
+}
@@ -0,0 +1,368 @@
+//
+//  memory.hpp
+//  cloxpp
+//
+
+#ifndef memory_hpp
+#define memory_hpp
+
+#include "value.hpp"
+#include "pool.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+// Concatenations shorter than this are copied and interned straight away.
+#define ROPE_MIN_LENGTH 64
+
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+#define GC_HEAP_GROW_FACTOR 2
+
+// While a collection is in progress, the VM does another slice of it every
+// time this many bytes have been allocated.
+#define GC_STEP_SIZE (64 * 1024)
+
+// Each slice marks or sweeps at least this many bytes of objects for every
+// byte allocated since the last one, even if that takes it past its pause
+// budget, so that a cycle keeps up with the program.
+#define GC_WORK_RATIO 4
+
+// A cycle still in progress once the heap has grown to this many times the
+// size that started it is finished in a single slice.
+#define GC_FORCE_FACTOR 2
+
+// How many objects are marked or swept between two looks at the clock.
+#ifdef DEBUG_STRESS_GC
+#define GC_CLOCK_INTERVAL 1
+#else
+#define GC_CLOCK_INTERVAL 64
+#endif
+
+#define NURSERY_SIZE (256 * 1024)
+
+struct HandleSlot {
+    Value value;
+    // -1 once the Heap has put the slot back on its free list.
+    int32_t refCount = 0;
+};
+
+// Keeps an object alive from C++ code that holds on to it across a
+// safepoint, outside of anything the VM marks. Copies share one slot in the
+// Heap and count themselves there without atomics, since a VM is only ever
+// used from one thread. A minor collection updates the slot when it moves
+// the object, so read it through the handle rather than caching the pointer.
+class Handle {
+    HandleSlot* slot;
+
+public:
+    explicit Handle(HandleSlot* slot): slot(slot) { slot->refCount++; }
+    Handle(const Handle& other): slot(other.slot) { slot->refCount++; }
+    Handle& operator=(const Handle& other) {
+        other.slot->refCount++;
+        slot->refCount--;
+        slot = other.slot;
+        return *this;
+    }
+    ~Handle() { slot->refCount--; }
+
+    Value get() const { return slot->value; }
+
+    template <typename T>
+    T* as() const { return slot->value.as<T>(); }
+};
+
+struct GCStats {
+    size_t minorCollections = 0;
+    size_t majorCollections = 0;
+    size_t cyclesStarted = 0;
+    // Cycles that fell so far behind the program that a slice finished them.
+    size_t cyclesForced = 0;
+    size_t pauses = 0;
+    std::chrono::nanoseconds totalPause{0};
+    std::chrono::nanoseconds maxPause{0};
+};
+
+// Owns every object created by the compiler and the VM.
+//
+// Old objects are threaded through their `next` pointer and reclaimed by a
+// tri-color mark-and-sweep collector. A cycle starts by marking the roots the
+// VM reports in `VM::markRoots`, then traces and sweeps in slices that each
+// fit in the configured pause budget. Objects allocated during marking start
+// out gray, and stores into objects go through `writeBarrier`, which grays
+// the stored value when its owner has already been marked. The stack is not
+// barriered, so it is marked again in the slice that finishes marking.
+// Slices do work in proportion to what the program allocated since the last
+// one, and a cycle that still falls behind is finished in one go.
+// Sweeping can optionally be handed to a background thread.
+//
+// Instances and bound methods, which mostly die young, are bump allocated in
+// a nursery instead. When it fills up a minor collection copies the
+// survivors into the old space and empties it. Old objects that are written
+// a pointer to a young one are kept in the remembered set so a minor
+// collection does not have to look at the rest of the old space.
+//
+// Moving objects and freeing unrooted ones invalidates raw pointers, so all
+// collection work happens at the safepoints where the VM calls
+// `safepoint()`. Until then a full nursery spills into the old space.
+//
+// Every byte the heap holds is counted in its HeapUsage: old objects as they
+// are allocated and freed, the nursery as a whole, and the strings, chunks
+// and tables inside objects through HeapAllocator while a Scope is active.
+// Going over the soft limit forces a full collection and tells the host;
+// going over the hard limit makes `safepoint()` fail if a full collection
+// does not bring the heap back under it.
+class Heap {
+    enum class Phase { IDLE, MARKING, SWEEPING };
+    using Clock = std::chrono::steady_clock;
+
+    VM& vm;
+    Pool pool;
+    Obj* objects = nullptr;
+    std::vector<Obj*> grayStack;
+    Phase phase = Phase::IDLE;
+    // Old objects that were alive when marking started, waiting to be swept.
+    Obj* unswept = nullptr;
+    HeapUsage usage;
+    size_t nextGC = GC_INITIAL_THRESHOLD;
+    size_t nextSlice = GC_INITIAL_THRESHOLD;
+    bool collectionPending = false;
+    int pauseCount = 0;
+    // What the heap held when the last slice ended, and how many bytes of
+    // objects the slice in progress has left to get through before it may
+    // stop at its deadline.
+    size_t sliceEndBytes = 0;
+    size_t sliceWork = 0;
+
+    std::chrono::microseconds pauseBudget{0};
+    bool backgroundSweep = false;
+    std::thread sweeper;
+    Obj* sweptObjects = nullptr;
+    Obj* lastSweptObject = nullptr;
+    // Only ever goes down, wrapping around, and is added to `usage` when the
+    // sweeper is joined.
+    HeapUsage sweptUsage;
+    PendingFrees pendingFrees;
+    GCStats stats;
+
+    size_t softLimit = SIZE_MAX;
+    size_t hardLimit = SIZE_MAX;
+    bool overSoftLimit = false;
+    std::function<void(size_t bytes)> softLimitCallback;
+
+    // Keys view the interned string's own characters. The table is weak: it
+    // does not keep strings alive.
+    std::unordered_map<std::string_view, StringObject*> strings;
+
+    // A deque so slots stay put as more are added.
+    std::deque<HandleSlot> handleSlots;
+    std::vector<HandleSlot*> freeHandleSlots;
+
+    std::unique_ptr<char[]> nursery;
+    char* nurseryTop;
+    char* nurseryEnd;
+    bool youngCollectionPending = false;
+    std::vector<Obj*> rememberedSet;
+    std::vector<Obj*> survivors;
+
+    template <typename T>
+    static constexpr bool startsYoung =
+        std::is_same_v<T, InstanceObject> || std::is_same_v<T, BoundMethodObject>;
+
+    static constexpr size_t youngSize(size_t size) {
+        return (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+    }
+
+    static size_t sizeOf(Obj* object);
+    template <typename Allocator>
+    static void freeObject(Obj* object, Allocator& allocator);
+    bool isYoung(Obj* object) const {
+        auto address = reinterpret_cast<uintptr_t>(object);
+        return address >= reinterpret_cast<uintptr_t>(nursery.get()) &&
+               address < reinterpret_cast<uintptr_t>(nurseryEnd);
+    }
+    bool isYoung(Value value) const { return value.isObj() && isYoung(value.asObj()); }
+    void remember(Obj* object) {
+        object->isRemembered = true;
+        rememberedSet.push_back(object);
+    }
+    template <typename F>
+    void forEachYoung(F visit);
+    Obj* promote(Obj* object);
+    void scanYoungReferences(Obj* object);
+    void collectYoung();
+
+    bool collect();
+    void collectFully();
+    void checkLimits();
+    void setNextSlice();
+    void spendWork(Obj* object) {
+        auto size = sizeOf(object);
+        sliceWork = sliceWork > size ? sliceWork - size : 0;
+    }
+    void recordPause(Clock::time_point start);
+    void markHandles();
+    void beginCycle();
+    void finishMarking();
+    void blackenObject(Obj* object);
+    bool traceReferences(Clock::time_point deadline);
+    void removeWhiteStrings();
+    bool sweep(Clock::time_point deadline);
+    void finishSweeping();
+    void startSweeper();
+    void joinSweeper();
+
+public:
+    // Charges the containers of objects created or freed on this thread to
+    // `usage` for as long as it lives.
+    class Scope {
+        HeapUsage* saved;
+
+    public:
+        explicit Scope(HeapUsage* usage): saved(currentHeapUsage) { currentHeapUsage = usage; }
+        explicit Scope(Heap& heap): Scope(&heap.usage) {}
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+        ~Scope() { currentHeapUsage = saved; }
+    };
+
+    explicit Heap(VM& vm)
+        : vm(vm), nursery(new char[NURSERY_SIZE]), nurseryTop(nursery.get()),
+          nurseryEnd(nursery.get() + NURSERY_SIZE) {
+        usage.allocated(NURSERY_SIZE);
+    }
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+    ~Heap();
+
+    template <typename T, typename... Args>
+    T* allocate(Args&&... args) {
+        if constexpr (startsYoung<T>) {
+            constexpr auto size = youngSize(sizeof(T));
+            if (nurseryTop + size <= nurseryEnd) {
+                auto object = new (nurseryTop) T(std::forward<Args>(args)...);
+                nurseryTop += size;
+#ifdef DEBUG_STRESS_GC
+                youngCollectionPending = true;
+                collectionPending = true;
+#endif
+                return object;
+            }
+
+            youngCollectionPending = true;
+            collectionPending = true;
+            auto object = allocateOld<T>(std::forward<Args>(args)...);
+            remember(object);
+            return object;
+        } else {
+            return allocateOld<T>(std::forward<Args>(args)...);
+        }
+    }
+
+    template <typename T, typename... Args>
+    T* allocateOld(Args&&... args) {
+        auto object = new (pool.allocate(sizeof(T))) T(std::forward<Args>(args)...);
+        Obj* header = object;
+        usage.allocated(sizeof(T));
+        header->next = objects;
+        objects = header;
+
+        if (phase == Phase::MARKING) markObject(header);
+#ifdef DEBUG_STRESS_GC
+        collectionPending = true;
+#endif
+        return object;
+    }
+
+    Handle makeHandle(Value value);
+
+    StringObject* copyString(std::string_view chars);
+    StringObject* takeString(HeapString&& chars);
+    StringObject* concatenate(StringObject* a, StringObject* b);
+
+    // Collection is paused while the compiler runs. Everything it allocates
+    // stays reachable from the function being compiled anyway.
+    void pause() { pauseCount++; }
+    void resume() { pauseCount--; }
+
+    // Zero means every collection runs to completion in a single pause.
+    void setPauseBudget(std::chrono::microseconds budget) { pauseBudget = budget; }
+    void setBackgroundSweep(bool enabled) { backgroundSweep = enabled; }
+    void setHugePages(bool enabled) { pool.setHugePages(enabled); }
+    const GCStats& getStats() const { return stats; }
+    void printStats(std::ostream& os) const;
+
+    // The callback runs at a safepoint, after the full collection, each time
+    // the heap goes over the soft limit. It must not run Lox code.
+    void setSoftLimit(size_t bytes, std::function<void(size_t bytes)> callback = nullptr) {
+        softLimit = bytes;
+        softLimitCallback = std::move(callback);
+        setNextSlice();
+    }
+    void setHardLimit(size_t bytes) {
+        hardLimit = bytes;
+        setNextSlice();
+    }
+    // Does not include what a background sweep has freed but not yet
+    // handed back.
+    size_t bytesInUse() const { return usage.bytes; }
+    size_t peakBytesInUse() const { return usage.peak; }
+
+    // Must be called whenever `value` is stored into `owner`.
+    void writeBarrier(Obj* owner, Value value) {
+        if (!value.isObj()) return;
+        auto target = value.asObj();
+        if (phase == Phase::MARKING && owner->isMarked) markObject(target);
+        if (!owner->isRemembered && isYoung(target) && !isYoung(owner)) remember(owner);
+    }
+
+    // Must be called after `owner` had many references stored into it at once.
+    void writeBarrier(Obj* owner) {
+        if (phase == Phase::MARKING && owner->isMarked) grayStack.push_back(owner);
+    }
+
+    // Must be called whenever a value is stored into a root that is only
+    // marked when a cycle begins, like the globals table.
+    void rootBarrier(Value value) {
+        if (phase == Phase::MARKING) markValue(value);
+    }
+
+    // Called by the VM at points where every live value is reachable from
+    // its roots and no raw object pointers are held. Returns false if the
+    // heap is still over its hard limit after collecting everything it can.
+    bool safepoint() {
+        if (collectionPending || usage.bytes > nextSlice) return collect();
+        return true;
+    }
+    // What `safepoint()` looks at to decide whether there is anything to do,
+    // for native code to check before it calls it.
+    struct SafepointTrigger {
+        const bool* pending;
+        const size_t* bytes;
+        const size_t* limit;
+    };
+    SafepointTrigger safepointTrigger() const { return { &collectionPending, &usage.bytes, &nextSlice }; }
+    void evacuate(Value& value);
+
+    void markObject(Obj* object) {
+        if (object == nullptr || object->isMarked) return;
+
+#ifdef DEBUG_LOG_GC
+        std::cout << object << " mark " << Value(object) << std::endl;
+#endif
+
+        object->isMarked = true;
+        grayStack.push_back(object);
+    }
+    void markValue(Value value) {
+        if (value.isObj()) markObject(value.asObj());
+    }
+};
+
+#endif /* memory_hpp */
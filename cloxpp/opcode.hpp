@@ -10,46 +10,165 @@
 #define opcode_hpp
 
 #include "common.hpp"
+#include <cstdint>
+#include <initializer_list>
+
+// Every opcode, in order. The VM builds its dispatch table from this list.
+//
+// The *_GLOBAL_SLOT opcodes take a two byte slot in the VM's GlobalTable
+// rather than a name.
+//
+// The *_IN_FRAME variants are GET_PROPERTY and GET_SUPER for bound methods
+// the compiler proved never outlive their frame. They are kept in the stack
+// slot they are pushed to instead of being allocated.
+//
+// The TAIL_* variants are CALL and INVOKE right before a RETURN. When they
+// call a Lox function, its frame takes the place of the caller's instead of
+// going on top of it. The RETURN after them is only for whatever else they
+// call, which has returned by then.
+#define OPCODES(X) \
+    X(CONSTANT) \
+    X(NIL) \
+    X(TRUE) \
+    X(FALSE) \
+    X(POP) \
+    X(GET_LOCAL) \
+    X(GET_GLOBAL_SLOT) \
+    X(DEFINE_GLOBAL_SLOT) \
+    X(SET_LOCAL) \
+    X(SET_GLOBAL_SLOT) \
+    X(GET_UPVALUE) \
+    X(SET_UPVALUE) \
+    X(GET_PROPERTY) \
+    X(SET_PROPERTY) \
+    X(GET_SUPER) \
+    X(GET_PROPERTY_IN_FRAME) \
+    X(GET_SUPER_IN_FRAME) \
+    X(EQUAL) \
+    X(GREATER) \
+    X(LESS) \
+    X(ADD) \
+    X(SUBTRACT) \
+    X(MULTIPLY) \
+    X(DIVIDE) \
+    X(NOT) \
+    X(NEGATE) \
+    X(PRINT) \
+    X(JUMP) \
+    X(JUMP_IF_FALSE) \
+    X(LOOP) \
+    X(CALL) \
+    X(INVOKE) \
+    X(SUPER_INVOKE) \
+    X(TAIL_CALL) \
+    X(TAIL_INVOKE) \
+    X(CLOSURE) \
+    X(CLOSE_UPVALUE) \
+    X(RETURN) \
+    X(CLASS) \
+    X(INHERIT) \
+    X(METHOD)
+
+// What each upvalue operand of a CLOSURE captures. The compiler emits LOCAL
+// for every variable of the enclosing function, and once the variable goes
+// out of scope turns it into VALUE if nothing ever assigns it after all, or
+// into IN_FRAME if the closure is only ever called from its variable.
+enum class Capture: uint8_t {
+    // The enclosing closure's upvalue of that index, however it holds it.
+    UPVALUE,
+    // A local, through an UpvalueObject that is closed when it goes away.
+    LOCAL,
+    // A local's value, copied into the closure.
+    VALUE,
+    // A local, through the upvalue of its stack slot, which never closes.
+    IN_FRAME
+};
+
+// Specialized forms of the instructions above. The compiler never emits
+// them; the VM rewrites an instruction into one in place once it has seen
+// what the instruction operates on. Each takes the same operands as the
+// instruction it replaces and turns back into it, before running, when its
+// guess turns out to be wrong.
+#define QUICKENED_OPCODES(X) \
+    X(GREATER_NUM) \
+    X(LESS_NUM) \
+    X(ADD_NUM) \
+    X(SUBTRACT_NUM) \
+    X(MULTIPLY_NUM) \
+    X(DIVIDE_NUM) \
+    X(CALL_CLOSURE) \
+    X(CALL_NATIVE)
+
+// Sequences of the instructions above that the compiler fuses so they cost
+// one dispatch instead of several, each listed with the instructions it
+// covers. A superinstruction only replaces the first opcode of its sequence:
+// the rest stays in place and the VM steps over the opcodes it covers. So
+// nothing moves, and a jump into the middle of a sequence still runs what
+// was there.
+//
+// tool/bin/superinstructions.dart ranks sequences by how many dispatches
+// fusing them would have saved across test/benchmark, using a build with
+// DEBUG_PROFILE_OPCODES on. These are the best of them, leaving out ones that
+// are only common because of how a single benchmark is written.
+#define SUPERINSTRUCTIONS(X) \
+    X(POP_GET_GLOBAL_SLOT, POP, GET_GLOBAL_SLOT) \
+    X(GET_LOCAL_GET_PROPERTY, GET_LOCAL, GET_PROPERTY) \
+    X(GET_LOCAL_RETURN, GET_LOCAL, RETURN) \
+    X(GET_LOCAL_CONSTANT_ADD, GET_LOCAL, CONSTANT, ADD) \
+    X(GET_LOCAL_CONSTANT_SUBTRACT, GET_LOCAL, CONSTANT, SUBTRACT) \
+    X(GET_LOCAL_CONSTANT_LESS_JUMP_IF_FALSE, GET_LOCAL, CONSTANT, LESS, JUMP_IF_FALSE) \
+    X(JUMP_IF_FALSE_POP, JUMP_IF_FALSE, POP) \
+    X(SET_PROPERTY_POP, SET_PROPERTY, POP) \
+    X(SET_LOCAL_POP, SET_LOCAL, POP) \
+    X(NIL_RETURN, NIL, RETURN)
 
 enum class OpCode: uint8_t {
-    CONSTANT,
-    NIL,
-    TRUE,
-    FALSE,
-    POP,
-    GET_LOCAL,
-    GET_GLOBAL,
-    DEFINE_GLOBAL,
-    SET_LOCAL,
-    SET_GLOBAL,
-    GET_UPVALUE,
-    SET_UPVALUE,
-    GET_PROPERTY,
-    SET_PROPERTY,
-    GET_SUPER,
-    EQUAL,
-    GREATER,
-    LESS,
-    ADD,
-    SUBTRACT,
-    MULTIPLY,
-    DIVIDE,
-    NOT,
-    NEGATE,
-    PRINT,
-    JUMP,
-    JUMP_IF_FALSE,
-    LOOP,
-    CALL,
-    INVOKE,
-    SUPER_INVOKE,
-    CLOSURE,
-    CLOSE_UPVALUE,
-    RETURN,
-    CLASS,
-    INHERIT,
-    METHOD
+#define OPCODE_ENUM(name) name,
+#define SUPERINSTRUCTION_ENUM(name, ...) name,
+    OPCODES(OPCODE_ENUM)
+    QUICKENED_OPCODES(OPCODE_ENUM)
+    SUPERINSTRUCTIONS(SUPERINSTRUCTION_ENUM)
+#undef SUPERINSTRUCTION_ENUM
+#undef OPCODE_ENUM
 };
 
+#define SUPERINSTRUCTION_PARTS_MAX 4
+
+struct Superinstruction {
+    OpCode op;
+    const char* name;
+    int length = 0;
+    OpCode parts[SUPERINSTRUCTION_PARTS_MAX] = {};
+
+    constexpr Superinstruction(OpCode op, const char* name, std::initializer_list<OpCode> sequence)
+        : op(op), name(name) {
+        for (auto part : sequence) parts[length++] = part;
+    }
+};
+
+// Every opcode by its bare name, so SUPERINSTRUCTIONS can list parts the way
+// OPCODES spells them.
+namespace superinstruction_parts {
+#define OPCODE_CONSTANT(name) constexpr OpCode name = OpCode::name;
+    OPCODES(OPCODE_CONSTANT)
+#undef OPCODE_CONSTANT
+
+#define SUPERINSTRUCTION_ENTRY(name, ...) Superinstruction(OpCode::name, "OP_" #name, {__VA_ARGS__}),
+    inline constexpr Superinstruction superinstructions[] = {
+        SUPERINSTRUCTIONS(SUPERINSTRUCTION_ENTRY)
+    };
+#undef SUPERINSTRUCTION_ENTRY
+}
+
+using superinstruction_parts::superinstructions;
+
+// The superinstruction `op` is, or null if it is an ordinary instruction.
+inline const Superinstruction* findSuperinstruction(OpCode op) {
+    for (auto& superinstruction : superinstructions) {
+        if (superinstruction.op == op) return &superinstruction;
+    }
+    return nullptr;
+}
+
 
 #endif /* opcode_hpp */
@@ -0,0 +1,106 @@
+//
+//  pool.cpp
+//  cloxpp
+//
+
+#include "pool.hpp"
+#include <sys/mman.h>
+#include <cstdint>
+#include <iomanip>
+#include <new>
+
+void PendingFrees::free(void* pointer, size_t size) {
+    if (size > POOL_MAX_SIZE) {
+        ::operator delete(pointer);
+        return;
+    }
+
+    auto index = (size - 1) / POOL_GRANULARITY;
+    auto block = static_cast<FreeBlock*>(pointer);
+    block->next = first[index];
+    if (first[index] == nullptr) last[index] = block;
+    first[index] = block;
+    count[index]++;
+}
+
+Pool::~Pool() {
+    for (auto region : regions) {
+        munmap(region, POOL_REGION_SIZE);
+    }
+}
+
+void* Pool::allocateSlow(SizeClass& sizeClass, size_t size) {
+    auto blockSize = (classIndex(size) + 1) * POOL_GRANULARITY;
+    if (sizeClass.top == nullptr || sizeClass.top + blockSize > sizeClass.end) {
+        sizeClass.top = allocateSlab();
+        sizeClass.end = sizeClass.top + POOL_SLAB_SIZE;
+        sizeClass.slabs++;
+    }
+
+    auto block = sizeClass.top;
+    sizeClass.top += blockSize;
+    return block;
+}
+
+char* Pool::allocateSlab() {
+    if (regionTop == regionEnd) {
+        // Reserve twice the size so the region can start on a huge page
+        // boundary, then give back the slack on either side.
+        auto size = static_cast<size_t>(POOL_REGION_SIZE);
+        auto mapped = static_cast<char*>(mmap(nullptr, 2 * size, PROT_READ | PROT_WRITE,
+                                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (mapped == MAP_FAILED) throw std::bad_alloc();
+
+        auto offset = reinterpret_cast<uintptr_t>(mapped) % size;
+        auto region = offset == 0 ? mapped : mapped + (size - offset);
+        if (region > mapped) munmap(mapped, region - mapped);
+        munmap(region + size, mapped + 2 * size - (region + size));
+
+#ifdef MADV_HUGEPAGE
+        if (hugePages) madvise(region, size, MADV_HUGEPAGE);
+#endif
+
+        regions.push_back(region);
+        regionTop = region;
+        regionEnd = region + size;
+    }
+
+    auto slab = regionTop;
+    regionTop += POOL_SLAB_SIZE;
+    return slab;
+}
+
+void Pool::reclaim(PendingFrees& pending) {
+    for (size_t i = 0; i < POOL_CLASS_COUNT; i++) {
+        if (pending.first[i] == nullptr) continue;
+
+        auto& sizeClass = classes[i];
+        pending.last[i]->next = sizeClass.free;
+        sizeClass.free = pending.first[i];
+        sizeClass.live -= pending.count[i];
+        sizeClass.freeCount += pending.count[i];
+    }
+    pending = PendingFrees();
+}
+
+void Pool::printStats(std::ostream& os) const {
+    size_t reserved = 0;
+    size_t used = 0;
+    os << "pool: size  slabs       live       free  utilization" << std::endl;
+    for (size_t i = 0; i < POOL_CLASS_COUNT; i++) {
+        auto& sizeClass = classes[i];
+        if (sizeClass.slabs == 0) continue;
+
+        auto blockSize = (i + 1) * POOL_GRANULARITY;
+        auto slabBytes = sizeClass.slabs * POOL_SLAB_SIZE;
+        reserved += slabBytes;
+        used += sizeClass.live * blockSize;
+        os << "pool: " << std::setw(4) << blockSize << std::setw(7) << sizeClass.slabs
+           << std::setw(11) << sizeClass.live << std::setw(11) << sizeClass.freeCount
+           << std::setw(12) << std::fixed << std::setprecision(1)
+           << 100.0 * sizeClass.live * blockSize / slabBytes << "%" << std::endl;
+    }
+    os << "pool: " << regions.size() << " regions of " << POOL_REGION_SIZE / 1024 << "KB"
+       << (hugePages ? " (huge pages requested)" : "") << ", " << used / 1024 << "KB of "
+       << reserved / 1024 << "KB in slabs in use, " << largeLive << " large objects" << std::endl;
+}
@@ -0,0 +1,105 @@
+//
+//  pool.hpp
+//  cloxpp
+//
+
+#ifndef pool_hpp
+#define pool_hpp
+
+#include <cstddef>
+#include <iostream>
+#include <vector>
+
+#define POOL_GRANULARITY 8
+#define POOL_MAX_SIZE 256
+#define POOL_CLASS_COUNT (POOL_MAX_SIZE / POOL_GRANULARITY)
+#define POOL_SLAB_SIZE (64 * 1024)
+// Slabs are carved out of regions this big, which is also the size of a
+// huge page on x86-64 and arm64 Linux.
+#define POOL_REGION_SIZE (2 * 1024 * 1024)
+
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+// Blocks freed away from the pool's thread, kept per size class until the
+// pool takes them back.
+struct PendingFrees {
+    FreeBlock* first[POOL_CLASS_COUNT] = {};
+    FreeBlock* last[POOL_CLASS_COUNT] = {};
+    size_t count[POOL_CLASS_COUNT] = {};
+
+    void free(void* pointer, size_t size);
+};
+
+// Hands out memory for heap objects from per-size-class slabs with free
+// lists. Sizes above POOL_MAX_SIZE go to the general allocator. Slabs are
+// kept for as long as the pool lives. On Linux the regions they come from
+// can be backed by transparent huge pages to cut down TLB misses.
+class Pool {
+    struct SizeClass {
+        FreeBlock* free = nullptr;
+        char* top = nullptr;
+        char* end = nullptr;
+        size_t slabs = 0;
+        size_t live = 0;
+        size_t freeCount = 0;
+    };
+
+    SizeClass classes[POOL_CLASS_COUNT];
+    std::vector<void*> regions;
+    char* regionTop = nullptr;
+    char* regionEnd = nullptr;
+    bool hugePages = false;
+    size_t largeLive = 0;
+
+    static size_t classIndex(size_t size) { return (size - 1) / POOL_GRANULARITY; }
+    void* allocateSlow(SizeClass& sizeClass, size_t size);
+    char* allocateSlab();
+
+public:
+    Pool() = default;
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+    ~Pool();
+
+    // Only affects regions reserved after the call.
+    void setHugePages(bool enabled) { hugePages = enabled; }
+
+    void* allocate(size_t size) {
+        if (size > POOL_MAX_SIZE) {
+            largeLive++;
+            return ::operator new(size);
+        }
+
+        auto& sizeClass = classes[classIndex(size)];
+        sizeClass.live++;
+        if (sizeClass.free != nullptr) {
+            auto block = sizeClass.free;
+            sizeClass.free = block->next;
+            sizeClass.freeCount--;
+            return block;
+        }
+        return allocateSlow(sizeClass, size);
+    }
+
+    void free(void* pointer, size_t size) {
+        if (size > POOL_MAX_SIZE) {
+            largeLive--;
+            ::operator delete(pointer);
+            return;
+        }
+
+        auto& sizeClass = classes[classIndex(size)];
+        auto block = static_cast<FreeBlock*>(pointer);
+        block->next = sizeClass.free;
+        sizeClass.free = block;
+        sizeClass.live--;
+        sizeClass.freeCount++;
+    }
+
+    void reclaim(PendingFrees& pending);
+    void printStats(std::ostream& os) const;
+};
+
+#endif /* pool_hpp */
@@ -0,0 +1,99 @@
+//
+//  profile.cpp
+//  cloxpp
+//
+
+#include "profile.hpp"
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+static const char* opcodeNames[] = {
+#define OPCODE_NAME(name) #name,
+    OPCODES(OPCODE_NAME)
+    QUICKENED_OPCODES(OPCODE_NAME)
+#undef OPCODE_NAME
+};
+
+static OpCode unquickened(OpCode op) {
+    switch (op) {
+        case OpCode::GREATER_NUM: return OpCode::GREATER;
+        case OpCode::LESS_NUM: return OpCode::LESS;
+        case OpCode::ADD_NUM: return OpCode::ADD;
+        case OpCode::SUBTRACT_NUM: return OpCode::SUBTRACT;
+        case OpCode::MULTIPLY_NUM: return OpCode::MULTIPLY;
+        case OpCode::DIVIDE_NUM: return OpCode::DIVIDE;
+        case OpCode::CALL_CLOSURE: return OpCode::CALL;
+        case OpCode::CALL_NATIVE: return OpCode::CALL;
+        default: return op;
+    }
+}
+
+// Zero for CLOSURE, whose length depends on the function it closes over.
+static int instructionLength(OpCode op) {
+    switch (op) {
+        case OpCode::CONSTANT:
+        case OpCode::GET_LOCAL:
+        case OpCode::SET_LOCAL:
+        case OpCode::GET_UPVALUE:
+        case OpCode::SET_UPVALUE:
+        case OpCode::CALL:
+        case OpCode::TAIL_CALL:
+        case OpCode::CLASS:
+            return 2;
+        case OpCode::GET_GLOBAL_SLOT:
+        case OpCode::DEFINE_GLOBAL_SLOT:
+        case OpCode::SET_GLOBAL_SLOT:
+        case OpCode::GET_SUPER:
+        case OpCode::GET_SUPER_IN_FRAME:
+        case OpCode::JUMP:
+        case OpCode::JUMP_IF_FALSE:
+        case OpCode::LOOP:
+        case OpCode::METHOD:
+            return 3;
+        case OpCode::GET_PROPERTY:
+        case OpCode::SET_PROPERTY:
+        case OpCode::GET_PROPERTY_IN_FRAME:
+        case OpCode::SUPER_INVOKE:
+            return 4;
+        case OpCode::INVOKE:
+        case OpCode::TAIL_INVOKE:
+            return 5;
+        case OpCode::CLOSURE:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+void OpcodeProfile::record(const uint8_t* ip) {
+    auto op = unquickened(OpCode(*ip));
+
+    if (ip != expected) windowLength = 0;
+    window = (window << 8 | static_cast<uint8_t>(op));
+    if (windowLength < PROFILE_SEQUENCE_MAX) windowLength++;
+
+    for (auto length = 1; length <= windowLength; length++) {
+        auto mask = length == 4 ? UINT32_MAX : (1u << (8 * length)) - 1;
+        counts[length - 1][window & mask]++;
+    }
+
+    auto length = instructionLength(op);
+    expected = length == 0 ? nullptr : ip + length;
+}
+
+void OpcodeProfile::print(std::ostream& os) const {
+    for (auto& sequences : counts) {
+        std::vector<std::pair<uint32_t, uint64_t>> sorted(sequences.begin(), sequences.end());
+        std::sort(sorted.begin(), sorted.end(), [](auto& a, auto& b) { return a.second > b.second; });
+
+        for (auto [sequence, count] : sorted) {
+            os << count;
+            auto length = static_cast<int>(&sequences - counts) + 1;
+            for (auto i = length; i-- > 0; ) {
+                os << " " << opcodeNames[(sequence >> (8 * i)) & 0xff];
+            }
+            os << std::endl;
+        }
+    }
+}
@@ -0,0 +1,37 @@
+//
+//  profile.hpp
+//  cloxpp
+//
+
+#ifndef profile_hpp
+#define profile_hpp
+
+#include "opcode.hpp"
+#include <cstdint>
+#include <iostream>
+#include <unordered_map>
+
+// The longest run of instructions an OpcodeProfile counts.
+#define PROFILE_SEQUENCE_MAX 4
+
+// Counts how often each instruction runs, and each sequence of up to
+// PROFILE_SEQUENCE_MAX instructions that run straight after one another
+// without a jump, call or return in between. These are the histograms
+// tool/bin/superinstructions.dart picks superinstructions from, so the
+// compiler emits none while DEBUG_PROFILE_OPCODES is on and quickened
+// instructions are counted as the ones they replaced.
+class OpcodeProfile {
+    // Sequences packed one opcode per byte, newest in the lowest byte.
+    std::unordered_map<uint32_t, uint64_t> counts[PROFILE_SEQUENCE_MAX];
+    uint32_t window = 0;
+    int windowLength = 0;
+    const uint8_t* expected = nullptr;
+
+public:
+    // Called with `ip` on the opcode of each instruction about to run.
+    void record(const uint8_t* ip);
+    // One line per sequence: its count, then its opcodes.
+    void print(std::ostream& os) const;
+};
+
+#endif /* profile_hpp */
@@ -0,0 +1,732 @@
+//
+//  registers.cpp
+//  cloxpp
+//
+
+#include "registers.hpp"
+#include "value.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+
+namespace {
+
+// Where the value of a stack slot is while the translator has not written it
+// to the slot's own register yet. A REGISTER entry only ever names a slot
+// whose own entry is SLOT.
+struct Entry {
+    enum class Kind: uint8_t { SLOT, REGISTER, CONSTANT, NIL, TRUE, FALSE };
+
+    Kind kind;
+    uint8_t operand = 0;
+
+    bool reads(int reg) const { return kind == Kind::REGISTER && operand == reg; }
+};
+
+// Superinstructions are translated part by part, and bound methods are
+// always allocated, so only the plain instructions are left.
+OpCode normalize(OpCode op) {
+    if (auto superinstruction = findSuperinstruction(op)) return superinstruction->parts[0];
+    switch (op) {
+        case OpCode::GET_PROPERTY_IN_FRAME: return OpCode::GET_PROPERTY;
+        case OpCode::GET_SUPER_IN_FRAME: return OpCode::GET_SUPER;
+        default: return op;
+    }
+}
+
+class Translator {
+    FunctionObject* function;
+    Chunk& chunk;
+    std::vector<uint8_t> code;
+    std::vector<int> lines;
+    std::vector<Entry> stack;
+    int frameSize;
+    int line = 0;
+    // Where the last instruction emitted starts, and where the destination
+    // operand of the last one that computed into a fresh slot is, so a
+    // SET_LOCAL right after it can have it compute into the local instead.
+    int lastStart = -1;
+    int resultAt = -1;
+    // Which instructions are jumped to, and the offset of the one to
+    // translate after the current one.
+    std::vector<bool> isLabel;
+    int next = 0;
+    // The new offset of every old one, and the forward jumps to patch.
+    std::vector<int> newOffsets;
+    struct Jump {
+        int operand;
+        int target;
+    };
+    std::vector<Jump> jumps;
+
+    OpCode opAt(int offset) { return normalize(OpCode(chunk.getCode(offset))); }
+    uint8_t byteAt(int offset) { return chunk.getCode(offset); }
+    uint16_t shortAt(int offset) {
+        return static_cast<uint16_t>(chunk.getCode(offset) << 8 | chunk.getCode(offset + 1));
+    }
+
+    int length(int offset);
+    int stackEffect(int offset);
+    int jumpTarget(int offset);
+
+    void emit(uint8_t byte) {
+        code.push_back(byte);
+        lines.push_back(line);
+    }
+    void emit(RegisterOp op) {
+        lastStart = static_cast<int>(code.size());
+        emit(static_cast<uint8_t>(op));
+    }
+    void emitShort(uint16_t value) {
+        emit(static_cast<uint8_t>(value >> 8));
+        emit(static_cast<uint8_t>(value & 0xff));
+    }
+    // Emits `op` with `dest` as its destination, which must be the top slot.
+    void emitResult(RegisterOp op, int dest) {
+        emit(op);
+        resultAt = static_cast<int>(code.size());
+        emit(static_cast<uint8_t>(dest));
+    }
+
+    int top() { return static_cast<int>(stack.size()) - 1; }
+    void push(Entry entry) {
+        stack.push_back(entry);
+        frameSize = std::max(frameSize, static_cast<int>(stack.size()));
+    }
+    void materialize(int slot);
+    void flush(int end);
+    int operand(int slot);
+
+    void binary(RegisterOp op, RegisterOp constantOp);
+    bool compareAndJump(RegisterOp op, RegisterOp constantOp);
+    void emitJump(int target);
+    void setLocal(int slot);
+    bool translate(int offset, std::string_view& error);
+
+public:
+    Translator(FunctionObject* function)
+        : function(function), chunk(function->getChunk()), frameSize(function->getArity() + 1) {}
+
+    bool run(std::string_view& error);
+};
+
+int Translator::length(int offset) {
+    return instructionLength(opAt(offset), chunk.getCodeStart() + offset, chunk.getConstants());
+}
+
+int Translator::stackEffect(int offset) {
+    return ::stackEffect(opAt(offset), chunk.getCodeStart() + offset);
+}
+
+int Translator::jumpTarget(int offset) {
+    auto jump = shortAt(offset + 1);
+    return opAt(offset) == OpCode::LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+void Translator::materialize(int slot) {
+    auto& entry = stack[slot];
+    switch (entry.kind) {
+        case Entry::Kind::SLOT:
+            return;
+        case Entry::Kind::REGISTER:
+            emit(RegisterOp::MOVE);
+            emit(static_cast<uint8_t>(slot));
+            emit(entry.operand);
+            break;
+        case Entry::Kind::CONSTANT:
+            emit(RegisterOp::LOAD_CONSTANT);
+            emit(static_cast<uint8_t>(slot));
+            emit(entry.operand);
+            break;
+        case Entry::Kind::NIL:
+            emit(RegisterOp::LOAD_NIL);
+            emit(static_cast<uint8_t>(slot));
+            break;
+        case Entry::Kind::TRUE:
+            emit(RegisterOp::LOAD_TRUE);
+            emit(static_cast<uint8_t>(slot));
+            break;
+        case Entry::Kind::FALSE:
+            emit(RegisterOp::LOAD_FALSE);
+            emit(static_cast<uint8_t>(slot));
+            break;
+    }
+    entry = { Entry::Kind::SLOT };
+}
+
+// Writes out every slot below `end`, for code that reads the stack as a
+// whole: calls, and the other side of a jump.
+void Translator::flush(int end) {
+    for (auto slot = 0; slot < end; slot++) materialize(slot);
+}
+
+// The register that holds the value of `slot`, writing it out first if it is
+// not in one.
+int Translator::operand(int slot) {
+    auto& entry = stack[slot];
+    if (entry.kind == Entry::Kind::REGISTER) return entry.operand;
+    materialize(slot);
+    return slot;
+}
+
+void Translator::binary(RegisterOp op, RegisterOp constantOp) {
+    auto right = top();
+    auto left = right - 1;
+    auto b = stack[right];
+    auto a = operand(left);
+    if (b.kind == Entry::Kind::CONSTANT) {
+        emitResult(constantOp, left);
+        emit(static_cast<uint8_t>(a));
+        emit(b.operand);
+    } else {
+        auto c = operand(right);
+        emitResult(op, left);
+        emit(static_cast<uint8_t>(a));
+        emit(static_cast<uint8_t>(c));
+    }
+    stack.pop_back();
+    stack.back() = { Entry::Kind::SLOT };
+}
+
+// Compares and jumps in one instruction if the comparison is only there for
+// a JUMP_IF_FALSE right after it, whose condition both sides pop.
+bool Translator::compareAndJump(RegisterOp op, RegisterOp constantOp) {
+    auto jump = next;
+    if (isLabel[jump] || opAt(jump) != OpCode::JUMP_IF_FALSE) return false;
+    auto target = jumpTarget(jump);
+    next = jump + length(jump);
+    if (opAt(target) != OpCode::POP || opAt(next) != OpCode::POP) {
+        next = jump;
+        return false;
+    }
+
+    auto right = top();
+    auto left = right - 1;
+    flush(left);
+    auto b = stack[right];
+    auto a = operand(left);
+    auto c = b.kind == Entry::Kind::CONSTANT ? b.operand : operand(right);
+    emit(b.kind == Entry::Kind::CONSTANT ? constantOp : op);
+    emit(static_cast<uint8_t>(a));
+    emit(static_cast<uint8_t>(c));
+    emitJump(target);
+
+    // Both sides pop the condition without looking at it.
+    stack.pop_back();
+    stack.back() = { Entry::Kind::SLOT };
+    return true;
+}
+
+void Translator::emitJump(int target) {
+    jumps.push_back({ static_cast<int>(code.size()), target });
+    emitShort(UINT16_MAX);
+}
+
+void Translator::setLocal(int slot) {
+    auto value = top();
+    auto isRead = false;
+    for (auto i = 0; i < value; i++) isRead = isRead || stack[i].reads(slot);
+
+    // Compute the value straight into the local if nothing else needs the
+    // old one.
+    if (stack[value].kind == Entry::Kind::SLOT && resultAt == lastStart + 1 && resultAt != -1 &&
+        code[resultAt] == value && !isRead) {
+        code[resultAt] = static_cast<uint8_t>(slot);
+        resultAt = -1;
+        stack[slot] = { Entry::Kind::SLOT };
+        stack[value] = { Entry::Kind::REGISTER, static_cast<uint8_t>(slot) };
+        return;
+    }
+
+    for (auto i = 0; i < value; i++) {
+        if (i != slot && stack[i].reads(slot)) materialize(i);
+    }
+    if (stack[value].reads(slot)) return; // Assigning a variable to itself.
+
+    auto entry = stack[value];
+    if (entry.kind == Entry::Kind::SLOT) entry = { Entry::Kind::REGISTER, static_cast<uint8_t>(value) };
+    stack[slot] = entry;
+    materialize(slot);
+}
+
+bool Translator::run(std::string_view& error) {
+    auto count = chunk.count();
+
+    // How deep the stack is before each reachable instruction, and which of
+    // them are jumped to.
+    std::vector<int> depths(count, -1);
+    isLabel.assign(count, false);
+    std::vector<int> worklist;
+    auto reach = [&](int offset, int depth) {
+        if (depths[offset] != -1) return;
+        depths[offset] = depth;
+        worklist.push_back(offset);
+    };
+    reach(0, frameSize);
+    while (!worklist.empty()) {
+        auto offset = worklist.back();
+        worklist.pop_back();
+        auto depth = depths[offset] + stackEffect(offset);
+        switch (opAt(offset)) {
+            case OpCode::JUMP_IF_FALSE:
+                reach(offset + length(offset), depth);
+                // Fall through.
+            case OpCode::JUMP:
+            case OpCode::LOOP:
+                isLabel[jumpTarget(offset)] = true;
+                reach(jumpTarget(offset), depth);
+                break;
+            case OpCode::RETURN:
+                break;
+            default:
+                reach(offset + length(offset), depth);
+        }
+    }
+
+    newOffsets.assign(count, -1);
+    stack.assign(frameSize, { Entry::Kind::SLOT });
+    auto live = true;
+    for (auto offset = 0; offset < count; offset = next) {
+        next = offset + length(offset);
+        if (depths[offset] == -1) continue;
+
+        if (isLabel[offset]) {
+            if (live) flush(top() + 1);
+            stack.assign(depths[offset], { Entry::Kind::SLOT });
+            frameSize = std::max(frameSize, depths[offset]);
+            resultAt = -1;
+        }
+        newOffsets[offset] = static_cast<int>(code.size());
+        line = chunk.getLine(offset);
+
+        if (!translate(offset, error)) return false;
+
+        auto op = opAt(offset);
+        live = op != OpCode::JUMP && op != OpCode::LOOP && op != OpCode::RETURN;
+    }
+
+    if (frameSize > REGISTERS_MAX) {
+        error = "Too many registers in function.";
+        return false;
+    }
+
+    for (auto& jump : jumps) {
+        auto distance = newOffsets[jump.target] - (jump.operand + 2);
+        if (distance > UINT16_MAX) {
+            error = "Too much code to jump over.";
+            return false;
+        }
+        code[jump.operand] = static_cast<uint8_t>(distance >> 8);
+        code[jump.operand + 1] = static_cast<uint8_t>(distance & 0xff);
+    }
+
+    auto& registers = function->getRegisterCode();
+    registers.code.assign(code.begin(), code.end());
+    registers.lines.assign(lines.begin(), lines.end());
+    registers.frameSize = frameSize;
+    return true;
+}
+
+bool Translator::translate(int offset, std::string_view& error) {
+    auto op = opAt(offset);
+    switch (op) {
+        case OpCode::CONSTANT:
+            push({ Entry::Kind::CONSTANT, byteAt(offset + 1) });
+            break;
+        case OpCode::NIL:
+            push({ Entry::Kind::NIL });
+            break;
+        case OpCode::TRUE:
+            push({ Entry::Kind::TRUE });
+            break;
+        case OpCode::FALSE:
+            push({ Entry::Kind::FALSE });
+            break;
+        case OpCode::POP:
+            stack.pop_back();
+            break;
+
+        case OpCode::GET_LOCAL: {
+            auto slot = byteAt(offset + 1);
+            auto entry = stack[slot];
+            if (entry.kind == Entry::Kind::SLOT) entry = { Entry::Kind::REGISTER, slot };
+            push(entry);
+            break;
+        }
+        case OpCode::SET_LOCAL:
+            setLocal(byteAt(offset + 1));
+            break;
+
+        case OpCode::GET_GLOBAL_SLOT:
+            emitResult(RegisterOp::GET_GLOBAL, top() + 1);
+            emitShort(shortAt(offset + 1));
+            push({ Entry::Kind::SLOT });
+            break;
+        case OpCode::DEFINE_GLOBAL_SLOT:
+        case OpCode::SET_GLOBAL_SLOT: {
+            auto value = operand(top());
+            emit(op == OpCode::DEFINE_GLOBAL_SLOT ? RegisterOp::DEFINE_GLOBAL : RegisterOp::SET_GLOBAL);
+            emit(static_cast<uint8_t>(value));
+            emitShort(shortAt(offset + 1));
+            if (op == OpCode::DEFINE_GLOBAL_SLOT) stack.pop_back();
+            break;
+        }
+
+        case OpCode::GET_UPVALUE:
+            emitResult(RegisterOp::GET_UPVALUE, top() + 1);
+            emit(byteAt(offset + 1));
+            push({ Entry::Kind::SLOT });
+            break;
+        case OpCode::SET_UPVALUE: {
+            auto value = operand(top());
+            emit(RegisterOp::SET_UPVALUE);
+            emit(static_cast<uint8_t>(value));
+            emit(byteAt(offset + 1));
+            break;
+        }
+
+        case OpCode::GET_PROPERTY: {
+            auto instance = operand(top());
+            emitResult(RegisterOp::GET_PROPERTY, top());
+            emit(static_cast<uint8_t>(instance));
+            emit(byteAt(offset + 1));
+            emitShort(shortAt(offset + 2));
+            stack.back() = { Entry::Kind::SLOT };
+            break;
+        }
+        case OpCode::SET_PROPERTY: {
+            auto instance = operand(top() - 1);
+            auto value = operand(top());
+            emit(RegisterOp::SET_PROPERTY);
+            emit(static_cast<uint8_t>(instance));
+            emit(static_cast<uint8_t>(value));
+            emit(byteAt(offset + 1));
+            emitShort(shortAt(offset + 2));
+
+            // The value takes the instance's place, unless it is popped
+            // straight away.
+            auto entry = stack.back();
+            stack.pop_back();
+            if (opAt(offset + length(offset)) == OpCode::POP) {
+                stack.back() = { Entry::Kind::SLOT };
+            } else if (entry.kind == Entry::Kind::SLOT) {
+                stack.back() = { Entry::Kind::REGISTER, static_cast<uint8_t>(top() + 1) };
+                materialize(top());
+            } else {
+                stack.back() = entry.reads(top()) ? Entry{ Entry::Kind::SLOT } : entry;
+            }
+            break;
+        }
+        case OpCode::GET_SUPER: {
+            auto receiver = operand(top() - 1);
+            auto superclass = operand(top());
+            stack.pop_back();
+            emitResult(RegisterOp::GET_SUPER, top());
+            emit(static_cast<uint8_t>(receiver));
+            emit(static_cast<uint8_t>(superclass));
+            emitShort(shortAt(offset + 1));
+            stack.back() = { Entry::Kind::SLOT };
+            break;
+        }
+
+        case OpCode::EQUAL:
+            if (compareAndJump(RegisterOp::JUMP_IF_NOT_EQUAL, RegisterOp::JUMP_IF_NOT_EQUAL_K)) break;
+            binary(RegisterOp::EQUAL, RegisterOp::EQUAL_K);
+            break;
+        case OpCode::GREATER:
+            if (compareAndJump(RegisterOp::JUMP_IF_NOT_GREATER, RegisterOp::JUMP_IF_NOT_GREATER_K)) break;
+            binary(RegisterOp::GREATER, RegisterOp::GREATER_K);
+            break;
+        case OpCode::LESS:
+            if (compareAndJump(RegisterOp::JUMP_IF_NOT_LESS, RegisterOp::JUMP_IF_NOT_LESS_K)) break;
+            binary(RegisterOp::LESS, RegisterOp::LESS_K);
+            break;
+        case OpCode::ADD:      binary(RegisterOp::ADD, RegisterOp::ADD_K); break;
+        case OpCode::SUBTRACT: binary(RegisterOp::SUBTRACT, RegisterOp::SUBTRACT_K); break;
+        case OpCode::MULTIPLY: binary(RegisterOp::MULTIPLY, RegisterOp::MULTIPLY_K); break;
+        case OpCode::DIVIDE:   binary(RegisterOp::DIVIDE, RegisterOp::DIVIDE_K); break;
+
+        case OpCode::NOT:
+        case OpCode::NEGATE: {
+            auto value = operand(top());
+            emitResult(op == OpCode::NOT ? RegisterOp::NOT : RegisterOp::NEGATE, top());
+            emit(static_cast<uint8_t>(value));
+            stack.back() = { Entry::Kind::SLOT };
+            break;
+        }
+        case OpCode::PRINT: {
+            auto value = operand(top());
+            emit(RegisterOp::PRINT);
+            emit(static_cast<uint8_t>(value));
+            stack.pop_back();
+            break;
+        }
+
+        case OpCode::JUMP:
+            flush(top() + 1);
+            emit(RegisterOp::JUMP);
+            emitJump(jumpTarget(offset));
+            break;
+        case OpCode::JUMP_IF_FALSE: {
+            // The condition only has to be in its own slot if the other side
+            // of the jump does not pop it first.
+            auto target = jumpTarget(offset);
+            auto condition = top();
+            flush(opAt(target) == OpCode::POP ? condition : condition + 1);
+            auto reg = operand(condition);
+            emit(RegisterOp::JUMP_IF_FALSE);
+            emit(static_cast<uint8_t>(reg));
+            emitJump(target);
+            break;
+        }
+        case OpCode::LOOP: {
+            flush(top() + 1);
+            emit(RegisterOp::LOOP);
+            auto distance = static_cast<int>(code.size()) + 2 - newOffsets[jumpTarget(offset)];
+            if (distance > UINT16_MAX) {
+                error = "Loop body too large.";
+                return false;
+            }
+            emitShort(static_cast<uint16_t>(distance));
+            break;
+        }
+
+        case OpCode::CALL:
+        case OpCode::TAIL_CALL:
+        case OpCode::INVOKE:
+        case OpCode::TAIL_INVOKE:
+        case OpCode::SUPER_INVOKE: {
+            flush(top() + 1);
+            auto isCall = op == OpCode::CALL || op == OpCode::TAIL_CALL;
+            auto isInvoke = op == OpCode::INVOKE || op == OpCode::TAIL_INVOKE;
+            auto argCount = byteAt(offset + (isCall ? 1 : isInvoke ? 2 : 3));
+            auto callee = top() - argCount - (op == OpCode::SUPER_INVOKE ? 1 : 0);
+            if (isCall) {
+                emit(op == OpCode::CALL ? RegisterOp::CALL : RegisterOp::TAIL_CALL);
+                emit(static_cast<uint8_t>(callee));
+                emit(argCount);
+            } else if (isInvoke) {
+                emit(op == OpCode::INVOKE ? RegisterOp::INVOKE : RegisterOp::TAIL_INVOKE);
+                emit(static_cast<uint8_t>(callee));
+                emit(byteAt(offset + 1));
+                emit(argCount);
+                emitShort(shortAt(offset + 3));
+            } else {
+                emit(RegisterOp::SUPER_INVOKE);
+                emit(static_cast<uint8_t>(callee));
+                emitShort(shortAt(offset + 1));
+                emit(argCount);
+            }
+            stack.resize(callee + 1);
+            stack.back() = { Entry::Kind::SLOT };
+            break;
+        }
+
+        case OpCode::CLOSURE: {
+            auto upvalueCount = (length(offset) - 2) / 2;
+            // A local function can capture itself, in the slot it is about
+            // to go in. Every kind of capture but UPVALUE reads a slot.
+            for (auto i = 0; i < upvalueCount; i++) {
+                auto slot = byteAt(offset + 3 + 2 * i);
+                if (byteAt(offset + 2 + 2 * i) && slot <= top()) materialize(slot);
+            }
+            emit(RegisterOp::CLOSURE);
+            emit(static_cast<uint8_t>(top() + 1));
+            for (auto i = 1; i < length(offset); i++) emit(byteAt(offset + i));
+            push({ Entry::Kind::SLOT });
+            break;
+        }
+        case OpCode::CLOSE_UPVALUE:
+            materialize(top());
+            emit(RegisterOp::CLOSE_UPVALUE);
+            emit(static_cast<uint8_t>(top()));
+            stack.pop_back();
+            break;
+        case OpCode::RETURN: {
+            if (stack.back().kind == Entry::Kind::NIL) {
+                emit(RegisterOp::RETURN_NIL);
+                break;
+            }
+            auto value = operand(top());
+            emit(RegisterOp::RETURN);
+            emit(static_cast<uint8_t>(value));
+            break;
+        }
+
+        case OpCode::CLASS:
+            emit(RegisterOp::CLASS);
+            emit(static_cast<uint8_t>(top() + 1));
+            emit(byteAt(offset + 1));
+            push({ Entry::Kind::SLOT });
+            break;
+        case OpCode::INHERIT:
+        case OpCode::METHOD: {
+            auto a = operand(top() - 1);
+            auto b = operand(top());
+            emit(op == OpCode::INHERIT ? RegisterOp::INHERIT : RegisterOp::METHOD);
+            emit(static_cast<uint8_t>(a));
+            emit(static_cast<uint8_t>(b));
+            if (op == OpCode::METHOD) emitShort(shortAt(offset + 1));
+            stack.pop_back();
+            break;
+        }
+
+        default:
+            error = "Unexpected instruction.";
+            return false;
+    }
+    return true;
+}
+
+} // namespace
+
+bool translateToRegisters(FunctionObject* function, std::string_view& error) {
+    return Translator(function).run(error);
+}
+
+static const char* registerOpNames[] = {
+#define REGISTER_OPCODE_NAME(name) "R_" #name,
+    REGISTER_OPCODES(REGISTER_OPCODE_NAME)
+#undef REGISTER_OPCODE_NAME
+};
+
+int RegisterCode::disassembleInstruction(const Chunk& chunk, int offset) const {
+    printf("%04d ", offset);
+    if (offset > 0 && lines[offset] == lines[offset - 1]) {
+        std::cout << "   | ";
+    } else {
+        printf("%4d ", lines[offset]);
+    }
+
+    auto op = RegisterOp(code[offset]);
+    auto byte = [&](int i) { return static_cast<int>(code[offset + i]); };
+    auto word = [&](int i) { return code[offset + i] << 8 | code[offset + i + 1]; };
+    auto constant = [&](int i) { std::cout << " '" << chunk.getConstant(code[offset + i]) << "'"; };
+    printf("%-16s", registerOpNames[code[offset]]);
+
+    switch (op) {
+        case RegisterOp::RETURN_NIL:
+            std::cout << std::endl;
+            return offset + 1;
+        case RegisterOp::LOAD_NIL:
+        case RegisterOp::LOAD_TRUE:
+        case RegisterOp::LOAD_FALSE:
+        case RegisterOp::PRINT:
+        case RegisterOp::CLOSE_UPVALUE:
+        case RegisterOp::RETURN:
+            printf(" r%d\n", byte(1));
+            return offset + 2;
+        case RegisterOp::MOVE:
+        case RegisterOp::NOT:
+        case RegisterOp::NEGATE:
+        case RegisterOp::INHERIT:
+            printf(" r%d r%d\n", byte(1), byte(2));
+            return offset + 3;
+        case RegisterOp::LOAD_CONSTANT:
+        case RegisterOp::CLASS:
+            printf(" r%d", byte(1));
+            constant(2);
+            std::cout << std::endl;
+            return offset + 3;
+        case RegisterOp::GET_GLOBAL:
+        case RegisterOp::DEFINE_GLOBAL:
+        case RegisterOp::SET_GLOBAL:
+            printf(" r%d g%d\n", byte(1), word(2));
+            return offset + 4;
+        case RegisterOp::GET_UPVALUE:
+        case RegisterOp::SET_UPVALUE:
+            printf(" r%d u%d\n", byte(1), byte(2));
+            return offset + 3;
+        case RegisterOp::GET_PROPERTY:
+        case RegisterOp::SET_PROPERTY:
+            printf(" r%d r%d", byte(1), byte(2));
+            constant(3);
+            printf(" cache %d\n", word(4));
+            return offset + 6;
+        case RegisterOp::GET_SUPER:
+            printf(" r%d r%d r%d s%d\n", byte(1), byte(2), byte(3), word(4));
+            return offset + 6;
+        case RegisterOp::METHOD:
+            printf(" r%d r%d s%d\n", byte(1), byte(2), word(3));
+            return offset + 5;
+        case RegisterOp::EQUAL:
+        case RegisterOp::GREATER:
+        case RegisterOp::LESS:
+        case RegisterOp::ADD:
+        case RegisterOp::SUBTRACT:
+        case RegisterOp::MULTIPLY:
+        case RegisterOp::DIVIDE:
+            printf(" r%d r%d r%d\n", byte(1), byte(2), byte(3));
+            return offset + 4;
+        case RegisterOp::EQUAL_K:
+        case RegisterOp::GREATER_K:
+        case RegisterOp::LESS_K:
+        case RegisterOp::ADD_K:
+        case RegisterOp::SUBTRACT_K:
+        case RegisterOp::MULTIPLY_K:
+        case RegisterOp::DIVIDE_K:
+            printf(" r%d r%d", byte(1), byte(2));
+            constant(3);
+            std::cout << std::endl;
+            return offset + 4;
+        case RegisterOp::JUMP:
+            printf(" -> %d\n", offset + 3 + word(1));
+            return offset + 3;
+        case RegisterOp::LOOP:
+            printf(" -> %d\n", offset + 3 - word(1));
+            return offset + 3;
+        case RegisterOp::JUMP_IF_FALSE:
+            printf(" r%d -> %d\n", byte(1), offset + 4 + word(2));
+            return offset + 4;
+        case RegisterOp::JUMP_IF_NOT_EQUAL:
+        case RegisterOp::JUMP_IF_NOT_GREATER:
+        case RegisterOp::JUMP_IF_NOT_LESS:
+            printf(" r%d r%d -> %d\n", byte(1), byte(2), offset + 5 + word(3));
+            return offset + 5;
+        case RegisterOp::JUMP_IF_NOT_EQUAL_K:
+        case RegisterOp::JUMP_IF_NOT_GREATER_K:
+        case RegisterOp::JUMP_IF_NOT_LESS_K:
+            printf(" r%d", byte(1));
+            constant(2);
+            printf(" -> %d\n", offset + 5 + word(3));
+            return offset + 5;
+        case RegisterOp::CALL:
+        case RegisterOp::TAIL_CALL:
+            printf(" r%d (%d args)\n", byte(1), byte(2));
+            return offset + 3;
+        case RegisterOp::INVOKE:
+        case RegisterOp::TAIL_INVOKE:
+            printf(" r%d (%d args)", byte(1), byte(3));
+            constant(2);
+            printf(" cache %d\n", word(4));
+            return offset + 6;
+        case RegisterOp::SUPER_INVOKE:
+            printf(" r%d s%d (%d args)\n", byte(1), word(2), byte(4));
+            return offset + 5;
+        case RegisterOp::CLOSURE: {
+            printf(" r%d", byte(1));
+            constant(2);
+            std::cout << std::endl;
+            auto function = chunk.getConstant(code[offset + 2]).as<FunctionObject>();
+            offset += 3;
+            for (int j = 0; j < function->getUpvalueCount(); j++) {
+                auto kind = Capture(code[offset++]);
+                int index = code[offset++];
+                printf("%04d      |                     %s %d\n", offset - 2, captureName(kind), index);
+            }
+            return offset;
+        }
+    }
+
+    std::cout << "Unknown opcode: " << static_cast<int>(code[offset]) << std::endl;
+    return offset + 1;
+}
+
+void RegisterCode::disassemble(const Chunk& chunk, std::string_view name) const {
+    std::cout << "== " << name << " (registers: " << frameSize << ") ==" << std::endl;
+
+    for (auto i = 0; i < static_cast<int>(code.size());) {
+        i = disassembleInstruction(chunk, i);
+    }
+}
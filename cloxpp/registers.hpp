@@ -0,0 +1,101 @@
+//
+//  registers.hpp
+//  cloxpp
+//
+
+#ifndef registers_hpp
+#define registers_hpp
+
+#include "common.hpp"
+#include <cstdint>
+#include <string_view>
+
+// The instructions of the register backend. Their operands name registers,
+// which are the slots of the running frame: the callee, the arguments and
+// locals, and then the temporaries. Registers, constants, upvalues and
+// argument counts take a byte each; globals, method selectors, jumps and
+// inline caches take two. The first register operand is where the result
+// goes, if there is one.
+//
+// The *_K variants of the binary operators take their right operand from
+// the constant table instead of a register.
+//
+// The JUMP_IF_NOT_* instructions are a comparison and the JUMP_IF_FALSE on
+// its result in one, for conditions that are not needed after the jump.
+#define REGISTER_OPCODES(X) \
+    X(MOVE)                   /* A B: A = B */ \
+    X(LOAD_CONSTANT)          /* A K */ \
+    X(LOAD_NIL)               /* A */ \
+    X(LOAD_TRUE)              /* A */ \
+    X(LOAD_FALSE)             /* A */ \
+    X(GET_GLOBAL)             /* A G */ \
+    X(DEFINE_GLOBAL)          /* A G */ \
+    X(SET_GLOBAL)             /* A G */ \
+    X(GET_UPVALUE)            /* A U */ \
+    X(SET_UPVALUE)            /* A U */ \
+    X(GET_PROPERTY)           /* A B K C: A = B.K */ \
+    X(SET_PROPERTY)           /* A B K C: A.K = B */ \
+    X(GET_SUPER)              /* A B C S: A = method S of superclass C bound to B */ \
+    X(EQUAL)                  /* A B C */ \
+    X(GREATER)                /* A B C */ \
+    X(LESS)                   /* A B C */ \
+    X(ADD)                    /* A B C */ \
+    X(SUBTRACT)               /* A B C */ \
+    X(MULTIPLY)               /* A B C */ \
+    X(DIVIDE)                 /* A B C */ \
+    X(EQUAL_K)                /* A B K */ \
+    X(GREATER_K)              /* A B K */ \
+    X(LESS_K)                 /* A B K */ \
+    X(ADD_K)                  /* A B K */ \
+    X(SUBTRACT_K)             /* A B K */ \
+    X(MULTIPLY_K)             /* A B K */ \
+    X(DIVIDE_K)               /* A B K */ \
+    X(NOT)                    /* A B */ \
+    X(NEGATE)                 /* A B */ \
+    X(PRINT)                  /* A */ \
+    X(JUMP)                   /* J */ \
+    X(JUMP_IF_FALSE)          /* A J */ \
+    X(JUMP_IF_NOT_EQUAL)      /* A B J: jumps unless A == B */ \
+    X(JUMP_IF_NOT_GREATER)    /* A B J */ \
+    X(JUMP_IF_NOT_LESS)       /* A B J */ \
+    X(JUMP_IF_NOT_EQUAL_K)    /* A K J */ \
+    X(JUMP_IF_NOT_GREATER_K)  /* A K J */ \
+    X(JUMP_IF_NOT_LESS_K)     /* A K J */ \
+    X(LOOP)                   /* J */ \
+    X(CALL)                   /* A N: calls A with the N registers after it */ \
+    X(INVOKE)                 /* A K N C */ \
+    X(SUPER_INVOKE)           /* A S N: the superclass is in the register after the arguments */ \
+    X(TAIL_CALL)              /* A N: CALL in place of the running frame */ \
+    X(TAIL_INVOKE)            /* A K N C */ \
+    X(CLOSURE)                /* A K, then a Capture and index byte per upvalue */ \
+    X(CLOSE_UPVALUE)          /* A */ \
+    X(RETURN)                 /* A */ \
+    X(RETURN_NIL)             /* returns nil */ \
+    X(CLASS)                  /* A K */ \
+    X(INHERIT)                /* A B: B inherits from A */ \
+    X(METHOD)                 /* A B S: method S of A = B */
+
+enum class RegisterOp: uint8_t {
+#define REGISTER_OPCODE_ENUM(name) name,
+    REGISTER_OPCODES(REGISTER_OPCODE_ENUM)
+#undef REGISTER_OPCODE_ENUM
+};
+
+// The most registers a frame can have, since operands are a byte.
+#define REGISTERS_MAX UINT8_COUNT
+
+class FunctionObject;
+
+// Translates the stack bytecode of `function` into register code, which it
+// keeps alongside. Every stack slot becomes the register of the same index,
+// so locals stay where they are. Reads of locals and constants are not
+// copied into a temporary until something needs them there, and a result
+// that is stored straight into a local is computed into it, so most of the
+// traffic of the stack machine goes away. Only knows about the function
+// itself; the ones in its constants are translated separately.
+//
+// Fails, with `error` set, if the function needs more than REGISTERS_MAX
+// registers.
+bool translateToRegisters(FunctionObject* function, std::string_view& error);
+
+#endif /* registers_hpp */
@@ -90,7 +90,7 @@ Token Scanner::makeToken(TokenType type) {
     return Token(type, text, line);
 }
 
-Token Scanner::errorToken(const std::string& message) {
+Token Scanner::errorToken(const char* message) {
     return Token(TokenType::ERROR, message, line);
 }
 
@@ -124,7 +124,7 @@ void Scanner::skipWhitespace() {
     }
 }
 
-TokenType Scanner::checkKeyword(size_t pos, size_t len, std::string rest, TokenType type) {
+TokenType Scanner::checkKeyword(size_t pos, size_t len, std::string_view rest, TokenType type) {
     if (current - start == pos + len && source.compare(start + pos, len, rest) == 0) {
         return type;
     }
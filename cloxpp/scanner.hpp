@@ -10,6 +10,7 @@
 #define scanner_hpp
 
 #include <string>
+#include <string_view>
 
 enum class TokenType {
     // Single-character tokens.
@@ -64,10 +65,10 @@ class Scanner {
     bool match(char expected);
     
     Token makeToken(TokenType type);
-    Token errorToken(const std::string& message);
+    Token errorToken(const char* message);
     
     void skipWhitespace();
-    TokenType checkKeyword(size_t pos, size_t len, std::string rest, TokenType type);
+    TokenType checkKeyword(size_t pos, size_t len, std::string_view rest, TokenType type);
     TokenType identifierType();
     Token identifier();
     Token number();
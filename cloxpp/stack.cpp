@@ -0,0 +1,54 @@
+//
+//  stack.cpp
+//  cloxpp
+//
+
+#include "stack.hpp"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstdint>
+#include <new>
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+// Address space for `bytes`, which the operating system only backs once it
+// is touched.
+static void* reserveAddressSpace(size_t bytes) {
+    auto mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapped == MAP_FAILED) throw std::bad_alloc();
+    return mapped;
+}
+
+ValueStack::~ValueStack() {
+    munmap(base, capacity * sizeof(Value));
+}
+
+void ValueStack::reserve(size_t capacity) {
+    if (base != nullptr) munmap(base, this->capacity * sizeof(Value));
+
+    base = static_cast<Value*>(reserveAddressSpace(capacity * sizeof(Value)));
+    top = base;
+    this->capacity = capacity;
+}
+
+void ValueStack::releaseUnused() {
+    auto pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    auto start = (reinterpret_cast<uintptr_t>(top) + pageSize - 1) & ~(pageSize - 1);
+    auto end = reinterpret_cast<uintptr_t>(base + capacity);
+    if (start < end) madvise(reinterpret_cast<void*>(start), end - start, MADV_DONTNEED);
+}
+
+CallStack::~CallStack() {
+    munmap(base, static_cast<size_t>(limit - base) * sizeof(CallFrame));
+}
+
+void CallStack::reserve(size_t capacity) {
+    if (base != nullptr) munmap(base, static_cast<size_t>(limit - base) * sizeof(CallFrame));
+
+    base = static_cast<CallFrame*>(reserveAddressSpace(capacity * sizeof(CallFrame)));
+    top = base;
+    limit = base + capacity;
+}
@@ -0,0 +1,102 @@
+//
+//  stack.hpp
+//  cloxpp
+//
+
+#ifndef stack_hpp
+#define stack_hpp
+
+#include "value.hpp"
+#include <cstddef>
+
+// The VM's value stack. Its whole capacity is reserved as address space up
+// front and the operating system only backs the pages that are actually
+// touched, so it never moves (open upvalues and the running frame point into
+// it) and costs next to nothing until a script recurses deeply.
+class ValueStack {
+    Value* base = nullptr;
+    Value* top = nullptr;
+    size_t capacity = 0;
+
+public:
+    explicit ValueStack(size_t capacity) { reserve(capacity); }
+    ValueStack(const ValueStack&) = delete;
+    ValueStack& operator=(const ValueStack&) = delete;
+    ~ValueStack();
+
+    // Replaces the reservation with one for `capacity` values. Only valid
+    // while the stack is empty.
+    void reserve(size_t capacity);
+    // Hands the pages above the top back to the operating system.
+    void releaseUnused();
+
+    void push(Value value) { *top++ = value; }
+    Value pop() { return *--top; }
+    Value& back() { return top[-1]; }
+    Value& operator[](size_t index) { return base[index]; }
+
+    size_t size() const { return static_cast<size_t>(top - base); }
+    size_t getCapacity() const { return capacity; }
+    bool empty() const { return top == base; }
+    // Drops everything above the first `size` values.
+    void truncate(size_t size) { top = base + size; }
+    // Moves the top to just after the first `size` values. Values it
+    // uncovers are set to nil, since the collector never looked at them
+    // while they were above the top.
+    void resize(size_t size) {
+        auto end = base + size;
+        while (top < end) *top++ = Value();
+        top = end;
+    }
+    void clear() { top = base; }
+
+    Value* begin() { return base; }
+    Value* end() { return top; }
+};
+
+struct CallFrame {
+    Closure closure;
+    // Into the function's chunk or its register code, depending on the
+    // backend. Only up to date while the frame is not the one running;
+    // `VM::run` keeps the running frame's in a local, and native code has
+    // none.
+    uint8_t* ip;
+    unsigned long stackOffset;
+    // Where native code goes on in the caller once this frame returns, if
+    // native code called it.
+    const uint8_t* nativeReturn = nullptr;
+};
+
+// The VM's call frames, reserved up front like the value stack so that they
+// never move and native code can push and pop them itself.
+class CallStack {
+    CallFrame* base = nullptr;
+    CallFrame* top = nullptr;
+    CallFrame* limit = nullptr;
+
+    friend struct JitLayout;
+
+public:
+    explicit CallStack(size_t capacity) { reserve(capacity); }
+    CallStack(const CallStack&) = delete;
+    CallStack& operator=(const CallStack&) = delete;
+    ~CallStack();
+
+    // Only valid while the stack is empty.
+    void reserve(size_t capacity);
+
+    void push(const CallFrame& frame) { *top++ = frame; }
+    void pop() { top--; }
+    CallFrame& back() { return top[-1]; }
+    CallFrame& operator[](size_t index) { return base[index]; }
+
+    size_t size() const { return static_cast<size_t>(top - base); }
+    bool empty() const { return top == base; }
+    bool full() const { return top == limit; }
+    void clear() { top = base; }
+
+    CallFrame* begin() { return base; }
+    CallFrame* end() { return top; }
+};
+
+#endif /* stack_hpp */
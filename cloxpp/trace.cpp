@@ -0,0 +1,781 @@
+//
+//  trace.cpp
+//  cloxpp
+//
+
+#include "jit.hpp"
+#include "vm.hpp"
+
+#ifdef X86_64_JIT
+
+#include "x86.hpp"
+#include <functional>
+#include <optional>
+
+namespace {
+
+// The values a trace can work on. Running into anything else ends a
+// recording.
+enum class TraceType: uint8_t { NUMBER, BOOL, NIL };
+
+std::optional<TraceType> typeOf(Value value) {
+    if (value.isNumber()) return TraceType::NUMBER;
+    if (value.isBool()) return TraceType::BOOL;
+    if (value.isNil()) return TraceType::NIL;
+    return std::nullopt;
+}
+
+// Superinstructions are recorded part by part, and quickened instructions
+// as the ones they replace.
+OpCode normalize(OpCode op) {
+    if (auto superinstruction = findSuperinstruction(op)) return superinstruction->parts[0];
+    switch (op) {
+        case OpCode::GREATER_NUM: return OpCode::GREATER;
+        case OpCode::LESS_NUM: return OpCode::LESS;
+        case OpCode::ADD_NUM: return OpCode::ADD;
+        case OpCode::SUBTRACT_NUM: return OpCode::SUBTRACT;
+        case OpCode::MULTIPLY_NUM: return OpCode::MULTIPLY;
+        case OpCode::DIVIDE_NUM: return OpCode::DIVIDE;
+        default: return op;
+    }
+}
+
+// One instruction a recording ran, and what it saw.
+struct TraceStep {
+    int offset;
+    OpCode op;
+    // The constant, local or global slot the instruction takes.
+    int operand = 0;
+    // Of the value a GET_LOCAL or GET_GLOBAL_SLOT read, or a SET_LOCAL
+    // stored.
+    TraceType type = TraceType::NIL;
+    // Whether a JUMP_IF_FALSE jumped.
+    bool jumped = false;
+};
+
+struct Trace {
+    // Where the loop starts, and how many slots the frame has there.
+    int header = 0;
+    int height = 0;
+    // What the slots below `height` held when the recording started.
+    std::vector<std::optional<TraceType>> slots;
+    std::vector<TraceStep> steps;
+};
+
+// Runs a loop's instructions from its start, on the VM's own stack, noting
+// what it sees, for as long as they only work on values a trace can hold
+// and never need the rest of the VM. Stops before the first one that does
+// not, or once it is back at the start.
+class TraceRecorder {
+    Chunk& chunk;
+    const uint8_t* start;
+    ValueStack& stack;
+    Value* slots;
+    GlobalTable& globals;
+    Trace trace;
+    int offset = 0;
+
+    uint16_t shortAt(int offset) const { return static_cast<uint16_t>(start[offset] << 8 | start[offset + 1]); }
+    bool step(bool& closed);
+
+public:
+    TraceRecorder(Chunk& chunk, ValueStack& stack, Value* slots, GlobalTable& globals)
+        : chunk(chunk), start(chunk.getCodeStart()), stack(stack), slots(slots), globals(globals) {}
+
+    // Returns true if it got back to `header`.
+    bool run(int header);
+    int stoppedAt() const { return offset; }
+    const Trace& getTrace() const { return trace; }
+};
+
+bool TraceRecorder::run(int header) {
+    trace.header = header;
+    trace.height = static_cast<int>(stack.end() - slots);
+    for (auto slot = 0; slot < trace.height; slot++) trace.slots.push_back(typeOf(slots[slot]));
+
+    offset = header;
+    while (trace.steps.size() < JIT_TRACE_LENGTH_MAX) {
+        auto closed = false;
+        if (!step(closed)) return false;
+        if (closed) return true;
+    }
+    return false;
+}
+
+// Leaves `offset` where it is unless it runs the instruction there.
+bool TraceRecorder::step(bool& closed) {
+    auto ip = start + offset;
+    TraceStep step{ offset, normalize(OpCode(*ip)) };
+    auto next = offset + 1;
+
+    auto numbers = [this] { return stack.end()[-2].isNumber() && stack.end()[-1].isNumber(); };
+    auto a = [this] { return stack.end()[-2].asNumber(); };
+    auto b = [this] { return stack.end()[-1].asNumber(); };
+    auto binary = [this](Value result) {
+        stack.pop();
+        stack.back() = result;
+    };
+
+    switch (step.op) {
+        case OpCode::CONSTANT:
+            if (!typeOf(chunk.getConstant(ip[1]))) return false;
+            step.operand = ip[1];
+            stack.push(chunk.getConstant(ip[1]));
+            next = offset + 2;
+            break;
+        case OpCode::NIL: stack.push(Value()); break;
+        case OpCode::TRUE: stack.push(Value(true)); break;
+        case OpCode::FALSE: stack.push(Value(false)); break;
+        case OpCode::POP: stack.pop(); break;
+
+        case OpCode::GET_LOCAL: {
+            auto type = typeOf(slots[ip[1]]);
+            if (!type) return false;
+            step.operand = ip[1];
+            step.type = *type;
+            stack.push(slots[ip[1]]);
+            next = offset + 2;
+            break;
+        }
+        case OpCode::SET_LOCAL:
+            step.operand = ip[1];
+            step.type = *typeOf(stack.back());
+            slots[ip[1]] = stack.back();
+            next = offset + 2;
+            break;
+        case OpCode::GET_GLOBAL_SLOT: {
+            auto type = typeOf(globals.values[shortAt(offset + 1)]);
+            if (!type) return false;
+            step.operand = shortAt(offset + 1);
+            step.type = *type;
+            stack.push(globals.values[step.operand]);
+            next = offset + 3;
+            break;
+        }
+        // Only ever stores values that are not objects, so it needs no
+        // barrier.
+        case OpCode::SET_GLOBAL_SLOT:
+            step.operand = shortAt(offset + 1);
+            if (globals.values[step.operand].isUndefined()) return false;
+            globals.values[step.operand] = stack.back();
+            next = offset + 3;
+            break;
+
+        case OpCode::EQUAL: binary(stack.end()[-2] == stack.end()[-1]); break;
+        case OpCode::GREATER:
+            if (!numbers()) return false;
+            binary(a() > b());
+            break;
+        case OpCode::LESS:
+            if (!numbers()) return false;
+            binary(a() < b());
+            break;
+        case OpCode::ADD:
+            if (!numbers()) return false;
+            binary(a() + b());
+            break;
+        case OpCode::SUBTRACT:
+            if (!numbers()) return false;
+            binary(a() - b());
+            break;
+        case OpCode::MULTIPLY:
+            if (!numbers()) return false;
+            binary(a() * b());
+            break;
+        case OpCode::DIVIDE:
+            if (!numbers()) return false;
+            binary(a() / b());
+            break;
+        case OpCode::NOT: stack.back() = Value(stack.back().isFalsy()); break;
+        case OpCode::NEGATE:
+            if (!stack.back().isNumber()) return false;
+            stack.back() = Value(-stack.back().asNumber());
+            break;
+
+        case OpCode::JUMP: next = offset + 3 + shortAt(offset + 1); break;
+        case OpCode::JUMP_IF_FALSE:
+            step.jumped = stack.back().isFalsy();
+            next = offset + 3 + (step.jumped ? shortAt(offset + 1) : 0);
+            break;
+        // An inner loop is followed around like any other jump, until it is
+        // done or the trace gets too long.
+        case OpCode::LOOP:
+            next = offset + 3 - shortAt(offset + 1);
+            closed = next == trace.header;
+            break;
+
+        default:
+            return false;
+    }
+
+    trace.steps.push_back(step);
+    offset = next;
+    return true;
+}
+
+// Where the value in a slot is while a trace runs. Slots are numbered from
+// the bottom of the frame.
+struct Entry {
+    enum class Kind: uint8_t {
+        // In the slot itself.
+        MEMORY,
+        // Unboxed in `reg`.
+        REGISTER,
+        // Known to be `constant`.
+        CONSTANT,
+        // A comparison that is true if the flags say ABOVE.
+        CONDITION,
+    };
+
+    Kind kind = Kind::MEMORY;
+    // Only unknown for slots in MEMORY the trace has not read yet.
+    std::optional<TraceType> type;
+    Xmm reg = XMM0;
+    Value constant;
+
+    static Entry memory(std::optional<TraceType> type) { return { Kind::MEMORY, type, XMM0, Value() }; }
+    static Entry inRegister(Xmm reg) { return { Kind::REGISTER, TraceType::NUMBER, reg, Value() }; }
+    static Entry known(Value value) { return { Kind::CONSTANT, typeOf(value), XMM0, value }; }
+    static Entry condition() { return { Kind::CONDITION, TraceType::BOOL, XMM0, Value() }; }
+};
+
+// Numbers are computed in the registers below TRACE_REGISTERS, some of
+// which are homes for locals. The two above are for loading operands.
+constexpr int TRACE_REGISTERS = 14;
+constexpr int TRACE_HOMES_MAX = 8;
+constexpr Xmm SCRATCH = XMM14;
+constexpr Xmm SCRATCH2 = XMM15;
+constexpr Reg GLOBALS = R11;
+
+// Compiles a trace to a loop that goes around until one of its guards
+// fails. Locals that hold numbers every time around are loaded into a
+// register of their own, their home, on the way in and stay there. Other
+// values are worked on wherever the entry for their slot says they are,
+// and only written back to the stack at the end of each iteration or when
+// the trace leaves.
+//
+// A guard leaves for the native code of the instruction it belongs to,
+// before that instruction has run, so what it writes back is the state the
+// instruction expects.
+class TraceCompiler {
+    const Trace& trace;
+    Chunk& chunk;
+    NativeCode& function;
+    uint64_t* exits;
+    Assembler as;
+    std::vector<Entry> stack;
+    // The home of each slot below the trace's height, or -1.
+    std::vector<int> homes;
+    bool isHome[TRACE_REGISTERS] = {};
+    std::vector<Xmm> freeRegisters;
+    bool failed = false;
+    std::vector<std::function<void()>> exitPaths;
+    std::vector<Assembler::Indirect> indirects;
+
+    int top() const { return static_cast<int>(stack.size()) - 1; }
+    static int32_t slot(int index) { return index * VALUE_SIZE; }
+    bool isTemporary(const Entry& entry) const { return entry.kind == Entry::Kind::REGISTER && !isHome[entry.reg]; }
+
+    Xmm allocate();
+    void release(const Entry& entry) {
+        if (isTemporary(entry)) freeRegisters.push_back(entry.reg);
+    }
+    void replace(int index, Entry entry) {
+        release(stack[index]);
+        stack[index] = entry;
+    }
+    void pop() {
+        release(stack.back());
+        stack.pop_back();
+    }
+
+    void box(Reg dst, const Entry& entry, int index);
+    Xmm operand(int index, Xmm scratch);
+    Xmm temporary(int index);
+    void flush(int index, const Entry& entry);
+    void storeBoolean(int index, Condition condition);
+
+    void exitTo(int offset, const std::vector<Entry>& snapshot);
+    void guard(Condition condition, int offset) { guard(condition, offset, stack); }
+    void guard(Condition condition, int offset, const std::vector<Entry>& snapshot);
+    void guardType(Reg reg, TraceType type, int offset);
+
+    void getLocal(const TraceStep& step);
+    void setLocal(const TraceStep& step);
+    void getGlobal(const TraceStep& step);
+    void arithmetic(OpCode op);
+    void compare(bool less);
+    void equal();
+    void negate();
+    void jumpIfFalse(const TraceStep& step);
+    void close();
+    void step(const TraceStep& step);
+
+public:
+    TraceCompiler(const Trace& trace, Chunk& chunk, NativeCode& function, uint64_t* exits)
+        : trace(trace), chunk(chunk), function(function), exits(exits) {}
+
+    bool run(NativeCode& native);
+    size_t codeSize() const { return as.position(); }
+};
+
+// Running out of registers fails the compilation, but only once it is done.
+Xmm TraceCompiler::allocate() {
+    if (freeRegisters.empty()) {
+        failed = true;
+        return SCRATCH;
+    }
+    auto reg = freeRegisters.back();
+    freeRegisters.pop_back();
+    return reg;
+}
+
+// Leaves the bits of the value `entry` says slot `index` has in `dst`.
+// Clobbers RAX.
+void TraceCompiler::box(Reg dst, const Entry& entry, int index) {
+    switch (entry.kind) {
+        case Entry::Kind::MEMORY: as.load(dst, SLOTS, slot(index)); break;
+        case Entry::Kind::REGISTER: as.movq(dst, entry.reg); break;
+        case Entry::Kind::CONSTANT: as.movImmediate(dst, JitLayout::of(entry.constant)); break;
+        case Entry::Kind::CONDITION:
+            as.setcc(Condition::ABOVE, RAX);
+            as.movzx8(RAX, RAX);
+            as.lea(RAX, NIL, RAX, static_cast<int8_t>(JitLayout::FALSE - JitLayout::NIL));
+            if (dst != RAX) as.mov(dst, RAX);
+            break;
+    }
+}
+
+// The register the number in slot `index` is in, after loading it into
+// `scratch` if it is not in one. Clobbers RAX.
+Xmm TraceCompiler::operand(int index, Xmm scratch) {
+    auto& entry = stack[index];
+    if (entry.type != TraceType::NUMBER) failed = true;
+    if (entry.kind == Entry::Kind::REGISTER) return entry.reg;
+    box(RAX, entry, index);
+    as.movq(scratch, RAX);
+    return scratch;
+}
+
+// A register to compute into that holds the number in slot `index`, and
+// that the slot's entry then says it is in: its own, if it is a temporary.
+Xmm TraceCompiler::temporary(int index) {
+    if (isTemporary(stack[index])) return stack[index].reg;
+    auto source = operand(index, SCRATCH);
+    auto reg = allocate();
+    as.movapd(reg, source);
+    replace(index, Entry::inRegister(reg));
+    return reg;
+}
+
+void TraceCompiler::flush(int index, const Entry& entry) {
+    if (entry.kind == Entry::Kind::MEMORY) return;
+    box(RAX, entry, index);
+    as.store(SLOTS, slot(index), RAX);
+}
+
+// Stores into slot `index` the boolean that is true if `condition` holds.
+void TraceCompiler::storeBoolean(int index, Condition condition) {
+    as.setcc(condition, RAX);
+    as.movzx8(RAX, RAX);
+    as.lea(RAX, NIL, RAX, static_cast<int8_t>(JitLayout::FALSE - JitLayout::NIL));
+    as.store(SLOTS, slot(index), RAX);
+    replace(index, Entry::memory(TraceType::BOOL));
+}
+
+// Writes `snapshot` back to the stack, counts the exit, and leaves for the
+// native code of the instruction at `offset`.
+void TraceCompiler::exitTo(int offset, const std::vector<Entry>& snapshot) {
+    for (auto index = 0; index < static_cast<int>(snapshot.size()); index++) flush(index, snapshot[index]);
+    as.lea(TOP, SLOTS, slot(static_cast<int>(snapshot.size())));
+    as.movImmediate(RCX, reinterpret_cast<uint64_t>(exits));
+    as.increment(RCX, 0);
+    indirects.push_back({ as.jumpIndirect(), function.code + function.offsets[offset] });
+}
+
+// Leaves, out of line, if `condition` holds.
+void TraceCompiler::guard(Condition condition, int offset, const std::vector<Entry>& snapshot) {
+    auto jump = as.jump(condition);
+    exitPaths.push_back([this, jump, offset, snapshot] {
+        as.bind(jump);
+        exitTo(offset, snapshot);
+    });
+}
+
+// Leaves unless the bits in `reg` are a value of type `type`. Clobbers RCX.
+void TraceCompiler::guardType(Reg reg, TraceType type, int offset) {
+    switch (type) {
+        case TraceType::NUMBER:
+            as.mov(RCX, reg);
+            as.andRegister(RCX, QNAN);
+            as.cmp(RCX, QNAN);
+            guard(Condition::EQUAL, offset);
+            break;
+        case TraceType::BOOL:
+            as.mov(RCX, reg);
+            as.sub(RCX, NIL);
+            as.subImmediate(RCX, static_cast<int32_t>(JitLayout::FALSE - JitLayout::NIL));
+            as.cmpImmediate(RCX, 1);
+            guard(Condition::ABOVE, offset);
+            break;
+        case TraceType::NIL:
+            as.cmp(reg, NIL);
+            guard(Condition::NOT_EQUAL, offset);
+            break;
+    }
+}
+
+// The first read of a slot the trace knows nothing about checks that it
+// holds what it did when the trace was recorded.
+void TraceCompiler::getLocal(const TraceStep& step) {
+    auto entry = stack[step.operand];
+    switch (entry.kind) {
+        case Entry::Kind::MEMORY:
+            as.load(RAX, SLOTS, slot(step.operand));
+            if (!entry.type) {
+                guardType(RAX, step.type, step.offset);
+                stack[step.operand].type = entry.type = step.type;
+            }
+            if (entry.type == TraceType::NUMBER) {
+                auto reg = allocate();
+                as.movq(reg, RAX);
+                stack.push_back(Entry::inRegister(reg));
+            } else {
+                as.store(SLOTS, slot(top() + 1), RAX);
+                stack.push_back(entry);
+            }
+            break;
+        case Entry::Kind::REGISTER: {
+            auto reg = allocate();
+            as.movapd(reg, entry.reg);
+            stack.push_back(Entry::inRegister(reg));
+            break;
+        }
+        default:
+            stack.push_back(entry);
+            break;
+    }
+}
+
+void TraceCompiler::setLocal(const TraceStep& step) {
+    auto local = step.operand;
+    auto value = stack.back();
+    if (local < trace.height && homes[local] >= 0) {
+        auto home = static_cast<Xmm>(homes[local]);
+        auto reg = operand(top(), home);
+        if (reg != home) as.movapd(home, reg);
+        return;
+    }
+
+    switch (value.kind) {
+        case Entry::Kind::REGISTER:
+            if (isTemporary(stack[local])) {
+                as.movapd(stack[local].reg, value.reg);
+            } else {
+                auto reg = allocate();
+                as.movapd(reg, value.reg);
+                replace(local, Entry::inRegister(reg));
+            }
+            break;
+        case Entry::Kind::MEMORY:
+            as.load(RAX, SLOTS, slot(top()));
+            as.store(SLOTS, slot(local), RAX);
+            replace(local, value);
+            break;
+        default:
+            replace(local, value);
+            break;
+    }
+}
+
+void TraceCompiler::getGlobal(const TraceStep& step) {
+    as.load(RAX, GLOBALS, slot(step.operand));
+    guardType(RAX, step.type, step.offset);
+    if (step.type == TraceType::NUMBER) {
+        auto reg = allocate();
+        as.movq(reg, RAX);
+        stack.push_back(Entry::inRegister(reg));
+    } else {
+        as.store(SLOTS, slot(top() + 1), RAX);
+        stack.push_back(Entry::memory(step.type));
+    }
+}
+
+void TraceCompiler::arithmetic(OpCode op) {
+    auto& a = stack[top() - 1];
+    auto& b = stack[top()];
+    if (a.kind == Entry::Kind::CONSTANT && b.kind == Entry::Kind::CONSTANT) {
+        auto x = a.constant.asNumber();
+        auto y = b.constant.asNumber();
+        Value result;
+        switch (op) {
+            case OpCode::ADD: result = x + y; break;
+            case OpCode::SUBTRACT: result = x - y; break;
+            case OpCode::MULTIPLY: result = x * y; break;
+            default: result = x / y; break;
+        }
+        pop();
+        replace(top(), Entry::known(result));
+        return;
+    }
+
+    auto dst = temporary(top() - 1);
+    auto src = operand(top(), SCRATCH2);
+    switch (op) {
+        case OpCode::ADD: as.arithmetic(0x58, dst, src); break;
+        case OpCode::SUBTRACT: as.arithmetic(0x5c, dst, src); break;
+        case OpCode::MULTIPLY: as.arithmetic(0x59, dst, src); break;
+        default: as.arithmetic(0x5e, dst, src); break;
+    }
+    pop();
+}
+
+// GREATER, or LESS, which is GREATER with its operands the other way round.
+// Leaves the comparison in the flags for a JUMP_IF_FALSE to guard on.
+void TraceCompiler::compare(bool less) {
+    auto a = operand(top() - 1, SCRATCH);
+    auto b = operand(top(), SCRATCH2);
+    if (less) {
+        as.ucomisd(b, a);
+    } else {
+        as.ucomisd(a, b);
+    }
+    pop();
+    replace(top(), Entry::condition());
+}
+
+// Numbers are compared as doubles, so that NaN is not equal to itself. The
+// other values a trace holds are equal if their bits are.
+void TraceCompiler::equal() {
+    auto a = stack[top() - 1];
+    auto b = stack[top()];
+    if (!a.type || !b.type) failed = true;
+    if ((a.type == TraceType::NUMBER) != (b.type == TraceType::NUMBER)) {
+        pop();
+        replace(top(), Entry::known(Value(false)));
+        return;
+    }
+    if (a.kind == Entry::Kind::CONSTANT && b.kind == Entry::Kind::CONSTANT) {
+        pop();
+        replace(top(), Entry::known(Value(a.constant == b.constant)));
+        return;
+    }
+
+    if (a.type == TraceType::NUMBER) {
+        auto x = operand(top() - 1, SCRATCH);
+        auto y = operand(top(), SCRATCH2);
+        as.ucomisd(x, y);
+        as.setcc(Condition::EQUAL, RDX);
+        as.setcc(Condition::NOT_PARITY, RCX);
+        as.and8(RDX, RCX);
+        as.test8(RDX);
+        pop();
+        storeBoolean(top(), Condition::NOT_EQUAL);
+    } else {
+        box(RDX, a, top() - 1);
+        box(RCX, b, top());
+        as.cmp(RDX, RCX);
+        pop();
+        storeBoolean(top(), Condition::EQUAL);
+    }
+}
+
+// Flips the sign bit.
+void TraceCompiler::negate() {
+    auto& entry = stack.back();
+    if (entry.kind == Entry::Kind::CONSTANT) {
+        replace(top(), Entry::known(Value(-entry.constant.asNumber())));
+        return;
+    }
+    auto reg = temporary(top());
+    as.movq(RAX, reg);
+    as.btc(RAX, 63);
+    as.movq(reg, RAX);
+}
+
+// Guards that the branch goes the way it did when the trace was recorded.
+// From then on the condition is known.
+void TraceCompiler::jumpIfFalse(const TraceStep& step) {
+    auto& entry = stack.back();
+    if (entry.kind == Entry::Kind::CONDITION) {
+        // Leaves with the condition the other way round.
+        auto snapshot = stack;
+        snapshot.back() = Entry::known(Value(step.jumped));
+        guard(step.jumped ? Condition::ABOVE : Condition::BELOW_OR_EQUAL, step.offset, snapshot);
+    } else if (entry.kind == Entry::Kind::MEMORY && entry.type == TraceType::BOOL) {
+        as.load(RAX, SLOTS, slot(top()));
+        as.sub(RAX, NIL);
+        as.cmpImmediate(RAX, static_cast<int32_t>(JitLayout::FALSE - JitLayout::NIL));
+        guard(step.jumped ? Condition::ABOVE : Condition::BELOW_OR_EQUAL, step.offset);
+    } else {
+        // Numbers, nil and constants always go the same way.
+        return;
+    }
+    replace(top(), Entry::known(Value(!step.jumped)));
+}
+
+// Puts everything back where it was when the loop started, ready to go
+// around again, unless the heap has work to do at a safepoint. Then it
+// leaves for the native code at the loop's start, which does it.
+void TraceCompiler::close() {
+    if (top() + 1 != trace.height) failed = true;
+    for (auto index = 0; index <= top() && index < trace.height; index++) {
+        if (homes[index] >= 0) continue;
+        flush(index, stack[index]);
+        replace(index, Entry::memory(std::nullopt));
+    }
+
+    as.load(RCX, STATE, offsetof(JitState, safepoint) + offsetof(Heap::SafepointTrigger, pending));
+    as.cmp8(RCX, 0, 0);
+    guard(Condition::NOT_EQUAL, trace.header);
+    as.load(RCX, STATE, offsetof(JitState, safepoint) + offsetof(Heap::SafepointTrigger, bytes));
+    as.load(RCX, RCX, 0);
+    as.load(RDX, STATE, offsetof(JitState, safepoint) + offsetof(Heap::SafepointTrigger, limit));
+    as.cmp(RCX, RDX, 0);
+    guard(Condition::ABOVE, trace.header);
+}
+
+void TraceCompiler::step(const TraceStep& step) {
+    // Every instruction but JUMP_IF_FALSE wants a comparison on the stack
+    // as a boolean.
+    if (step.op != OpCode::JUMP_IF_FALSE && !stack.empty() && stack.back().kind == Entry::Kind::CONDITION) {
+        box(RAX, stack.back(), top());
+        as.store(SLOTS, slot(top()), RAX);
+        replace(top(), Entry::memory(TraceType::BOOL));
+    }
+
+    switch (step.op) {
+        case OpCode::CONSTANT: stack.push_back(Entry::known(chunk.getConstant(step.operand))); break;
+        case OpCode::NIL: stack.push_back(Entry::known(Value())); break;
+        case OpCode::TRUE: stack.push_back(Entry::known(Value(true))); break;
+        case OpCode::FALSE: stack.push_back(Entry::known(Value(false))); break;
+        case OpCode::POP: pop(); break;
+
+        case OpCode::GET_LOCAL: getLocal(step); break;
+        case OpCode::SET_LOCAL: setLocal(step); break;
+        case OpCode::GET_GLOBAL_SLOT: getGlobal(step); break;
+        case OpCode::SET_GLOBAL_SLOT:
+            box(RAX, stack.back(), top());
+            as.store(GLOBALS, slot(step.operand), RAX);
+            break;
+
+        case OpCode::EQUAL: equal(); break;
+        case OpCode::GREATER: compare(false); break;
+        case OpCode::LESS: compare(true); break;
+        case OpCode::ADD:
+        case OpCode::SUBTRACT:
+        case OpCode::MULTIPLY:
+        case OpCode::DIVIDE:
+            arithmetic(step.op);
+            break;
+        case OpCode::NOT: {
+            auto& entry = stack.back();
+            if (entry.kind == Entry::Kind::CONSTANT) {
+                replace(top(), Entry::known(Value(entry.constant.isFalsy())));
+            } else if (entry.type == TraceType::BOOL) {
+                as.load(RAX, SLOTS, slot(top()));
+                as.sub(RAX, NIL);
+                as.cmpImmediate(RAX, static_cast<int32_t>(JitLayout::FALSE - JitLayout::NIL));
+                storeBoolean(top(), Condition::BELOW_OR_EQUAL);
+            } else {
+                replace(top(), Entry::known(Value(entry.type == TraceType::NIL)));
+            }
+            break;
+        }
+        case OpCode::NEGATE: negate(); break;
+
+        // The trace already goes wherever they went.
+        case OpCode::JUMP:
+        case OpCode::LOOP:
+            break;
+        case OpCode::JUMP_IF_FALSE: jumpIfFalse(step); break;
+
+        default:
+            failed = true;
+            break;
+    }
+}
+
+bool TraceCompiler::run(NativeCode& native) {
+    // Locals that start out as numbers, are read, and are never set to
+    // anything else get a home.
+    std::vector<bool> read(trace.height), setOther(trace.height);
+    for (auto& step : trace.steps) {
+        if (step.operand >= trace.height) continue;
+        if (step.op == OpCode::GET_LOCAL) read[step.operand] = true;
+        if (step.op == OpCode::SET_LOCAL && step.type != TraceType::NUMBER) setOther[step.operand] = true;
+    }
+    homes.assign(trace.height, -1);
+    auto homeCount = 0;
+    for (auto index = 0; index < trace.height && homeCount < TRACE_HOMES_MAX; index++) {
+        if (trace.slots[index] == TraceType::NUMBER && read[index] && !setOther[index]) {
+            isHome[homeCount] = true;
+            homes[index] = homeCount++;
+        }
+    }
+    for (auto reg = TRACE_REGISTERS - 1; reg >= homeCount; reg--) freeRegisters.push_back(static_cast<Xmm>(reg));
+
+    // Checks the homes hold numbers before it loads them, so it can leave
+    // with nothing to write back.
+    stack.assign(trace.height, Entry::memory(std::nullopt));
+    as.load(GLOBALS, STATE, offsetof(JitState, globals));
+    for (auto index = 0; index < trace.height; index++) {
+        if (homes[index] < 0) continue;
+        as.load(RAX, SLOTS, slot(index));
+        guardType(RAX, TraceType::NUMBER, trace.header);
+    }
+    for (auto index = 0; index < trace.height; index++) {
+        if (homes[index] < 0) continue;
+        auto home = static_cast<Xmm>(homes[index]);
+        as.load(RAX, SLOTS, slot(index));
+        as.movq(home, RAX);
+        stack[index] = Entry::inRegister(home);
+    }
+
+    auto loopStart = as.position();
+    for (auto& step : trace.steps) this->step(step);
+    close();
+    as.patch(as.jump(), loopStart);
+    if (failed) return false;
+
+    for (auto& path : exitPaths) path();
+    as.table(indirects);
+    return mapCode(as, native);
+}
+
+} // namespace
+
+const uint8_t* Jit::recordTrace(NativeLoop& loop, const uint8_t* ip) {
+    auto& frame = vm.frames.back();
+    auto function = frame.closure->function;
+    auto& chunk = function->getChunk();
+    auto native = function->getNativeCode();
+    auto start = std::chrono::steady_clock::now();
+
+    auto offset = static_cast<int>(ip - chunk.getCodeStart());
+    auto header = offset + 3 - (ip[1] << 8 | ip[2]);
+    TraceRecorder recorder(chunk, vm.stack, &vm.stack[frame.stackOffset], vm.globals);
+    if (recorder.run(header)) {
+        auto& trace = recorder.getTrace();
+        auto& stats = traceStats.emplace_back();
+        auto code = std::make_unique<NativeCode>();
+        TraceCompiler compiler(trace, chunk, *native, &stats.exits);
+        if (compiler.run(*code)) {
+            stats.function = std::string(function->getName());
+            stats.line = chunk.getLine(header);
+            stats.length = static_cast<int>(trace.steps.size());
+            stats.nativeSize = compiler.codeSize();
+            stats.time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+            loop.entry = code->code;
+            loop.trace = std::move(code);
+            return loop.entry;
+        }
+        traceStats.pop_back();
+    }
+
+    traceAborts++;
+    if (++loop.aborts < JIT_TRACE_ATTEMPTS) loop.count = 0;
+    return native->code + native->offsets[recorder.stoppedAt()];
+}
+
+#endif
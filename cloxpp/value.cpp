@@ -7,6 +7,253 @@
 //
 
 #include "value.hpp"
+#include <algorithm>
+#include <iterator>
+
+const HeapString& StringObject::flatten() {
+    if (!isRope()) return chars;
+
+    // Walk the rope iteratively; a string built one piece at a time in a loop
+    // is a very deep left-leaning tree.
+    chars.reserve(length);
+    std::vector<StringObject*> pending { right, left };
+    while (!pending.empty()) {
+        auto node = pending.back();
+        pending.pop_back();
+        if (node->isRope()) {
+            pending.push_back(node->right);
+            pending.push_back(node->left);
+        } else {
+            chars += node->chars;
+        }
+    }
+
+    hash = std::hash<std::string_view>()(chars);
+    left = nullptr;
+    right = nullptr;
+    return chars;
+}
+
+bool stringsEqual(StringObject* a, StringObject* b) {
+    if (a->isInterned && b->isInterned) return false;
+    if (a->length != b->length) return false;
+    return a->flatten() == b->flatten();
+}
+
+int GlobalTable::resolve(StringObject* name) {
+    auto found = slots.find(name);
+    if (found != slots.end()) return found->second;
+    if (values.size() == GLOBALS_MAX) return -1;
+
+    auto slot = static_cast<uint16_t>(values.size());
+    slots[name] = slot;
+    names.push_back(name);
+    values.push_back(Value::undefined());
+    return slot;
+}
+
+int SelectorTable::resolve(StringObject* name) {
+    auto found = selectors.find(name);
+    if (found != selectors.end()) return found->second;
+    if (names.size() == SELECTORS_MAX) return -1;
+
+    auto selector = static_cast<uint16_t>(names.size());
+    selectors[name] = selector;
+    names.push_back(name);
+    return selector;
+}
+
+Shape::~Shape() {
+    HeapAllocator<Shape> allocator;
+    for (auto child : transitions) {
+        child->~Shape();
+        allocator.deallocate(child, 1);
+    }
+}
+
+int Shape::find(StringObject* name) const {
+    for (auto shape = this; shape->parent != nullptr; shape = shape->parent) {
+        if (shape->name == name) return shape->slot;
+    }
+    return -1;
+}
+
+Shape* Shape::transition(StringObject* name) {
+    for (auto child : transitions) {
+        if (child->name == name) return child;
+    }
+
+    auto child = new (HeapAllocator<Shape>().allocate(1)) Shape(this, name);
+    transitions.push_back(child);
+    return child;
+}
+
+// Keeps the header, mark included: a minor collection moves instances that
+// the marking in progress may already have reached.
+InstanceObject::InstanceObject(InstanceObject&& other)
+    : Obj(other), klass(other.klass), shape(other.shape),
+      overflowFields(std::move(other.overflowFields)), dictionary(other.dictionary) {
+    std::copy(std::begin(other.inlineFields), std::end(other.inlineFields), inlineFields);
+    other.dictionary = nullptr;
+}
+
+InstanceObject::~InstanceObject() {
+    if (dictionary == nullptr) return;
+    dictionary->~StringTable<Value>();
+    HeapAllocator<StringTable<Value>>().deallocate(dictionary, 1);
+}
+
+Value* InstanceObject::findField(StringObject* name) {
+    if (dictionary != nullptr) {
+        auto found = dictionary->find(name);
+        return found == dictionary->end() ? nullptr : &found->second;
+    }
+
+    auto slot = shape->find(name);
+    return slot == -1 ? nullptr : &field(slot);
+}
+
+void InstanceObject::setField(StringObject* name, Value value) {
+    if (auto existing = findField(name)) {
+        *existing = value;
+        return;
+    }
+
+    if (dictionary == nullptr && shape->fieldCount < SHAPE_MAX_FIELDS) {
+        addField(shape->transition(name), value);
+        return;
+    }
+
+    if (dictionary == nullptr) {
+        dictionary = new (HeapAllocator<StringTable<Value>>().allocate(1)) StringTable<Value>();
+        for (auto fieldShape = shape; fieldShape->parent != nullptr; fieldShape = fieldShape->parent) {
+            dictionary->emplace(fieldShape->name, field(fieldShape->slot));
+        }
+        overflowFields = HeapVector<Value>();
+        shape = nullptr;
+    }
+    dictionary->emplace(name, value);
+}
+
+std::ostream& operator<<(std::ostream& os, const Value& v) {
+    if (v.isNumber()) return os << v.asNumber();
+    if (v.isNil()) return os << "nil";
+    if (v.isBool()) return os << (v.asBool() ? "true" : "false");
+
+    switch (v.asObj()->type) {
+        case ObjType::STRING:
+            return os << v.as<StringObject>()->flatten();
+        case ObjType::FUNCTION: {
+            auto function = v.as<FunctionObject>();
+            if (function->getName().empty()) {
+                return os << "<script>";
+            }
+            return os << "<fn " << function->getName() << ">";
+        }
+        case ObjType::NATIVE:
+            return os << "<native fn>";
+        case ObjType::CLOSURE:
+            return os << Value(v.as<ClosureObject>()->function);
+        case ObjType::UPVALUE:
+            return os << "upvalue";
+        case ObjType::CLASS:
+            return os << v.as<ClassObject>()->name->chars;
+        case ObjType::INSTANCE:
+            return os << v.as<InstanceObject>()->klass->name->chars << " instance";
+        case ObjType::BOUND_METHOD:
+            return os << Value(v.as<BoundMethodObject>()->method->function);
+    }
+
+    return os;
+}
+
+const char* captureName(Capture kind) {
+    switch (kind) {
+        case Capture::UPVALUE: return "upvalue";
+        case Capture::LOCAL: return "local";
+        case Capture::VALUE: return "value";
+        case Capture::IN_FRAME: return "in frame";
+    }
+    return "?";
+}
+
+int instructionLength(OpCode op, const uint8_t* code, const Value* constants) {
+    switch (op) {
+        case OpCode::CONSTANT:
+        case OpCode::GET_LOCAL:
+        case OpCode::SET_LOCAL:
+        case OpCode::GET_UPVALUE:
+        case OpCode::SET_UPVALUE:
+        case OpCode::CALL:
+        case OpCode::TAIL_CALL:
+        case OpCode::CLASS:
+            return 2;
+        case OpCode::GET_GLOBAL_SLOT:
+        case OpCode::DEFINE_GLOBAL_SLOT:
+        case OpCode::SET_GLOBAL_SLOT:
+        case OpCode::GET_SUPER:
+        case OpCode::JUMP:
+        case OpCode::JUMP_IF_FALSE:
+        case OpCode::LOOP:
+        case OpCode::METHOD:
+            return 3;
+        case OpCode::GET_PROPERTY:
+        case OpCode::SET_PROPERTY:
+        case OpCode::SUPER_INVOKE:
+            return 4;
+        case OpCode::INVOKE:
+        case OpCode::TAIL_INVOKE:
+            return 5;
+        case OpCode::CLOSURE: {
+            auto closed = constants[code[1]].as<FunctionObject>();
+            return 2 + 2 * closed->getUpvalueCount();
+        }
+        default:
+            return 1;
+    }
+}
+
+int stackEffect(OpCode op, const uint8_t* code) {
+    switch (op) {
+        case OpCode::CONSTANT:
+        case OpCode::NIL:
+        case OpCode::TRUE:
+        case OpCode::FALSE:
+        case OpCode::GET_LOCAL:
+        case OpCode::GET_GLOBAL_SLOT:
+        case OpCode::GET_UPVALUE:
+        case OpCode::CLOSURE:
+        case OpCode::CLASS:
+            return 1;
+        case OpCode::POP:
+        case OpCode::DEFINE_GLOBAL_SLOT:
+        case OpCode::SET_PROPERTY:
+        case OpCode::GET_SUPER:
+        case OpCode::EQUAL:
+        case OpCode::GREATER:
+        case OpCode::LESS:
+        case OpCode::ADD:
+        case OpCode::SUBTRACT:
+        case OpCode::MULTIPLY:
+        case OpCode::DIVIDE:
+        case OpCode::PRINT:
+        case OpCode::CLOSE_UPVALUE:
+        case OpCode::RETURN:
+        case OpCode::INHERIT:
+        case OpCode::METHOD:
+            return -1;
+        case OpCode::CALL:
+        case OpCode::TAIL_CALL:
+            return -code[1];
+        case OpCode::INVOKE:
+        case OpCode::TAIL_INVOKE:
+            return -code[2];
+        case OpCode::SUPER_INVOKE:
+            return -code[3] - 1;
+        default:
+            return 0;
+    }
+}
 
 void Chunk::write(uint8_t byte, int line) {
     code.push_back(byte);
@@ -17,12 +264,17 @@ void Chunk::write(OpCode opcode, int line) {
     write(static_cast<uint8_t>(opcode), line);
 }
 
+void Chunk::assign(const uint8_t* code, const int* lines, size_t count) {
+    this->code.assign(code, code + count);
+    this->lines.assign(lines, lines + count);
+}
+
 unsigned long Chunk::addConstant(Value value) {
     constants.push_back(value);
     return constants.size() - 1;
 }
 
-void Chunk::disassemble(const std::string& name) {
+void Chunk::disassemble(std::string_view name) {
     std::cout << "== " << name << " ==" << std::endl;
     
     for (auto i = 0; i < static_cast<int>(code.size());) {
@@ -43,12 +295,35 @@ static int constantInstruction(const std::string& name, const Chunk& chunk, int
     return offset + 2;
 }
 
+static void printCache(const Chunk& chunk, int offset) {
+    auto cache = static_cast<uint16_t>(chunk.getCode(offset) << 8 | chunk.getCode(offset + 1));
+    printf(" cache %d (%d classes)", cache, chunk.getCache(cache).count);
+}
+
+static int propertyInstruction(const std::string& name, const Chunk& chunk, int offset) {
+    auto constant = chunk.getCode(offset + 1);
+    printf("%-16s %4d '", name.c_str(), constant);
+    std::cout << chunk.getConstant(constant) << "'";
+    printCache(chunk, offset + 2);
+    printf("\n");
+    return offset + 4;
+}
+
 static int invokeInstruction(const std::string& name, const Chunk& chunk, int offset) {
     auto constant = chunk.getCode(offset + 1);
     auto argCount = chunk.getCode(offset + 2);
     printf("%-16s (%d args) %4d '", name.c_str(), argCount, constant);
-    std::cout << chunk.getConstant(constant) << "'" << std::endl;
-    return offset + 3;
+    std::cout << chunk.getConstant(constant) << "'";
+    printCache(chunk, offset + 3);
+    printf("\n");
+    return offset + 5;
+}
+
+static int superInvokeInstruction(const std::string& name, const Chunk& chunk, int offset) {
+    auto selector = static_cast<uint16_t>(chunk.getCode(offset + 1) << 8 | chunk.getCode(offset + 2));
+    auto argCount = chunk.getCode(offset + 3);
+    printf("%-16s (%d args) %4d\n", name.c_str(), argCount, selector);
+    return offset + 4;
 }
 
 static int byteInstruction(const std::string& name, const Chunk& chunk, int offset) {
@@ -57,6 +332,12 @@ static int byteInstruction(const std::string& name, const Chunk& chunk, int offs
     return offset + 2;
 }
 
+static int shortInstruction(const std::string& name, const Chunk& chunk, int offset) {
+    auto slot = static_cast<uint16_t>(chunk.getCode(offset + 1) << 8 | chunk.getCode(offset + 2));
+    printf("%-16s %4d\n", name.c_str(), slot);
+    return offset + 3;
+}
+
 static int jumpInstruction(const std::string& name, int sign, const Chunk& chunk, int offset) {
     uint16_t jump = static_cast<uint16_t>(chunk.getCode(offset + 1) << 8);
     jump |= static_cast<uint16_t>(chunk.getCode(offset + 2));
@@ -74,6 +355,16 @@ int Chunk::disassembleInstruction(int offset) {
     }
     
     auto instruction = OpCode(code[offset]);
+    // The parts after the first are still there to show as they are.
+    if (auto superinstruction = findSuperinstruction(instruction)) {
+        std::cout << superinstruction->name << std::endl;
+        printf("%04d    | ", offset);
+        return disassembleOperands(superinstruction->parts[0], offset);
+    }
+    return disassembleOperands(instruction, offset);
+}
+
+int Chunk::disassembleOperands(OpCode instruction, int offset) {
     switch (instruction) {
         case OpCode::CONSTANT:
             return constantInstruction("OP_CONSTANT", *this, offset);
@@ -87,24 +378,28 @@ int Chunk::disassembleInstruction(int offset) {
             return simpleInstruction("OP_POP", offset);
         case OpCode::GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", *this, offset);
-        case OpCode::GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", *this, offset);
-        case OpCode::DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", *this, offset);
+        case OpCode::GET_GLOBAL_SLOT:
+            return shortInstruction("OP_GET_GLOBAL_SLOT", *this, offset);
+        case OpCode::DEFINE_GLOBAL_SLOT:
+            return shortInstruction("OP_DEFINE_GLOBAL_SLOT", *this, offset);
         case OpCode::SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", *this, offset);
-        case OpCode::SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", *this, offset);
+        case OpCode::SET_GLOBAL_SLOT:
+            return shortInstruction("OP_SET_GLOBAL_SLOT", *this, offset);
         case OpCode::GET_UPVALUE:
             return byteInstruction("OP_GET_UPVALUE", *this, offset);
         case OpCode::SET_UPVALUE:
             return byteInstruction("OP_SET_UPVALUE", *this, offset);
         case OpCode::GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", *this, offset);
+            return propertyInstruction("OP_GET_PROPERTY", *this, offset);
         case OpCode::SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", *this, offset);
+            return propertyInstruction("OP_SET_PROPERTY", *this, offset);
         case OpCode::GET_SUPER:
-            return constantInstruction("OP_GET_SUPER", *this, offset);
+            return shortInstruction("OP_GET_SUPER", *this, offset);
+        case OpCode::GET_PROPERTY_IN_FRAME:
+            return propertyInstruction("OP_GET_PROPERTY_IN_FRAME", *this, offset);
+        case OpCode::GET_SUPER_IN_FRAME:
+            return shortInstruction("OP_GET_SUPER_IN_FRAME", *this, offset);
         case OpCode::EQUAL:
             return simpleInstruction("OP_EQUAL", offset);
         case OpCode::GREATER:
@@ -133,10 +428,14 @@ int Chunk::disassembleInstruction(int offset) {
             return jumpInstruction("OP_JUMP", -1, *this, offset);
         case OpCode::CALL:
             return byteInstruction("OP_CALL", *this, offset);
+        case OpCode::TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", *this, offset);
         case OpCode::INVOKE:
             return invokeInstruction("OP_INVOKE", *this, offset);
+        case OpCode::TAIL_INVOKE:
+            return invokeInstruction("OP_TAIL_INVOKE", *this, offset);
         case OpCode::SUPER_INVOKE:
-            return invokeInstruction("OP_SUPER_INVOKE", *this, offset);
+            return superInvokeInstruction("OP_SUPER_INVOKE", *this, offset);
         case OpCode::CLOSURE: {
             offset++;
             auto constant = code[offset++];
@@ -144,12 +443,11 @@ int Chunk::disassembleInstruction(int offset) {
             std::cout << constants[constant];
             std::cout << std::endl;
             
-            auto function = std::get<Function>(constants[constant]);
+            auto function = constants[constant].as<FunctionObject>();
             for (int j = 0; j < function->upvalueCount; j++) {
-                int isLocal = code[offset++];
+                auto kind = Capture(code[offset++]);
                 int index = code[offset++];
-                printf("%04d      |                     %s %d\n",
-                       offset - 2, isLocal ? "local" : "upvalue", index);
+                printf("%04d      |                     %s %d\n", offset - 2, captureName(kind), index);
             }
             
             return offset;
@@ -163,7 +461,25 @@ int Chunk::disassembleInstruction(int offset) {
         case OpCode::INHERIT:
             return simpleInstruction("OP_INHERIT", offset);
         case OpCode::METHOD:
-            return constantInstruction("OP_METHOD", *this, offset);
+            return shortInstruction("OP_METHOD", *this, offset);
+        case OpCode::GREATER_NUM:
+            return simpleInstruction("OP_GREATER_NUM", offset);
+        case OpCode::LESS_NUM:
+            return simpleInstruction("OP_LESS_NUM", offset);
+        case OpCode::ADD_NUM:
+            return simpleInstruction("OP_ADD_NUM", offset);
+        case OpCode::SUBTRACT_NUM:
+            return simpleInstruction("OP_SUBTRACT_NUM", offset);
+        case OpCode::MULTIPLY_NUM:
+            return simpleInstruction("OP_MULTIPLY_NUM", offset);
+        case OpCode::DIVIDE_NUM:
+            return simpleInstruction("OP_DIVIDE_NUM", offset);
+        case OpCode::CALL_CLOSURE:
+            return byteInstruction("OP_CALL_CLOSURE", *this, offset);
+        case OpCode::CALL_NATIVE:
+            return byteInstruction("OP_CALL_NATIVE", *this, offset);
+        default:
+            break;
     }
     
     std::cout << "Unknown opcode: " << code[offset] << std::endl;
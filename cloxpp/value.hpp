@@ -11,96 +11,501 @@
 
 #include "common.hpp"
 #include "opcode.hpp"
-#include <variant>
+#include <cstring>
+#include <deque>
 #include <memory>
+#include <string>
+#include <string_view>
 #include <unordered_map>
 
+enum class ObjType: uint8_t {
+    STRING,
+    FUNCTION,
+    NATIVE,
+    CLOSURE,
+    UPVALUE,
+    CLASS,
+    INSTANCE,
+    BOUND_METHOD
+};
+
+struct Obj {
+    ObjType type;
+    bool isMarked = false;
+    bool isRemembered = false;
+    // Lives in a VM stack slot rather than on the heap. See
+    // VM::bindMethodInFrame.
+    bool isInFrame = false;
+    // Links old objects into the heap. A young object uses it as its
+    // forwarding pointer once it has been promoted.
+    Obj* next = nullptr;
+    explicit Obj(ObjType type): type(type) {}
+};
+
+struct StringObject;
 struct NativeFunctionObject;
 struct UpvalueObject;
 struct ClassObject;
 struct InstanceObject;
 struct BoundMethodObject;
+struct Shape;
 class FunctionObject;
 class ClosureObject;
 class Compiler;
 class Parser;
 class VM;
-using Function = std::shared_ptr<FunctionObject>;
-using NativeFunction = std::shared_ptr<NativeFunctionObject>;
-using Closure = std::shared_ptr<ClosureObject>;
-using UpvalueValue = std::shared_ptr<UpvalueObject>;
-using ClassValue = std::shared_ptr<ClassObject>;
-using InstanceValue = std::shared_ptr<InstanceObject>;
-using BoundMethodValue = std::shared_ptr<BoundMethodObject>;
+class Heap;
+class Jit;
+struct JitLayout;
+using Function = FunctionObject*;
+using NativeFunction = NativeFunctionObject*;
+using Closure = ClosureObject*;
+using UpvalueValue = UpvalueObject*;
+using ClassValue = ClassObject*;
+using InstanceValue = InstanceObject*;
+using BoundMethodValue = BoundMethodObject*;
+
+// A NaN-boxed value. Doubles are stored as themselves, everything else hides
+// in the payload of a quiet NaN. Objects set the sign bit and keep their
+// pointer in the low 48 bits; nil, true and false are small tags. There is
+// one more tag, for the value of a global that hasn't been defined yet, which
+// Lox code never gets to see.
+class Value {
+    static constexpr uint64_t SIGN_BIT = 0x8000000000000000;
+    static constexpr uint64_t QNAN = 0x7ffc000000000000;
+    static constexpr uint64_t TAG_NIL = 1;
+    static constexpr uint64_t TAG_FALSE = 2;
+    static constexpr uint64_t TAG_TRUE = 3;
+    static constexpr uint64_t TAG_UNDEFINED = 4;
+    static constexpr uint64_t NIL_BITS = QNAN | TAG_NIL;
+    static constexpr uint64_t FALSE_BITS = QNAN | TAG_FALSE;
+    static constexpr uint64_t TRUE_BITS = QNAN | TAG_TRUE;
+    static constexpr uint64_t UNDEFINED_BITS = QNAN | TAG_UNDEFINED;
+
+    uint64_t bits;
+
+public:
+    Value(): bits(NIL_BITS) {}
+    Value(double number) { std::memcpy(&bits, &number, sizeof(double)); }
+    Value(bool boolean): bits(boolean ? TRUE_BITS : FALSE_BITS) {}
+    Value(Obj* object): bits(SIGN_BIT | QNAN | reinterpret_cast<uintptr_t>(object)) {}
+
+    static Value undefined() {
+        Value value;
+        value.bits = UNDEFINED_BITS;
+        return value;
+    }
+
+    bool isNumber() const { return (bits & QNAN) != QNAN; }
+    bool isNil() const { return bits == NIL_BITS; }
+    bool isBool() const { return (bits | 1) == TRUE_BITS; }
+    bool isUndefined() const { return bits == UNDEFINED_BITS; }
+    bool isObj() const { return (bits & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT); }
+    bool isObjType(ObjType type) const { return isObj() && asObj()->type == type; }
+
+    template <typename T>
+    bool is() const { return isObjType(T::objType); }
+
+    double asNumber() const {
+        double number;
+        std::memcpy(&number, &bits, sizeof(double));
+        return number;
+    }
+    bool asBool() const { return bits == TRUE_BITS; }
+    Obj* asObj() const { return reinterpret_cast<Obj*>(bits & ~(SIGN_BIT | QNAN)); }
+
+    template <typename T>
+    T* as() const { return static_cast<T*>(asObj()); }
+
+    bool isFalsy() const { return isNil() || bits == FALSE_BITS; }
+
+    friend bool operator==(const Value& a, const Value& b);
+    friend struct JitLayout;
+};
+
+// What a Heap holds, in bytes: its objects plus everything their strings,
+// vectors and tables allocate.
+struct HeapUsage {
+    size_t bytes = 0;
+    size_t peak = 0;
+
+    void allocated(size_t size) {
+        bytes += size;
+        if (bytes > peak) peak = bytes;
+    }
+    void freed(size_t size) { bytes -= size; }
+};
+
+// The usage that containers inside objects are charged to on this thread.
+// Set by Heap::Scope while a VM is running; null means nothing is counted.
+extern thread_local HeapUsage* currentHeapUsage;
+
+template <typename T>
+struct HeapAllocator {
+    using value_type = T;
 
-using Value = std::variant<double, bool, std::monostate, std::string, Function, NativeFunction, Closure, UpvalueValue, ClassValue, InstanceValue, BoundMethodValue>;
+    HeapAllocator() = default;
+    template <typename U>
+    HeapAllocator(const HeapAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        if (currentHeapUsage != nullptr) currentHeapUsage->allocated(n * sizeof(T));
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    void deallocate(T* pointer, size_t n) {
+        if (currentHeapUsage != nullptr) currentHeapUsage->freed(n * sizeof(T));
+        ::operator delete(pointer);
+    }
+
+    template <typename U>
+    bool operator==(const HeapAllocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const HeapAllocator<U>&) const { return false; }
+};
+
+using HeapString = std::basic_string<char, std::char_traits<char>, HeapAllocator<char>>;
+template <typename T>
+using HeapVector = std::vector<T, HeapAllocator<T>>;
+
+#define INLINE_CACHE_SIZE 4
+
+// What a GET_PROPERTY, SET_PROPERTY or INVOKE site found the property's name
+// to mean on instances of the shapes it has seen, up to INLINE_CACHE_SIZE of
+// them: the field in `slot`, or else `method`, which is null if the class
+// has no such method either. A SET_PROPERTY that adds the field also
+// remembers the shape the instance moves to. Shapes never change and
+// methods are all in place before a class has any instances, so entries
+// never go stale.
+struct InlineCache {
+    struct Entry {
+        const Shape* shape;
+        int slot;
+        Closure method;
+        Shape* transition;
+    };
+    Entry entries[INLINE_CACHE_SIZE];
+    uint8_t count = 0;
+
+    const Entry* find(const Shape* shape) const {
+        for (int i = 0; i < count; i++) {
+            if (entries[i].shape == shape) return &entries[i];
+        }
+        return nullptr;
+    }
+};
 
 class Chunk {
-    std::vector<uint8_t> code;
-    std::vector<Value> constants;
-    std::vector<int> lines;
+    HeapVector<uint8_t> code;
+    HeapVector<Value> constants;
+    HeapVector<int> lines;
+    // Indexed by the 16-bit operand of the instructions that use them.
+    HeapVector<InlineCache> caches;
+
+    int disassembleOperands(OpCode instruction, int offset);
 
 public:
     uint8_t getCode(int offset) const { return code[offset]; };
+    // Writable so the VM can quicken instructions as it runs them.
+    uint8_t* getCodeStart() { return code.data(); }
     void setCode(int offset, uint8_t value) { code[offset] = value; }
     const Value& getConstant(int constant) const { return constants[constant]; };
+    int constantCount() const { return static_cast<int>(constants.size()); }
+    const Value* getConstants() const { return constants.data(); }
+    InlineCache* getCaches() { return caches.data(); }
+    const InlineCache& getCache(int cache) const { return caches[cache]; }
+    void setCacheCount(int count) { caches.resize(count); }
     void write(uint8_t byte, int line);
     void write(OpCode opcode, int line);
+    void assign(const uint8_t* code, const int* lines, size_t count);
     unsigned long addConstant(Value value);
     int disassembleInstruction(int offset);
-    void disassemble(const std::string& name);
+    void disassemble(std::string_view name);
     int getLine(int instruction) { return lines[instruction]; }
     int count() { return static_cast<int>(code.size()); }
+
+    friend Heap;
 };
 
-typedef Value (*NativeFn)(int argCount, std::vector<Value>::iterator args);
+// Reads as many arguments from `args` as the function's arity and stores
+// what it returns in `result`, the callee's stack slot. Returns nullptr, or
+// the message of the runtime error the call ends in instead.
+typedef const char* (*NativeFn)(const Value* args, Value& result);
+
+// Strings are immutable and interned by the Heap, so two strings with the same
+// contents are usually the same object and can be compared by pointer.
+//
+// The exception is the result of a concatenation, which starts out as a rope
+// node pointing at its two halves. A rope is only flattened into `chars` when
+// something needs its contents (printing, comparing, hashing), which keeps
+// building a string in a loop linear. Flattened ropes are not interned.
+struct StringObject: Obj {
+    static constexpr ObjType objType = ObjType::STRING;
+    HeapString chars;
+    size_t hash;
+    size_t length;
+    bool isInterned = false;
+    StringObject* left = nullptr;
+    StringObject* right = nullptr;
+
+    explicit StringObject(HeapString chars)
+        : Obj(objType), chars(std::move(chars)), hash(std::hash<std::string_view>()(this->chars)),
+          length(this->chars.size()) {}
+    explicit StringObject(StringObject* left, StringObject* right)
+        : Obj(objType), hash(0), length(left->length + right->length), left(left), right(right) {}
+
+    bool isRope() const { return left != nullptr; }
+    const HeapString& flatten();
+
+    struct Hash {
+        size_t operator()(const StringObject* string) const { return string->hash; }
+    };
+};
+
+bool stringsEqual(StringObject* a, StringObject* b);
+
+template <typename T>
+using StringTable = std::unordered_map<StringObject*, T, StringObject::Hash, std::equal_to<StringObject*>,
+                                       HeapAllocator<std::pair<StringObject* const, T>>>;
+
+#define GLOBALS_MAX (UINT16_MAX + 1)
+
+// The VM's global variables. The compiler gives each name a slot the first
+// time any script mentions it, so code compiled later in the same VM (a REPL
+// session, say) agrees on where every global lives, and the VM reads and
+// writes them by slot. A slot holds Value::undefined() until its variable is
+// defined.
+struct GlobalTable {
+    StringTable<uint16_t> slots;
+    HeapVector<StringObject*> names;
+    HeapVector<Value> values;
 
-struct NativeFunctionObject {
+    // Returns the slot for `name`, adding one if it is new, or -1 if the
+    // table is full.
+    int resolve(StringObject* name);
+};
+
+#define SELECTORS_MAX (UINT16_MAX + 1)
+
+// The names methods are defined and called by. Like globals, the compiler
+// gives each name a number, its selector, the first time any script uses it
+// for a method, and classes keep their methods in a table indexed by it.
+struct SelectorTable {
+    StringTable<uint16_t> selectors;
+    HeapVector<StringObject*> names;
+
+    // Returns the selector for `name`, adding one if it is new, or -1 if
+    // the table is full.
+    int resolve(StringObject* name);
+    // -1 if no method has ever been called `name`.
+    int find(StringObject* name) const {
+        auto found = selectors.find(name);
+        return found == selectors.end() ? -1 : found->second;
+    }
+};
+
+struct NativeFunctionObject: Obj {
+    static constexpr ObjType objType = ObjType::NATIVE;
     NativeFn function;
+    int arity;
+    // Whether it leaves the VM alone: it never allocates or fails, so native
+    // code can call it without handing the VM its state first.
+    bool isPure;
+    NativeFunctionObject(NativeFn function, int arity, bool isPure)
+        : Obj(objType), function(function), arity(arity), isPure(isPure) {}
 };
 
-struct UpvalueObject {
+struct UpvalueObject: Obj {
+    static constexpr ObjType objType = ObjType::UPVALUE;
     Value* location;
     Value closed;
     UpvalueValue next;
-    UpvalueObject(Value* slot): location(slot), closed(std::monostate()), next(nullptr) {}
+    explicit UpvalueObject(Value* slot): Obj(objType), location(slot), closed(), next(nullptr) {}
+};
+
+#define INSTANCE_INLINE_FIELDS 4
+#define SHAPE_MAX_FIELDS 64
+
+// The fields of an instance and the slots they are in, shared by every
+// instance of the class that had the same fields added in the same order.
+// Each class has a tree of them, rooted at the shape of an instance with no
+// fields, where adding a field moves an instance to a child. Shapes live as
+// long as their class.
+struct Shape {
+    ClassValue klass;
+    Shape* parent;
+    // The field this shape adds to its parent's, and the slot it is in.
+    StringObject* name;
+    int slot;
+    int fieldCount;
+    HeapVector<Shape*> transitions;
+
+    explicit Shape(ClassValue klass)
+        : klass(klass), parent(nullptr), name(nullptr), slot(-1), fieldCount(0) {}
+    explicit Shape(Shape* parent, StringObject* name)
+        : klass(parent->klass), parent(parent), name(name), slot(parent->fieldCount),
+          fieldCount(parent->fieldCount + 1) {}
+    Shape(const Shape&) = delete;
+    Shape& operator=(const Shape&) = delete;
+    ~Shape();
+
+    // The slot of the field called `name`, or -1.
+    int find(StringObject* name) const;
+    // The shape an instance of this one moves to when it gets a field called
+    // `name`. Created the first time it is asked for.
+    Shape* transition(StringObject* name);
+
+    template <typename F>
+    void forEach(F visit) {
+        visit(this);
+        for (auto child : transitions) child->forEach(visit);
+    }
 };
 
-struct ClassObject {
-    std::string name;
-    std::unordered_map<std::string, Closure> methods;
-    explicit ClassObject(std::string name): name(name) {}
+// A class's methods are indexed by selector, with the ones it inherits
+// copied in, so finding one never looks further than the class itself.
+// Null where the class has no method with that selector.
+struct ClassObject: Obj {
+    static constexpr ObjType objType = ObjType::CLASS;
+    StringObject* name;
+    HeapVector<Closure> methods;
+    Shape shape;
+    explicit ClassObject(StringObject* name): Obj(objType), name(name), shape(this) {}
+
+    Closure findMethod(int selector) const {
+        return static_cast<size_t>(selector) < methods.size() ? methods[selector] : nullptr;
+    }
 };
 
-struct InstanceObject {
+// Fields are kept in slots, the first few of them in the instance itself,
+// at the positions the instance's shape gives them. An instance that gets
+// more than SHAPE_MAX_FIELDS fields stops having a shape and keeps them all
+// in a hash table instead.
+struct InstanceObject: Obj {
+    static constexpr ObjType objType = ObjType::INSTANCE;
     ClassValue klass;
-    std::unordered_map<std::string, Value> fields;
-    explicit InstanceObject(ClassValue klass): klass(klass) {}
+    Shape* shape;
+    Value inlineFields[INSTANCE_INLINE_FIELDS];
+    HeapVector<Value> overflowFields;
+    StringTable<Value>* dictionary = nullptr;
+
+    explicit InstanceObject(ClassValue klass): Obj(objType), klass(klass), shape(&klass->shape) {}
+    InstanceObject(InstanceObject&& other);
+    ~InstanceObject();
+
+    Value& field(int slot) {
+        return slot < INSTANCE_INLINE_FIELDS ? inlineFields[slot]
+                                             : overflowFields[slot - INSTANCE_INLINE_FIELDS];
+    }
+    // Null if there is no field called `name`.
+    Value* findField(StringObject* name);
+    void setField(StringObject* name, Value value);
+    // Moves the instance to `next`, a transition from its shape, and stores
+    // the field that adds.
+    void addField(Shape* next, Value value) {
+        if (next->slot < INSTANCE_INLINE_FIELDS) {
+            inlineFields[next->slot] = value;
+        } else {
+            overflowFields.push_back(value);
+        }
+        shape = next;
+    }
+
+    template <typename F>
+    void forEachField(F visit) {
+        if (dictionary != nullptr) {
+            for (auto& [name, value] : *dictionary) visit(value);
+            return;
+        }
+        for (int slot = 0; slot < shape->fieldCount; slot++) visit(field(slot));
+    }
 };
 
-struct BoundMethodObject {
-    InstanceValue receiver;
+struct BoundMethodObject: Obj {
+    static constexpr ObjType objType = ObjType::BOUND_METHOD;
+    Value receiver;
     Closure method;
-    explicit BoundMethodObject(InstanceValue receiver, Closure method)
-        : receiver(receiver), method(method) {}
+    explicit BoundMethodObject(Value receiver, Closure method)
+        : Obj(objType), receiver(receiver), method(method) {}
+};
+
+// A function's code for the register backend, made from its chunk by
+// translateToRegisters. Shares the chunk's constants and inline caches.
+struct RegisterCode {
+    HeapVector<uint8_t> code;
+    HeapVector<int> lines;
+    // How many registers a frame of the function needs.
+    int frameSize = 0;
+
+    int disassembleInstruction(const Chunk& chunk, int offset) const;
+    void disassemble(const Chunk& chunk, std::string_view name) const;
+};
+
+struct NativeCode;
+
+// A loop in a function's native code. Counts how many times it goes around
+// until the JIT records a trace of it, and then holds on to the trace.
+struct NativeLoop {
+    uint64_t count = 0;
+    // Where native code goes to run the trace instead, once there is one.
+    const uint8_t* entry = nullptr;
+    std::unique_ptr<NativeCode> trace;
+    // Recordings that did not make it back around the loop.
+    int aborts = 0;
 };
 
-class FunctionObject {
+// Machine code the JIT made from a function's chunk once it got hot, or
+// from a trace through one of its loops. Lives in its own mapping, which
+// goes away with the function.
+struct NativeCode {
+    uint8_t* code = nullptr;
+    size_t size = 0;
+    // Where each instruction of the chunk starts in `code`, indexed by its
+    // offset in the chunk. NATIVE_NO_OFFSET between instructions.
+    HeapVector<uint32_t> offsets;
+    // One for each LOOP in the chunk. A deque so that they stay put, since
+    // the code points at them.
+    std::deque<NativeLoop> loops;
+
+    NativeCode() = default;
+    NativeCode(const NativeCode&) = delete;
+    NativeCode& operator=(const NativeCode&) = delete;
+    ~NativeCode();
+};
+
+#define NATIVE_NO_OFFSET UINT32_MAX
+
+class FunctionObject: public Obj {
 private:
     int arity;
     int upvalueCount = 0;
-    std::string name;
+    // How many stack slots a call to it can fill at most, counting from the
+    // callee's slot.
+    int stackSize = 0;
+    HeapString name;
     Chunk chunk;
+    RegisterCode registers;
+    std::unique_ptr<NativeCode> native;
+    // Where a call starts in `native`, for native code to go to directly.
+    const uint8_t* nativeEntry = nullptr;
+    // How many times the function has been called or gone around a loop,
+    // towards the JIT's threshold.
+    uint32_t hotness = 0;
 
 public:
-    FunctionObject(int arity, const std::string& name)
-        : arity(arity), name(name), chunk(Chunk()) {}
-    
-    const std::string& getName() const { return name; }
+    static constexpr ObjType objType = ObjType::FUNCTION;
+
+    FunctionObject(int arity, std::string_view name)
+        : Obj(objType), arity(arity), name(name), chunk(Chunk()) {}
+
+    std::string_view getName() const { return name; }
 
-    bool operator==(const Function& rhs) const { return false; }
-    
     Chunk& getChunk() { return chunk; }
+    RegisterCode& getRegisterCode() { return registers; }
+    // Null until the JIT has compiled the function.
+    NativeCode* getNativeCode() { return native.get(); }
+    int getArity() const { return arity; }
+    int getStackSize() const { return stackSize; }
+    int getUpvalueCount() const { return upvalueCount; }
     uint8_t getCode(int offset) { return chunk.getCode(offset); }
     const Value& getConstant(int constant) const { return chunk.getConstant(constant); }
 
@@ -109,54 +514,47 @@ public:
     friend VM;
     friend Chunk;
     friend ClosureObject;
+    friend Jit;
+    friend JitLayout;
 };
 
-class ClosureObject {
+class ClosureObject: public Obj {
 public:
+    static constexpr ObjType objType = ObjType::CLOSURE;
     Function function;
-    std::vector<UpvalueValue> upvalues;
-    explicit ClosureObject(Function function): function(function) {
-        upvalues.resize(function->upvalueCount, nullptr);
+    // Each holds either the captured value itself or, for a variable that
+    // can still be assigned, the UpvalueObject it lives in. Lox code never
+    // sees an UpvalueObject, so the two cannot be confused.
+    HeapVector<Value> upvalues;
+    explicit ClosureObject(Function function): Obj(objType), function(function) {
+        upvalues.resize(function->upvalueCount, Value());
     };
-};
-
-std::ostream& operator<<(std::ostream& os, const Value& v);
-
-struct OutputVisitor {
-    void operator()(const double d) const { std::cout << d; }
-    void operator()(const bool b) const { std::cout << (b ? "true" : "false"); }
-    void operator()(const std::monostate n) const { std::cout << "nil"; }
-    void operator()(const std::string& s) const { std::cout << s; }
-    void operator()(const Function& f) const {
-        if (f->getName().empty()) {
-            std::cout << "<script>";
-        } else {
-            std::cout << "<fn " << f->getName() << ">";
-        }
+    Value& upvalue(int slot) {
+        auto& captured = upvalues[slot];
+        return captured.is<UpvalueObject>() ? *captured.as<UpvalueObject>()->location : captured;
     }
-    void operator()(const NativeFunction& f) const { std::cout << "<native fn>"; }
-    void operator()(const Closure& c) const { std::cout << Value(c->function); }
-    void operator()(const UpvalueValue& u) const { std::cout << "upvalue"; }
-    void operator()(const ClassValue& c) const { std::cout << c->name; }
-    void operator()(const InstanceValue& i) const { std::cout << i->klass->name << " instance"; }
-    void operator()(const BoundMethodValue& m) const { std::cout << Value(m->method->function); }
 };
 
-inline std::ostream& operator<<(std::ostream& os, const Value& v) {
-    std::visit(OutputVisitor(), v);
-    return os;
+inline bool operator==(const Value& a, const Value& b) {
+    if (a.isNumber() && b.isNumber()) {
+        return a.asNumber() == b.asNumber();
+    }
+    if (a.bits == b.bits) return true;
+    if (a.is<StringObject>() && b.is<StringObject>()) {
+        return stringsEqual(a.as<StringObject>(), b.as<StringObject>());
+    }
+    return false;
 }
 
-struct FalsinessVisitor {
-    bool operator()(const bool b) const { return !b; }
-    bool operator()(const std::monostate n) const { return true; }
-    
-    template <typename T>
-    bool operator()(const T& value) const { return false; }
-};
+std::ostream& operator<<(std::ostream& os, const Value& v);
+const char* captureName(Capture kind);
 
-inline bool isFalsy(const Value& v) {
-    return std::visit(FalsinessVisitor(), v);
-}
+// How long the instruction at `code` is when its opcode is read as `op`, and
+// how many more values are on the stack after it than before. Only for the
+// instructions the compiler emits, before the VM quickens any or they are
+// fused. A CLOSURE is as long as the function it closes over, one of
+// `constants`, has upvalues.
+int instructionLength(OpCode op, const uint8_t* code, const Value* constants);
+int stackEffect(OpCode op, const uint8_t* code);
 
 #endif /* value_hpp */
@@ -7,100 +7,174 @@
 //
 
 #include "vm.hpp"
+#include <algorithm>
+#include <cstdarg>
 
-template<class... Ts> struct overloaded : Ts... { using Ts::operator()...; };
-template<class... Ts> overloaded(Ts...) -> overloaded<Ts...>;
-
-struct CallVisitor {
-    const int argCount;
-    VM& vm;
-    
-    CallVisitor(int argCount, VM& vm)
-        : argCount(argCount), vm(vm) {}
-    
-    bool operator()(const NativeFunction& native) const {
-        auto result = native->function(argCount, vm.stack.end() - argCount);
-        vm.stack.resize(vm.stack.size() - argCount - 1);
-        vm.stack.reserve(STACK_MAX);
-        vm.push(std::move(result));
-        return true;
-    }
-    
-    bool operator()(const Closure& closure) const {
-        return vm.call(closure, argCount);
-    }
-    
-    bool operator()(const ClassValue& klass) const {
-        vm.stack[vm.stack.size() - argCount - 1] = std::make_shared<InstanceObject>(klass);
-        auto found = klass->methods.find(vm.initString);
-        if (found != klass->methods.end()) {
-            auto initializer = found->second;
-            return vm.call(initializer, argCount);
-        } else if (argCount != 0) {
-            vm.runtimeError("Expected 0 arguments but got %d.", argCount);
-            return false;
+bool VM::callValue(Value callee, int argCount) {
+    if (callee.isObj()) {
+        switch (callee.asObj()->type) {
+            case ObjType::NATIVE:
+                return callNative(callee.as<NativeFunctionObject>(), argCount);
+            case ObjType::CLOSURE:
+                return call(callee.as<ClosureObject>(), argCount);
+            case ObjType::CLASS: {
+                auto klass = callee.as<ClassObject>();
+                stack[stack.size() - argCount - 1] = heap.allocate<InstanceObject>(klass);
+                if (auto initializer = klass->findMethod(initSelector)) {
+                    return call(initializer, argCount);
+                } else if (argCount != 0) {
+                    runtimeError("Expected 0 arguments but got %d.", argCount);
+                    return false;
+                }
+                return true;
+            }
+            case ObjType::BOUND_METHOD: {
+                auto bound = callee.as<BoundMethodObject>();
+                stack[stack.size() - argCount - 1] = bound->receiver;
+                return call(bound->method, argCount);
+            }
+            default:
+                break; // Non-callable object type.
         }
-        return true;
-    }
-    
-    bool operator()(const BoundMethodValue& bound) const {
-        vm.stack[vm.stack.size() - argCount - 1] = bound->receiver;
-        return vm.call(bound->method, argCount);
     }
 
-    template <typename T>
-    bool operator()(const T& value) const {
-        vm.runtimeError("Can only call functions and classes.");
+    runtimeError("Can only call functions and classes.");
+    return false;
+}
+
+// Leaves the result in the callee's slot, where the arguments start.
+bool VM::callNative(NativeFunction native, int argCount) {
+    if (argCount != native->arity) {
+        runtimeError("Expected %d arguments but got %d.", native->arity, argCount);
         return false;
     }
-};
 
-bool VM::callValue(const Value& callee, int argCount) {
-    return std::visit(CallVisitor(argCount, *this), callee);
+    auto args = stack.end() - argCount;
+    if (auto error = native->function(args, args[-1])) {
+        runtimeError("%s", error);
+        return false;
+    }
+    stack.truncate(stack.size() - argCount);
+    return true;
 }
 
-bool VM::invoke(const std::string& name, int argCount) {
-    try {
-        auto instance = std::get<InstanceValue>(peek(argCount));
-        
-        auto found = instance->fields.find(name);
-        if (found != instance->fields.end()) {
-            auto value = found->second;
-            stack[stack.size() - argCount - 1] = value;
-            return callValue(value, argCount);
-        }
-        
-        return invokeFromClass(instance->klass, name, argCount);
-    } catch (std::bad_variant_access&) {
+bool VM::invoke(StringObject* name, int argCount, InlineCache& cache) {
+    auto receiver = peek(argCount);
+    if (!receiver.is<InstanceObject>()) {
         runtimeError("Only instances have methods.");
         return false;
     }
+
+    auto property = findProperty(cache, receiver.as<InstanceObject>(), name);
+    if (property.field != nullptr) {
+        auto value = *property.field;
+        stack[stack.size() - argCount - 1] = value;
+        return callValue(value, argCount);
+    }
+
+    if (property.method == nullptr) {
+        runtimeError("Undefined property '%s'.", name->chars.c_str());
+        return false;
+    }
+    return call(property.method, argCount);
 }
 
-bool VM::invokeFromClass(ClassValue klass, const std::string& name, int argCount) {
-    auto found = klass->methods.find(name);
-    if (found == klass->methods.end()) {
-        runtimeError("Undefined property '%s'.", name.c_str());
+bool VM::invokeFromClass(ClassValue klass, uint16_t selector, int argCount) {
+    auto method = klass->findMethod(selector);
+    if (method == nullptr) {
+        runtimeError("Undefined property '%s'.", selectors.names[selector]->chars.c_str());
         return false;
     }
-    auto method = found->second;
     return call(method, argCount);
 }
 
-bool VM::bindMethod(ClassValue klass, const std::string& name) {
-    auto found = klass->methods.find(name);
-    if (found == klass->methods.end()) {
-        runtimeError("Undefined property '%s'.", name.c_str());
+// Instances without a shape keep their fields in a hash table and are
+// never cached.
+VM::Property VM::findPropertySlow(InlineCache& cache, InstanceValue instance, StringObject* name) {
+    cacheStats.misses++;
+    auto shape = instance->shape;
+    if (shape == nullptr) {
+        if (auto field = instance->findField(name)) return { field, nullptr };
+        return { nullptr, findMethod(instance->klass, name) };
+    }
+
+    auto slot = shape->find(name);
+    auto method = slot == -1 ? findMethod(instance->klass, name) : nullptr;
+    fillCache(cache, { shape, slot, method, nullptr });
+    return { slot == -1 ? nullptr : &instance->field(slot), method };
+}
+
+void VM::setPropertySlow(InlineCache& cache, InstanceValue instance, StringObject* name, Value value) {
+    cacheStats.misses++;
+    auto shape = instance->shape;
+    instance->setField(name, value);
+    heap.writeBarrier(instance, value);
+
+    if (instance->shape == nullptr) {
+        heap.writeBarrier(instance, name);
+    } else if (instance->shape == shape) {
+        fillCache(cache, { shape, shape->find(name), nullptr, nullptr });
+    } else {
+        // The transition may be new, and the class holds on to its name.
+        heap.writeBarrier(instance->klass, name);
+        fillCache(cache, { shape, instance->shape->slot, nullptr, instance->shape });
+    }
+}
+
+// `cache` belongs to the running function.
+void VM::fillCache(InlineCache& cache, const InlineCache::Entry& entry) {
+    if (cache.count == INLINE_CACHE_SIZE) {
+        cacheStats.megamorphic++;
+        return;
+    }
+
+    cache.entries[cache.count++] = entry;
+    auto function = frames.back().closure->function;
+    heap.writeBarrier(function, entry.shape->klass);
+    if (entry.method != nullptr) heap.writeBarrier(function, entry.method);
+}
+
+// Only for cache misses, which have the name rather than its selector.
+Closure VM::findMethod(ClassValue klass, StringObject* name) {
+    auto selector = selectors.find(name);
+    return selector == -1 ? nullptr : klass->findMethod(selector);
+}
+
+bool VM::bindMethod(ClassValue klass, uint16_t selector, bool inFrame) {
+    auto method = klass->findMethod(selector);
+    if (method == nullptr) {
+        runtimeError("Undefined property '%s'.", selectors.names[selector]->chars.c_str());
         return false;
     }
-    auto method = found->second;
-    auto instance = std::get<InstanceValue>(peek(0));
-    auto bound = std::make_shared<BoundMethodObject>(instance, method);
+    pushBoundMethod(method, inFrame);
+    return true;
+}
+
+// Replaces the receiver on top of the stack with `method` bound to it.
+void VM::pushBoundMethod(Closure method, bool inFrame) {
+    auto bound = inFrame ? bindMethodInFrame(peek(0), method)
+                         : heap.allocate<BoundMethodObject>(peek(0), method);
     
     pop();
     push(bound);
-    
-    return true;
+}
+
+// Reuses the bound method of the stack slot the receiver is in. Whatever was
+// kept there before belonged to a variable that has gone out of scope. These
+// are always marked, so the Heap leaves them alone; their references are
+// roots instead, as long as the stack points at them.
+BoundMethodValue VM::bindMethodInFrame(Value receiver, Closure method) {
+    auto slot = stack.size() - 1;
+    while (inFrameBoundMethods.size() <= slot) {
+        auto& bound = inFrameBoundMethods.emplace_back(Value(), nullptr);
+        bound.isMarked = true;
+        bound.isInFrame = true;
+    }
+
+    auto& bound = inFrameBoundMethods[slot];
+    bound.receiver = receiver;
+    bound.method = method;
+    return &bound;
 }
 
 UpvalueValue VM::captureUpvalue(Value* local) {
@@ -116,7 +190,7 @@ UpvalueValue VM::captureUpvalue(Value* local) {
         return upvalue;
     }
     
-    auto createdUpvalue = std::make_shared<UpvalueObject>(local);
+    auto createdUpvalue = heap.allocate<UpvalueObject>(local);
     createdUpvalue->next = upvalue;
     
     if (prevUpvalue == nullptr) {
@@ -128,20 +202,50 @@ UpvalueValue VM::captureUpvalue(Value* local) {
     return createdUpvalue;
 }
 
+UpvalueValue VM::upvalueInFrame(Value* local) {
+    auto slot = static_cast<size_t>(local - stack.begin());
+    while (inFrameUpvalues.size() <= slot) {
+        auto& upvalue = inFrameUpvalues.emplace_back(nullptr);
+        upvalue.isMarked = true;
+        upvalue.isInFrame = true;
+    }
+
+    auto& upvalue = inFrameUpvalues[slot];
+    upvalue.location = local;
+    return &upvalue;
+}
+
+// Fills in the upvalues of a closure CLOSURE just made, from the upvalue
+// operands at `ip` and the frame whose slots start at `slots`.
+void VM::captureUpvalues(Closure closure, const uint8_t* ip, Value* slots, Closure enclosing) {
+    for (int i = 0; i < static_cast<int>(closure->upvalues.size()); i++) {
+        auto kind = Capture(*ip++);
+        auto index = *ip++;
+        auto& captured = closure->upvalues[i];
+        switch (kind) {
+            case Capture::UPVALUE: captured = enclosing->upvalues[index]; break;
+            case Capture::LOCAL: captured = captureUpvalue(&slots[index]); break;
+            case Capture::VALUE: captured = slots[index]; break;
+            case Capture::IN_FRAME: captured = upvalueInFrame(&slots[index]); break;
+        }
+        heap.writeBarrier(closure, captured);
+    }
+}
+
 void VM::closeUpvalues(Value* last) {
     while (openUpvalues != nullptr && openUpvalues->location >= last) {
-        auto& upvalue = openUpvalues;
+        auto upvalue = openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        heap.writeBarrier(upvalue, upvalue->closed);
         openUpvalues = upvalue->next;
     }
 }
 
-void VM::defineMethod(const std::string& name) {
-    auto method = std::get<Closure>(peek(0));
-    auto klass = std::get<ClassValue>(peek(1));
-    klass->methods[name] = method;
-    pop();
+void VM::defineMethod(ClassValue klass, uint16_t selector, Closure method) {
+    if (klass->methods.size() <= selector) klass->methods.resize(selector + 1);
+    klass->methods[selector] = method;
+    heap.writeBarrier(klass, method);
 }
 
 bool VM::call(const Closure& closure, int argCount) {
@@ -151,33 +255,168 @@ bool VM::call(const Closure& closure, int argCount) {
         return false;
     }
     
-    if (frames.size() + 1 == FRAMES_MAX) {
+    // Temporaries and arguments go on top of the locals, so a frame can need
+    // more than its share of the reserved stack.
+    auto stackOffset = stack.size() - argCount - 1;
+    if (frames.full() || stackOffset + closure->function->getStackSize() > stack.getCapacity()) {
         runtimeError("Stack overflow.");
         return false;
     }
 
-    frames.emplace_back(CallFrame());
+    jit.countUse(closure->function);
+    frames.push(CallFrame());
     auto& frame = frames.back();
-    frame.ip = 0;
+    frame.ip = closure->function->getChunk().getCodeStart();
     frame.closure = closure;
-    frame.stackOffset = stack.size() - argCount - 1;
+    frame.stackOffset = stackOffset;
     
     return true;
 }
 
+// Moves the frame a call in tail position has just pushed down over the
+// caller's, once the caller's upvalues are closed. The callee returns to
+// wherever the caller would have.
+// The callee's frame moves down to where the caller's starts, so `call`
+// already made sure it has room.
+void VM::replaceCaller() {
+    auto& callee = frames.back();
+    auto& caller = frames[frames.size() - 2];
+    auto slots = &stack[caller.stackOffset];
+    closeUpvalues(slots);
+
+    auto window = stack.size() - callee.stackOffset;
+    std::copy(&stack[callee.stackOffset], stack.end(), slots);
+    stack.truncate(caller.stackOffset + window);
+    caller.closure = callee.closure;
+    caller.ip = callee.ip;
+    frames.pop();
+}
+
 InterpretResult VM::interpret(const std::string& source) {
-    auto parser = Parser(source);
-    auto opt = parser.compile();
+    Heap::Scope scope(heap);
+    auto opt = Parser(source, heap, globals, selectors).compile();
     if (!opt) { return InterpretResult::COMPILE_ERROR; }
 
     auto& function = *opt;
-    auto closure = std::make_shared<ClosureObject>(function);
+    // A script with a function the register machine cannot hold runs on the
+    // stack machine instead, and so does every one after it, since they can
+    // call its functions.
+    if (backend == Backend::REGISTERS && !translate(function)) {
+        setBackend(Backend::STACK);
+    }
+
+    push(function);
+    auto closure = heap.allocate<ClosureObject>(function);
+    pop();
     push(closure);
     call(closure, 0);
 
-    return run();
+    InterpretResult result;
+    if (backend == Backend::REGISTERS) {
+        enterRegisterFrame();
+        result = runRegisters();
+    } else {
+        result = run();
+    }
+    stack.releaseUnused();
+    return result;
 }
 
+// Translates `function` and every function declared inside it, or fails if
+// one of them needs more registers than the register machine has.
+bool VM::translate(FunctionObject* function) {
+    std::string_view error;
+    if (!translateToRegisters(function, error)) return false;
+
+#ifdef DEBUG_PRINT_CODE
+    auto name = function->getName().empty() ? "<script>" : function->getName();
+    function->getRegisterCode().disassemble(function->getChunk(), name);
+#endif
+
+    auto& chunk = function->getChunk();
+    for (auto i = 0; i < chunk.constantCount(); i++) {
+        auto& constant = chunk.getConstant(i);
+        if (constant.is<FunctionObject>() && !translate(constant.as<FunctionObject>())) return false;
+    }
+    return true;
+}
+
+// Points the frame `call` just pushed at its register code and makes room
+// for its registers.
+void VM::enterRegisterFrame() {
+    auto& frame = frames.back();
+    auto& registers = frame.closure->function->getRegisterCode();
+    frame.ip = registers.code.data();
+    stack.resize(frame.stackOffset + registers.frameSize);
+}
+
+// `call` for a closure whose callee and arguments are in registers from
+// `callee` on.
+bool VM::callInRegisters(const Closure& closure, size_t callee, int argCount) {
+    auto function = closure->function;
+    if (argCount != function->arity) {
+        runtimeError("Expected %d arguments but got %d.", function->arity, argCount);
+        return false;
+    }
+
+    if (frames.full()) {
+        runtimeError("Stack overflow.");
+        return false;
+    }
+
+    auto& registers = function->registers;
+    frames.push({ closure, registers.code.data(), callee });
+    stack.truncate(callee + argCount + 1);
+    stack.resize(callee + registers.frameSize);
+    return true;
+}
+
+// Calls whatever else is in register `callee` the way the stack backend
+// does, after dropping the registers above the arguments so they are on top
+// of the stack. The stack then goes back up to the end of the frame that
+// runs next: the callee's, or the caller's if the call has already returned.
+bool VM::callValueInRegisters(size_t callee, int argCount) {
+    auto frameCount = frames.size();
+    auto top = stack.size();
+    stack.truncate(callee + argCount + 1);
+    if (!callValue(stack[callee], argCount)) return false;
+
+    if (frames.size() > frameCount) {
+        enterRegisterFrame();
+    } else {
+        stack.resize(top);
+    }
+    return true;
+}
+
+void VM::setMaxFrames(size_t frames) {
+    this->frames.reserve(frames);
+    stack.reserve(STACK_SLOTS(frames));
+}
+
+std::optional<Handle> VM::getGlobal(const std::string& name) {
+    Heap::Scope scope(heap);
+    auto found = globals.slots.find(heap.copyString(name));
+    if (found == globals.slots.end()) return std::nullopt;
+    auto value = globals.values[found->second];
+    if (value.isUndefined()) return std::nullopt;
+    return heap.makeHandle(value);
+}
+
+void VM::printCacheStats(std::ostream& os) const {
+    auto lookups = cacheStats.hits + cacheStats.misses;
+    os << "inline caches: " << cacheStats.hits << " hits, " << cacheStats.misses << " misses ("
+       << cacheStats.megamorphic << " megamorphic)";
+    if (lookups > 0) os << ", " << 100.0 * cacheStats.hits / lookups << "% hit rate";
+    os << std::endl;
+}
+
+#ifdef DEBUG_PROFILE_OPCODES
+void VM::printOpcodeProfile(std::ostream& os) const {
+    opcodeProfile.print(os);
+}
+#endif
+
 void VM::runtimeError(const char* format, ...) {
     va_list args;
     va_start(args, format);
@@ -186,9 +425,24 @@ void VM::runtimeError(const char* format, ...) {
     std::cerr << std::endl;
     
     for (auto i = frames.size(); i-- > 0; ) {
+        // Only show both ends of a deep trace.
+        if (frames.size() > 2 * TRACE_EDGE_FRAMES && i == frames.size() - TRACE_EDGE_FRAMES - 1) {
+            auto omitted = frames.size() - 2 * TRACE_EDGE_FRAMES;
+            std::cerr << "[" << omitted << " more frames]" << std::endl;
+            i -= omitted - 1;
+            continue;
+        }
+
         auto& frame = frames[i];
         auto function = frame.closure->function;
-        auto line = function->getChunk().getLine(frame.ip - 1);
+        int line;
+        if (backend == Backend::REGISTERS) {
+            auto& registers = function->getRegisterCode();
+            line = registers.lines[frame.ip - registers.code.data() - 1];
+        } else {
+            auto& chunk = function->getChunk();
+            line = chunk.getLine(static_cast<int>(frame.ip - chunk.getCodeStart()) - 1);
+        }
         std::cerr << "[line " << line << "] in ";
         if (function->name.empty()) {
             std::cerr << "script" << std::endl;
@@ -200,24 +454,74 @@ void VM::runtimeError(const char* format, ...) {
     resetStack();
 }
 
-void VM::defineNative(const std::string& name, NativeFn function) {
-    auto obj = std::make_shared<NativeFunctionObject>();
-    obj->function = function;
-    globals[name] = obj;
+void VM::defineNative(const std::string& name, NativeFn function, int arity, bool isPure) {
+    push(heap.copyString(name));
+    push(heap.allocate<NativeFunctionObject>(function, arity, isPure));
+    auto slot = globals.resolve(peek(1).as<StringObject>());
+    globals.values[slot] = peek(0);
+    heap.rootBarrier(peek(1));
+    heap.rootBarrier(peek(0));
+    pop();
+    pop();
+}
+
+void VM::markRoots() {
+    markStackRoots();
+
+    for (auto name : globals.names) {
+        heap.markObject(name);
+    }
+    for (auto& value : globals.values) {
+        heap.markValue(value);
+    }
+    for (auto name : selectors.names) {
+        heap.markObject(name);
+    }
+}
+
+void VM::markStackRoots() {
+    for (auto& value : stack) {
+        heap.markValue(value);
+        if (value.isObj() && value.asObj()->isInFrame) {
+            auto bound = value.as<BoundMethodObject>();
+            heap.markValue(bound->receiver);
+            heap.markObject(bound->method);
+        }
+    }
+
+    for (auto& frame : frames) {
+        heap.markObject(frame.closure);
+    }
+
+    for (auto upvalue = openUpvalues; upvalue != nullptr; upvalue = upvalue->next) {
+        heap.markObject(upvalue);
+    }
+}
+
+void VM::evacuateRoots() {
+    for (auto& value : stack) {
+        heap.evacuate(value);
+        if (value.isObj() && value.asObj()->isInFrame) {
+            heap.evacuate(value.as<BoundMethodObject>()->receiver);
+        }
+    }
+
+    for (auto& value : globals.values) {
+        heap.evacuate(value);
+    }
 }
 
 template <typename F>
 bool VM::binaryOp(F op) {
-    try {
-        auto b = std::get<double>(peek(0));
-        auto a = std::get<double>(peek(1));
-        
-        popTwoAndPush(op(a, b));
-        return true;
-    } catch (std::bad_variant_access&) {
+    if (!peek(0).isNumber() || !peek(1).isNumber()) {
         runtimeError("Operands must be numbers.");
         return false;
     }
+
+    auto b = peek(0).asNumber();
+    auto a = peek(1).asNumber();
+    popTwoAndPush(op(a, b));
+    return true;
 }
 
 void VM::popTwoAndPush(const Value& v) {
@@ -226,312 +530,1069 @@ void VM::popTwoAndPush(const Value& v) {
     push(v);
 }
 
+// Dispatch is direct threaded where the compiler supports labels as values,
+// and a switch everywhere else. Either way the running frame's ip, slots and
+// constants live in locals. They are written back before anything that can
+// look at the frame from outside (calls and errors) and reloaded after
+// anything that can change which frame is running.
+//
+// Generic instructions that find the operands a quickened form expects
+// rewrite themselves into it, and quickened ones that do not rewrite
+// themselves back and run again as the generic one.
+//
+// Superinstructions step over the opcodes of the parts they cover. Those
+// parts are never quickened, so superinstructions check their operands
+// themselves.
+//
+// A frame whose function the JIT has compiled runs as machine code from
+// wherever it is whenever the loop loads it or goes around one of its loops,
+// and goes on through the calls and returns it makes until it gets to code
+// it has to leave to the loop.
 InterpretResult VM::run() {
-    auto readByte = [this]() -> uint8_t {
-        return this->frames.back().closure->function->getCode(this->frames.back().ip++);
-    };
-    
-    auto readConstant = [this, readByte]() -> const Value& {
-        return this->frames.back().closure->function->getConstant(readByte());
-    };
-    
-    auto readShort = [this]() -> uint16_t {
-        this->frames.back().ip += 2;
-        return ((this->frames.back().closure->function->getCode(this->frames.back().ip - 2) << 8) | (this->frames.back().closure->function->getCode(this->frames.back().ip - 1)));
-    };
-    
-    auto readString = [readConstant]() -> const std::string& {
-        return std::get<std::string>(readConstant());
-    };
-    
-    while (true) {
-#ifdef DEBUG_TRACE_EXECUTION
-        std::cout << "          ";
-        for (auto value: stack) {
-            std::cout << "[ " << value << " ]";
-        }
-        std::cout << std::endl;
-        
-        frames.back().closure->function->getChunk().disassembleInstruction(frames.back().ip);
+    CallFrame* frame;
+    uint8_t* ip;
+    Value* slots;
+    const Value* constants;
+    InlineCache* caches;
+    // Only added to the VM's count on the way out, so that counting costs
+    // next to nothing.
+    size_t executed = 0;
+
+#define FINISH(result) \
+    do { \
+        instructionCount += executed; \
+        return result; \
+    } while (false)
+
+#define LOAD_FRAME() \
+    do { \
+        frame = &frames.back(); \
+        ip = frame->ip; \
+        slots = &stack[frame->stackOffset]; \
+        constants = frame->closure->function->getChunk().getConstants(); \
+        caches = frame->closure->function->getChunk().getCaches(); \
+    } while (false)
+
+#define STORE_FRAME() (frame->ip = ip)
+
+#ifdef X86_64_JIT
+#define RUN_NATIVE() \
+    do { \
+        if (frame->closure->function->getNativeCode() != nullptr) { \
+            STORE_FRAME(); \
+            if (!jit.run()) FINISH(InterpretResult::RUNTIME_ERROR); \
+            LOAD_FRAME(); \
+        } \
+    } while (false)
+#else
+#define RUN_NATIVE() do {} while (false)
 #endif
 
-#define BINARY_OP(op) \
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, static_cast<uint16_t>((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_STRING() (READ_CONSTANT().as<StringObject>())
+#define READ_CACHE() (caches[READ_SHORT()])
+
+// Only valid before an instruction has read any of its operands.
+#define QUICKEN(name) (ip[-1] = static_cast<uint8_t>(OpCode::name))
+#define DEQUICKEN(name) (QUICKEN(name), ip--)
+
+#define BINARY_OP(op, quickened) \
     do { \
+        if (peek(0).isNumber() && peek(1).isNumber()) QUICKEN(quickened); \
+        STORE_FRAME(); \
         if (!binaryOp([](double a, double b) -> Value { return a op b; })) { \
-            return InterpretResult::RUNTIME_ERROR; \
+            FINISH(InterpretResult::RUNTIME_ERROR); \
+        } \
+    } while (false)
+
+// Finishes a superinstruction whose operands are not what it is fast for by
+// running the part whose opcode `ip` is on as itself. Direct threading can go
+// straight to that part's handler; a switch just dispatches it as usual.
+#ifdef COMPUTED_GOTO
+#define FUSED_TAIL(name) { ip++; goto op_##name; }
+#else
+#define FUSED_TAIL(name) break
+#endif
+
+// Not wrapped in do-while, which would catch a switch's FUSED_TAIL break.
+#define LOCAL_CONSTANT_OP(op, generic) \
+    { \
+        auto a = slots[READ_BYTE()]; \
+        ip++; /* CONSTANT */ \
+        auto b = READ_CONSTANT(); \
+        if (!a.isNumber() || !b.isNumber()) { \
+            push(a); \
+            push(b); \
+            FUSED_TAIL(generic); \
         } \
+        ip++; /* The operator. */ \
+        push(a.asNumber() op b.asNumber()); \
+    }
+
+#define NUMBER_OP(op, generic) \
+    if (peek(0).isNumber() && peek(1).isNumber()) { \
+        auto b = pop().asNumber(); \
+        stack.back() = Value(stack.back().asNumber() op b); \
+    } else { \
+        DEQUICKEN(generic); \
+    }
+
+#define SAFEPOINT() \
+    do { \
+        if (!heap.safepoint()) { \
+            STORE_FRAME(); \
+            runtimeError("Out of memory."); \
+            FINISH(InterpretResult::RUNTIME_ERROR); \
+        } \
+    } while (false)
+
+#define RUNTIME_ERROR(...) \
+    do { \
+        STORE_FRAME(); \
+        runtimeError(__VA_ARGS__); \
+        FINISH(InterpretResult::RUNTIME_ERROR); \
+    } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION() \
+    do { \
+        std::cout << "          "; \
+        for (auto value: stack) { \
+            std::cout << "[ " << value << " ]"; \
+        } \
+        std::cout << std::endl; \
+        auto& chunk = frame->closure->function->getChunk(); \
+        chunk.disassembleInstruction(static_cast<int>(ip - chunk.getCodeStart())); \
+    } while (false)
+#else
+#define TRACE_EXECUTION() do {} while (false)
+#endif
+
+#ifdef DEBUG_PROFILE_OPCODES
+#define PROFILE_INSTRUCTION() opcodeProfile.record(ip)
+#else
+#define PROFILE_INSTRUCTION() do {} while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    static const void* dispatchTable[] = {
+#define OPCODE_LABEL(name) &&op_##name,
+#define SUPERINSTRUCTION_LABEL(name, ...) &&op_##name,
+        OPCODES(OPCODE_LABEL)
+        QUICKENED_OPCODES(OPCODE_LABEL)
+        SUPERINSTRUCTIONS(SUPERINSTRUCTION_LABEL)
+#undef SUPERINSTRUCTION_LABEL
+#undef OPCODE_LABEL
+    };
+
+#define CASE(name) op_##name
+#define DISPATCH() \
+    do { \
+        TRACE_EXECUTION(); \
+        PROFILE_INSTRUCTION(); \
+        executed++; \
+        goto *dispatchTable[READ_BYTE()]; \
     } while (false)
-        
-        auto instruction = OpCode(readByte());
-        switch (instruction) {
-            case OpCode::CONSTANT: {
-                auto constant = readConstant();
-                push(constant);
-                break;
-            }
-            case OpCode::NIL:   push(std::monostate()); break;
-            case OpCode::TRUE:  push(true); break;
-            case OpCode::FALSE: push(false); break;
-            case OpCode::POP: pop(); break;
+#else
+#define CASE(name) case OpCode::name
+#define DISPATCH() break
+#endif
+
+    LOAD_FRAME();
+    RUN_NATIVE();
+
+#ifdef COMPUTED_GOTO
+    DISPATCH();
+#else
+    while (true) {
+        TRACE_EXECUTION();
+        PROFILE_INSTRUCTION();
+        executed++;
+        switch (OpCode(READ_BYTE())) {
+#endif
+            CASE(CONSTANT): {
+                push(READ_CONSTANT());
+                DISPATCH();
+            }
+            CASE(NIL):   push(Value()); DISPATCH();
+            CASE(TRUE):  push(true); DISPATCH();
+            CASE(FALSE): push(false); DISPATCH();
+            CASE(POP): pop(); DISPATCH();
                 
-            case OpCode::GET_LOCAL: {
-                uint8_t slot = readByte();
-                push(stack[frames.back().stackOffset + slot]);
-                break;
+            CASE(GET_LOCAL): {
+                uint8_t slot = READ_BYTE();
+                push(slots[slot]);
+                DISPATCH();
             }
                 
-            case OpCode::GET_GLOBAL: {
-                auto name = readString();
-                auto found = globals.find(name);
-                if (found == globals.end()) {
-                    runtimeError("Undefined variable '%s'.", name.c_str());
-                    return InterpretResult::RUNTIME_ERROR;
+            CASE(GET_GLOBAL_SLOT): {
+                auto slot = READ_SHORT();
+                auto value = globals.values[slot];
+                if (value.isUndefined()) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", globals.names[slot]->chars.c_str());
                 }
-                push(found->second);
-                break;
+                push(value);
+                DISPATCH();
             }
                 
-            case OpCode::DEFINE_GLOBAL: {
-                auto name = readString();
-                globals[name] = peek(0);
+            CASE(DEFINE_GLOBAL_SLOT): {
+                auto slot = READ_SHORT();
+                globals.values[slot] = peek(0);
+                heap.rootBarrier(peek(0));
                 pop();
-                break;
+                DISPATCH();
             }
                 
-            case OpCode::SET_LOCAL: {
-                uint8_t slot = readByte();
-                stack[frames.back().stackOffset + slot] = peek(0);
-                break;
+            CASE(SET_LOCAL): {
+                uint8_t slot = READ_BYTE();
+                slots[slot] = peek(0);
+                DISPATCH();
             }
                 
-            case OpCode::SET_GLOBAL: {
-                auto name = readString();
-                auto found = globals.find(name);
-                if (found == globals.end()) {
-                    runtimeError("Undefined variable '%s'.", name.c_str());
-                    return InterpretResult::RUNTIME_ERROR;
-                }
-                found->second = peek(0);
-                break;
-            }
-            case OpCode::GET_UPVALUE: {
-                auto slot = readByte();
-                push(*frames.back().closure->upvalues[slot]->location);
-                break;
-            }
-            case OpCode::SET_UPVALUE: {
-                auto slot = readByte();
-                *frames.back().closure->upvalues[slot]->location = peek(0);
-                break;
-            }
-            case OpCode::GET_PROPERTY: {
-                InstanceValue instance;
-
-                try {
-                    instance = std::get<InstanceValue>(peek(0));
-                } catch (std::bad_variant_access&) {
-                    runtimeError("Only instances have properties.");
-                    return InterpretResult::RUNTIME_ERROR;
-                }
-
-                auto name = readString();
-                auto found = instance->fields.find(name);
-                if (found != instance->fields.end()) {
-                    auto value = found->second;
+            CASE(SET_GLOBAL_SLOT): {
+                auto slot = READ_SHORT();
+                auto& value = globals.values[slot];
+                if (value.isUndefined()) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", globals.names[slot]->chars.c_str());
+                }
+                value = peek(0);
+                heap.rootBarrier(peek(0));
+                DISPATCH();
+            }
+            CASE(GET_UPVALUE): {
+                auto slot = READ_BYTE();
+                push(frame->closure->upvalue(slot));
+                DISPATCH();
+            }
+            CASE(SET_UPVALUE): {
+                auto slot = READ_BYTE();
+                auto upvalue = frame->closure->upvalues[slot].as<UpvalueObject>();
+                *upvalue->location = peek(0);
+                if (!upvalue->isInFrame) heap.writeBarrier(upvalue, peek(0));
+                DISPATCH();
+            }
+            CASE(GET_PROPERTY):
+            CASE(GET_PROPERTY_IN_FRAME): {
+                auto inFrame = OpCode(ip[-1]) == OpCode::GET_PROPERTY_IN_FRAME;
+                if (!peek(0).is<InstanceObject>()) {
+                    RUNTIME_ERROR("Only instances have properties.");
+                }
+
+                auto instance = peek(0).as<InstanceObject>();
+                auto name = READ_STRING();
+                auto property = findProperty(READ_CACHE(), instance, name);
+                if (property.field != nullptr) {
+                    auto value = *property.field;
                     pop(); // Instance.
                     push(value);
-                    break;
+                    DISPATCH();
                 }
 
-                if (!bindMethod(instance->klass, name)) {
-                    return InterpretResult::RUNTIME_ERROR;
+                if (property.method == nullptr) {
+                    RUNTIME_ERROR("Undefined property '%s'.", name->chars.c_str());
                 }
-                break;
+                pushBoundMethod(property.method, inFrame);
+                DISPATCH();
             }
-            case OpCode::SET_PROPERTY: {
-                try {
-                    auto instance = std::get<InstanceValue>(peek(1));
-                    auto name = readString();
-                    instance->fields[name] = peek(0);
-                    
-                    auto value = pop();
-                    pop();
-                    push(value);
-                } catch (std::bad_variant_access&) {
-                    runtimeError("Only instances have fields.");
-                    return InterpretResult::RUNTIME_ERROR;
+            CASE(SET_PROPERTY): {
+                if (!peek(1).is<InstanceObject>()) {
+                    RUNTIME_ERROR("Only instances have fields.");
                 }
-                break;
+
+                auto instance = peek(1).as<InstanceObject>();
+                auto name = READ_STRING();
+                setProperty(READ_CACHE(), instance, name, peek(0));
+
+                auto value = pop();
+                pop();
+                push(value);
+                DISPATCH();
             }
-            case OpCode::GET_SUPER: {
-                auto name = readString();
-                auto superclass = std::get<ClassValue>(pop());
+            CASE(GET_SUPER):
+            CASE(GET_SUPER_IN_FRAME): {
+                auto inFrame = OpCode(ip[-1]) == OpCode::GET_SUPER_IN_FRAME;
+                auto selector = READ_SHORT();
+                auto superclass = pop().as<ClassObject>();
                 
-                if (!bindMethod(superclass, name)) {
-                    return InterpretResult::RUNTIME_ERROR;
+                STORE_FRAME();
+                if (!bindMethod(superclass, selector, inFrame)) {
+                    FINISH(InterpretResult::RUNTIME_ERROR);
                 }
-                break;
+                DISPATCH();
             }
-            case OpCode::EQUAL: {
+            CASE(EQUAL): {
                 popTwoAndPush(peek(0) == peek(1));
-                break;
+                DISPATCH();
             }
                 
-            case OpCode::GREATER:   BINARY_OP(>); break;
-            case OpCode::LESS:      BINARY_OP(<); break;
+            CASE(GREATER):   BINARY_OP(>, GREATER_NUM); DISPATCH();
+            CASE(LESS):      BINARY_OP(<, LESS_NUM); DISPATCH();
                 
-            case OpCode::ADD: {
-                auto success = std::visit(overloaded {
-                    [this](double b, double a) -> bool {
-                        this->popTwoAndPush(a + b);
-                        return true;
-                    },
-                    [this](std::string b, std::string a) -> bool {
-                        this->popTwoAndPush(a + b);
-                        return true;
-                    },
-                    [this](auto a, auto b) -> bool {
-                        this->runtimeError("Operands must be two numbers or two strings.");
-                        return false;
-                    }
-                }, peek(0), peek(1));
-                
-                if (!success)
-                    return InterpretResult::RUNTIME_ERROR;
-                
-                break;
+            CASE(ADD): {
+                auto b = peek(0);
+                auto a = peek(1);
+                if (a.isNumber() && b.isNumber()) {
+                    QUICKEN(ADD_NUM);
+                    popTwoAndPush(a.asNumber() + b.asNumber());
+                } else if (a.is<StringObject>() && b.is<StringObject>()) {
+                    popTwoAndPush(heap.concatenate(a.as<StringObject>(), b.as<StringObject>()));
+                } else {
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
+                }
+                DISPATCH();
             }
                 
-            case OpCode::SUBTRACT:  BINARY_OP(-); break;
-            case OpCode::MULTIPLY:  BINARY_OP(*); break;
-            case OpCode::DIVIDE:    BINARY_OP(/); break;
-            case OpCode::NOT: push(isFalsy(pop())); break;
+            CASE(SUBTRACT):  BINARY_OP(-, SUBTRACT_NUM); DISPATCH();
+            CASE(MULTIPLY):  BINARY_OP(*, MULTIPLY_NUM); DISPATCH();
+            CASE(DIVIDE):    BINARY_OP(/, DIVIDE_NUM); DISPATCH();
+            CASE(NOT): push(pop().isFalsy()); DISPATCH();
             
-            case OpCode::NEGATE:
-                try {
-                    auto negated = -std::get<double>(peek(0));
-                    pop(); // if we get here it means it was good
-                    push(negated);
-                } catch (std::bad_variant_access&) {
-                    runtimeError("Operand must be a number.");
-                    return InterpretResult::RUNTIME_ERROR;
-                }
-                break;
+            CASE(NEGATE):
+                if (!peek(0).isNumber()) {
+                    RUNTIME_ERROR("Operand must be a number.");
+                }
+                push(-pop().asNumber());
+                DISPATCH();
                 
-            case OpCode::PRINT: {
+            CASE(PRINT): {
                 std::cout << pop() << std::endl;
-                break;
+                DISPATCH();
             }
             
-            case OpCode::JUMP: {
-                auto offset = readShort();
-                frames.back().ip += offset;
-                break;
+            CASE(JUMP): {
+                auto offset = READ_SHORT();
+                ip += offset;
+                DISPATCH();
             }
                 
-            case OpCode::LOOP: {
-                auto offset = readShort();
-                frames.back().ip -= offset;
-                break;
+            CASE(LOOP): {
+                auto offset = READ_SHORT();
+                ip -= offset;
+                SAFEPOINT();
+                jit.countUse(frame->closure->function);
+                RUN_NATIVE();
+                DISPATCH();
             }
                 
-            case OpCode::JUMP_IF_FALSE: {
-                auto offset = readShort();
-                if (isFalsy(peek(0))) {
-                    frames.back().ip += offset;
+            CASE(JUMP_IF_FALSE): {
+                auto offset = READ_SHORT();
+                if (peek(0).isFalsy()) {
+                    ip += offset;
                 }
-                break;
+                DISPATCH();
             }
                 
-            case OpCode::CALL: {
-                int argCount = readByte();
+            CASE(CALL): {
+                SAFEPOINT();
+                int argCount = READ_BYTE();
+                if (peek(argCount).is<ClosureObject>()) {
+                    ip[-2] = static_cast<uint8_t>(OpCode::CALL_CLOSURE);
+                } else if (peek(argCount).is<NativeFunctionObject>()) {
+                    ip[-2] = static_cast<uint8_t>(OpCode::CALL_NATIVE);
+                }
+                STORE_FRAME();
                 if (!callValue(peek(argCount), argCount)) {
-                    return InterpretResult::RUNTIME_ERROR;
+                    FINISH(InterpretResult::RUNTIME_ERROR);
                 }
-                break;
+                LOAD_FRAME();
+                RUN_NATIVE();
+                DISPATCH();
             }
                 
-            case OpCode::INVOKE: {
-                auto method = readString();
-                int argCount = readByte();
-                if (!invoke(method, argCount)) {
-                    return InterpretResult::RUNTIME_ERROR;
+            CASE(INVOKE): {
+                SAFEPOINT();
+                auto method = READ_STRING();
+                int argCount = READ_BYTE();
+                auto& cache = READ_CACHE();
+                STORE_FRAME();
+                if (!invoke(method, argCount, cache)) {
+                    FINISH(InterpretResult::RUNTIME_ERROR);
                 }
-                break;
+                LOAD_FRAME();
+                RUN_NATIVE();
+                DISPATCH();
             }
                 
-            case OpCode::SUPER_INVOKE: {
-                auto method = readString();
-                int argCount = readByte();
-                auto superclass = std::get<ClassValue>(pop());
-                if (!invokeFromClass(superclass, method, argCount)) {
-                    return InterpretResult::RUNTIME_ERROR;
+            CASE(TAIL_CALL): {
+                SAFEPOINT();
+                int argCount = READ_BYTE();
+                auto frameCount = frames.size();
+                STORE_FRAME();
+                if (!callValue(peek(argCount), argCount)) {
+                    FINISH(InterpretResult::RUNTIME_ERROR);
+                }
+                if (frames.size() > frameCount) replaceCaller();
+                LOAD_FRAME();
+                RUN_NATIVE();
+                DISPATCH();
+            }
+
+            CASE(TAIL_INVOKE): {
+                SAFEPOINT();
+                auto method = READ_STRING();
+                int argCount = READ_BYTE();
+                auto& cache = READ_CACHE();
+                auto frameCount = frames.size();
+                STORE_FRAME();
+                if (!invoke(method, argCount, cache)) {
+                    FINISH(InterpretResult::RUNTIME_ERROR);
                 }
-                break;
+                if (frames.size() > frameCount) replaceCaller();
+                LOAD_FRAME();
+                RUN_NATIVE();
+                DISPATCH();
+            }
+
+            CASE(SUPER_INVOKE): {
+                SAFEPOINT();
+                auto selector = READ_SHORT();
+                int argCount = READ_BYTE();
+                auto superclass = pop().as<ClassObject>();
+                STORE_FRAME();
+                if (!invokeFromClass(superclass, selector, argCount)) {
+                    FINISH(InterpretResult::RUNTIME_ERROR);
+                }
+                LOAD_FRAME();
+                RUN_NATIVE();
+                DISPATCH();
             }
                 
-            case OpCode::CLOSURE: {
-                auto function = std::get<Function>(readConstant());
-                auto closure = std::make_shared<ClosureObject>(function);
+            CASE(CLOSURE): {
+                auto function = READ_CONSTANT().as<FunctionObject>();
+                auto closure = heap.allocate<ClosureObject>(function);
                 push(closure);
-                for (int i = 0; i < static_cast<int>(closure->upvalues.size()); i++) {
-                    auto isLocal = readByte();
-                    auto index = readByte();
-                    if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(&stack[frames.back().stackOffset + index]);
-                    } else {
-                        closure->upvalues[i] = frames.back().closure->upvalues[index];
-                    }
-                }
-                break;
+                captureUpvalues(closure, ip, slots, frame->closure);
+                ip += 2 * closure->upvalues.size();
+                DISPATCH();
             }
             
-            case OpCode::CLOSE_UPVALUE:
+            CASE(CLOSE_UPVALUE):
                 closeUpvalues(&stack.back());
                 pop();
-                break;
+                DISPATCH();
                 
-            case OpCode::RETURN: {
+            CASE(RETURN): {
                 auto result = pop();
-                closeUpvalues(&stack[frames.back().stackOffset]);
+                closeUpvalues(slots);
                 
-                auto lastOffset = frames.back().stackOffset;
-                frames.pop_back();
+                auto lastOffset = frame->stackOffset;
+                frames.pop();
                 if (frames.empty()) {
                     pop();
-                    return InterpretResult::OK;
+                    FINISH(InterpretResult::OK);
                 }
 
-                stack.resize(lastOffset);
-                stack.reserve(STACK_MAX);
+                stack.truncate(lastOffset);
                 push(result);
-                break;
+                LOAD_FRAME();
+                RUN_NATIVE();
+                DISPATCH();
             }
                 
-            case OpCode::CLASS:
-                push(std::make_shared<ClassObject>(readString()));
-                break;
+            CASE(CLASS):
+                push(heap.allocate<ClassObject>(READ_STRING()));
+                DISPATCH();
                 
-            case OpCode::INHERIT: {
-                try {
-                    auto superclass = std::get<ClassValue>(peek(1));
-                    auto subclass = std::get<ClassValue>(peek(0));
-                    subclass->methods = superclass->methods;
-                    pop(); // Subclass.
-                    break;
-                } catch (std::bad_variant_access&) {
-                    runtimeError("Superclass must be a class.");
-                    return InterpretResult::RUNTIME_ERROR;
+            CASE(INHERIT): {
+                if (!peek(1).is<ClassObject>()) {
+                    RUNTIME_ERROR("Superclass must be a class.");
                 }
+
+                auto superclass = peek(1).as<ClassObject>();
+                auto subclass = peek(0).as<ClassObject>();
+                subclass->methods = superclass->methods;
+                heap.writeBarrier(subclass);
+                pop(); // Subclass.
+                DISPATCH();
             }
                 
-            case OpCode::METHOD:
-                defineMethod(readString());
-                break;
+            CASE(METHOD):
+                defineMethod(peek(1).as<ClassObject>(), READ_SHORT(), peek(0).as<ClosureObject>());
+                pop();
+                DISPATCH();
+
+            CASE(GREATER_NUM):  NUMBER_OP(>, GREATER); DISPATCH();
+            CASE(LESS_NUM):     NUMBER_OP(<, LESS); DISPATCH();
+            CASE(ADD_NUM):      NUMBER_OP(+, ADD); DISPATCH();
+            CASE(SUBTRACT_NUM): NUMBER_OP(-, SUBTRACT); DISPATCH();
+            CASE(MULTIPLY_NUM): NUMBER_OP(*, MULTIPLY); DISPATCH();
+            CASE(DIVIDE_NUM):   NUMBER_OP(/, DIVIDE); DISPATCH();
+
+            CASE(CALL_CLOSURE): {
+                auto callee = peek(*ip);
+                if (!callee.is<ClosureObject>()) {
+                    DEQUICKEN(CALL);
+                    DISPATCH();
+                }
+
+                SAFEPOINT();
+                int argCount = READ_BYTE();
+                STORE_FRAME();
+                if (!call(callee.as<ClosureObject>(), argCount)) {
+                    FINISH(InterpretResult::RUNTIME_ERROR);
+                }
+                LOAD_FRAME();
+                RUN_NATIVE();
+                DISPATCH();
+            }
+
+            CASE(CALL_NATIVE): {
+                auto callee = peek(*ip);
+                if (!callee.is<NativeFunctionObject>()) {
+                    DEQUICKEN(CALL);
+                    DISPATCH();
+                }
+
+                SAFEPOINT();
+                int argCount = READ_BYTE();
+                STORE_FRAME();
+                if (!callNative(callee.as<NativeFunctionObject>(), argCount)) {
+                    FINISH(InterpretResult::RUNTIME_ERROR);
+                }
+                DISPATCH();
+            }
+
+            CASE(POP_GET_GLOBAL_SLOT):
+                pop();
+                FUSED_TAIL(GET_GLOBAL_SLOT);
+
+            CASE(GET_LOCAL_GET_PROPERTY):
+                push(slots[READ_BYTE()]);
+                FUSED_TAIL(GET_PROPERTY);
+
+            CASE(GET_LOCAL_RETURN):
+                push(slots[READ_BYTE()]);
+                FUSED_TAIL(RETURN);
+
+            CASE(GET_LOCAL_CONSTANT_ADD):      LOCAL_CONSTANT_OP(+, ADD); DISPATCH();
+            CASE(GET_LOCAL_CONSTANT_SUBTRACT): LOCAL_CONSTANT_OP(-, SUBTRACT); DISPATCH();
+
+            CASE(GET_LOCAL_CONSTANT_LESS_JUMP_IF_FALSE): {
+                LOCAL_CONSTANT_OP(<, LESS);
+                ip++; // JUMP_IF_FALSE
+                auto offset = READ_SHORT();
+                if (peek(0).isFalsy()) {
+                    ip += offset;
+                }
+                DISPATCH();
+            }
+
+            CASE(JUMP_IF_FALSE_POP): {
+                auto offset = READ_SHORT();
+                if (peek(0).isFalsy()) {
+                    ip += offset;
+                } else {
+                    pop();
+                    ip++; // POP
+                }
+                DISPATCH();
+            }
+
+            CASE(SET_PROPERTY_POP): {
+                if (!peek(1).is<InstanceObject>()) {
+                    RUNTIME_ERROR("Only instances have fields.");
+                }
+
+                auto instance = peek(1).as<InstanceObject>();
+                auto name = READ_STRING();
+                setProperty(READ_CACHE(), instance, name, peek(0));
+                pop(); // Value.
+                pop(); // Instance.
+                ip++; // POP
+                DISPATCH();
+            }
+
+            CASE(SET_LOCAL_POP):
+                slots[READ_BYTE()] = pop();
+                ip++; // POP
+                DISPATCH();
+
+            CASE(NIL_RETURN):
+                push(Value());
+                FUSED_TAIL(RETURN);
+#ifndef COMPUTED_GOTO
         }
     }
-    
-    return InterpretResult::OK;
+#endif
+
+#undef FINISH
+#undef LOAD_FRAME
+#undef STORE_FRAME
+#undef RUN_NATIVE
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef READ_CACHE
+#undef QUICKEN
+#undef DEQUICKEN
+#undef BINARY_OP
+#undef NUMBER_OP
+#undef FUSED_TAIL
+#undef LOCAL_CONSTANT_OP
+#undef SAFEPOINT
+#undef RUNTIME_ERROR
+#undef TRACE_EXECUTION
+#undef PROFILE_INSTRUCTION
+#undef CASE
+#undef DISPATCH
+}
+
+// The register backend's loop. Each frame's registers are its stack slots,
+// and the stack's top stays at the end of the running frame's registers, so
+// the collector and upvalues see them the same way they see the stack
+// backend's slots.
+//
+// Nothing here is quickened or fused: the register code already does the
+// work of several stack instructions per dispatch.
+InterpretResult VM::runRegisters() {
+    CallFrame* frame;
+    uint8_t* ip;
+    Value* regs;
+    const Value* constants;
+    InlineCache* caches;
+    size_t executed = 0;
+
+#define FINISH(result) \
+    do { \
+        instructionCount += executed; \
+        return result; \
+    } while (false)
+
+#define LOAD_FRAME() \
+    do { \
+        frame = &frames.back(); \
+        ip = frame->ip; \
+        regs = &stack[frame->stackOffset]; \
+        constants = frame->closure->function->getChunk().getConstants(); \
+        caches = frame->closure->function->getChunk().getCaches(); \
+    } while (false)
+
+#define STORE_FRAME() (frame->ip = ip)
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, static_cast<uint16_t>((ip[-2] << 8) | ip[-1]))
+#define READ_REGISTER() (regs[READ_BYTE()])
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_STRING() (READ_CONSTANT().as<StringObject>())
+#define READ_CACHE() (caches[READ_SHORT()])
+
+#define BINARY_OP(op, right) \
+    do { \
+        auto dest = READ_BYTE(); \
+        auto a = READ_REGISTER(); \
+        auto b = right; \
+        if (!a.isNumber() || !b.isNumber()) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        regs[dest] = a.asNumber() op b.asNumber(); \
+    } while (false)
+
+#define ADD_OP(right) \
+    do { \
+        auto dest = READ_BYTE(); \
+        auto a = READ_REGISTER(); \
+        auto b = right; \
+        if (a.isNumber() && b.isNumber()) { \
+            regs[dest] = a.asNumber() + b.asNumber(); \
+        } else if (a.is<StringObject>() && b.is<StringObject>()) { \
+            regs[dest] = heap.concatenate(a.as<StringObject>(), b.as<StringObject>()); \
+        } else { \
+            RUNTIME_ERROR("Operands must be two numbers or two strings."); \
+        } \
+    } while (false)
+
+#define EQUAL_OP(right) \
+    do { \
+        auto dest = READ_BYTE(); \
+        auto a = READ_REGISTER(); \
+        auto b = right; \
+        regs[dest] = a == b; \
+    } while (false)
+
+#define COMPARE_AND_JUMP(op, right) \
+    do { \
+        auto a = READ_REGISTER(); \
+        auto b = right; \
+        auto offset = READ_SHORT(); \
+        if (!a.isNumber() || !b.isNumber()) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        if (!(a.asNumber() op b.asNumber())) ip += offset; \
+    } while (false)
+
+#define EQUAL_AND_JUMP(right) \
+    do { \
+        auto a = READ_REGISTER(); \
+        auto b = right; \
+        auto offset = READ_SHORT(); \
+        if (!(a == b)) ip += offset; \
+    } while (false)
+
+#define SAFEPOINT() \
+    do { \
+        if (!heap.safepoint()) { \
+            STORE_FRAME(); \
+            runtimeError("Out of memory."); \
+            FINISH(InterpretResult::RUNTIME_ERROR); \
+        } \
+    } while (false)
+
+#define RUNTIME_ERROR(...) \
+    do { \
+        STORE_FRAME(); \
+        runtimeError(__VA_ARGS__); \
+        FINISH(InterpretResult::RUNTIME_ERROR); \
+    } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION() \
+    do { \
+        std::cout << "          "; \
+        for (auto value = regs; value != stack.end(); value++) { \
+            std::cout << "[ " << *value << " ]"; \
+        } \
+        std::cout << std::endl; \
+        auto function = frame->closure->function; \
+        auto& registers = function->getRegisterCode(); \
+        registers.disassembleInstruction(function->getChunk(), static_cast<int>(ip - registers.code.data())); \
+    } while (false)
+#else
+#define TRACE_EXECUTION() do {} while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    static const void* dispatchTable[] = {
+#define REGISTER_OPCODE_LABEL(name) &&reg_##name,
+        REGISTER_OPCODES(REGISTER_OPCODE_LABEL)
+#undef REGISTER_OPCODE_LABEL
+    };
+
+#define CASE(name) reg_##name
+#define DISPATCH() \
+    do { \
+        TRACE_EXECUTION(); \
+        executed++; \
+        goto *dispatchTable[READ_BYTE()]; \
+    } while (false)
+#else
+#define CASE(name) case RegisterOp::name
+#define DISPATCH() break
+#endif
+
+    LOAD_FRAME();
+
+#ifdef COMPUTED_GOTO
+    DISPATCH();
+#else
+    while (true) {
+        TRACE_EXECUTION();
+        executed++;
+        switch (RegisterOp(READ_BYTE())) {
+#endif
+            CASE(MOVE): {
+                auto dest = READ_BYTE();
+                regs[dest] = READ_REGISTER();
+                DISPATCH();
+            }
+            CASE(LOAD_CONSTANT): {
+                auto dest = READ_BYTE();
+                regs[dest] = READ_CONSTANT();
+                DISPATCH();
+            }
+            CASE(LOAD_NIL):   regs[READ_BYTE()] = Value(); DISPATCH();
+            CASE(LOAD_TRUE):  regs[READ_BYTE()] = true; DISPATCH();
+            CASE(LOAD_FALSE): regs[READ_BYTE()] = false; DISPATCH();
+
+            CASE(GET_GLOBAL): {
+                auto dest = READ_BYTE();
+                auto slot = READ_SHORT();
+                auto value = globals.values[slot];
+                if (value.isUndefined()) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", globals.names[slot]->chars.c_str());
+                }
+                regs[dest] = value;
+                DISPATCH();
+            }
+            CASE(DEFINE_GLOBAL): {
+                auto value = READ_REGISTER();
+                globals.values[READ_SHORT()] = value;
+                heap.rootBarrier(value);
+                DISPATCH();
+            }
+            CASE(SET_GLOBAL): {
+                auto value = READ_REGISTER();
+                auto slot = READ_SHORT();
+                auto& global = globals.values[slot];
+                if (global.isUndefined()) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", globals.names[slot]->chars.c_str());
+                }
+                global = value;
+                heap.rootBarrier(value);
+                DISPATCH();
+            }
+            CASE(GET_UPVALUE): {
+                auto dest = READ_BYTE();
+                regs[dest] = frame->closure->upvalue(READ_BYTE());
+                DISPATCH();
+            }
+            CASE(SET_UPVALUE): {
+                auto value = READ_REGISTER();
+                auto upvalue = frame->closure->upvalues[READ_BYTE()].as<UpvalueObject>();
+                *upvalue->location = value;
+                if (!upvalue->isInFrame) heap.writeBarrier(upvalue, value);
+                DISPATCH();
+            }
+
+            CASE(GET_PROPERTY): {
+                auto dest = READ_BYTE();
+                auto receiver = READ_REGISTER();
+                if (!receiver.is<InstanceObject>()) {
+                    RUNTIME_ERROR("Only instances have properties.");
+                }
+
+                auto name = READ_STRING();
+                auto property = findProperty(READ_CACHE(), receiver.as<InstanceObject>(), name);
+                if (property.field != nullptr) {
+                    regs[dest] = *property.field;
+                } else if (property.method != nullptr) {
+                    regs[dest] = heap.allocate<BoundMethodObject>(receiver, property.method);
+                } else {
+                    RUNTIME_ERROR("Undefined property '%s'.", name->chars.c_str());
+                }
+                DISPATCH();
+            }
+            CASE(SET_PROPERTY): {
+                auto instance = READ_REGISTER();
+                auto value = READ_REGISTER();
+                if (!instance.is<InstanceObject>()) {
+                    RUNTIME_ERROR("Only instances have fields.");
+                }
+
+                auto name = READ_STRING();
+                setProperty(READ_CACHE(), instance.as<InstanceObject>(), name, value);
+                DISPATCH();
+            }
+            CASE(GET_SUPER): {
+                auto dest = READ_BYTE();
+                auto receiver = READ_REGISTER();
+                auto superclass = READ_REGISTER().as<ClassObject>();
+                auto selector = READ_SHORT();
+                auto method = superclass->findMethod(selector);
+                if (method == nullptr) {
+                    RUNTIME_ERROR("Undefined property '%s'.", selectors.names[selector]->chars.c_str());
+                }
+                regs[dest] = heap.allocate<BoundMethodObject>(receiver, method);
+                DISPATCH();
+            }
+
+            CASE(EQUAL):      EQUAL_OP(READ_REGISTER()); DISPATCH();
+            CASE(GREATER):    BINARY_OP(>, READ_REGISTER()); DISPATCH();
+            CASE(LESS):       BINARY_OP(<, READ_REGISTER()); DISPATCH();
+            CASE(ADD):        ADD_OP(READ_REGISTER()); DISPATCH();
+            CASE(SUBTRACT):   BINARY_OP(-, READ_REGISTER()); DISPATCH();
+            CASE(MULTIPLY):   BINARY_OP(*, READ_REGISTER()); DISPATCH();
+            CASE(DIVIDE):     BINARY_OP(/, READ_REGISTER()); DISPATCH();
+            CASE(EQUAL_K):    EQUAL_OP(READ_CONSTANT()); DISPATCH();
+            CASE(GREATER_K):  BINARY_OP(>, READ_CONSTANT()); DISPATCH();
+            CASE(LESS_K):     BINARY_OP(<, READ_CONSTANT()); DISPATCH();
+            CASE(ADD_K):      ADD_OP(READ_CONSTANT()); DISPATCH();
+            CASE(SUBTRACT_K): BINARY_OP(-, READ_CONSTANT()); DISPATCH();
+            CASE(MULTIPLY_K): BINARY_OP(*, READ_CONSTANT()); DISPATCH();
+            CASE(DIVIDE_K):   BINARY_OP(/, READ_CONSTANT()); DISPATCH();
+
+            CASE(NOT): {
+                auto dest = READ_BYTE();
+                regs[dest] = READ_REGISTER().isFalsy();
+                DISPATCH();
+            }
+            CASE(NEGATE): {
+                auto dest = READ_BYTE();
+                auto value = READ_REGISTER();
+                if (!value.isNumber()) {
+                    RUNTIME_ERROR("Operand must be a number.");
+                }
+                regs[dest] = -value.asNumber();
+                DISPATCH();
+            }
+            CASE(PRINT):
+                std::cout << READ_REGISTER() << std::endl;
+                DISPATCH();
+
+            CASE(JUMP): {
+                auto offset = READ_SHORT();
+                ip += offset;
+                DISPATCH();
+            }
+            CASE(JUMP_IF_FALSE): {
+                auto condition = READ_REGISTER();
+                auto offset = READ_SHORT();
+                if (condition.isFalsy()) {
+                    ip += offset;
+                }
+                DISPATCH();
+            }
+            CASE(JUMP_IF_NOT_EQUAL):     EQUAL_AND_JUMP(READ_REGISTER()); DISPATCH();
+            CASE(JUMP_IF_NOT_GREATER):   COMPARE_AND_JUMP(>, READ_REGISTER()); DISPATCH();
+            CASE(JUMP_IF_NOT_LESS):      COMPARE_AND_JUMP(<, READ_REGISTER()); DISPATCH();
+            CASE(JUMP_IF_NOT_EQUAL_K):   EQUAL_AND_JUMP(READ_CONSTANT()); DISPATCH();
+            CASE(JUMP_IF_NOT_GREATER_K): COMPARE_AND_JUMP(>, READ_CONSTANT()); DISPATCH();
+            CASE(JUMP_IF_NOT_LESS_K):    COMPARE_AND_JUMP(<, READ_CONSTANT()); DISPATCH();
+
+            CASE(LOOP): {
+                auto offset = READ_SHORT();
+                ip -= offset;
+                SAFEPOINT();
+                DISPATCH();
+            }
+
+            CASE(CALL):
+            CASE(TAIL_CALL): {
+                SAFEPOINT();
+                auto tail = RegisterOp(ip[-1]) == RegisterOp::TAIL_CALL;
+                auto callee = frame->stackOffset + READ_BYTE();
+                int argCount = READ_BYTE();
+                auto frameCount = frames.size();
+                STORE_FRAME();
+                if (stack[callee].is<ClosureObject>()) {
+                    if (!callInRegisters(stack[callee].as<ClosureObject>(), callee, argCount)) {
+                        FINISH(InterpretResult::RUNTIME_ERROR);
+                    }
+                } else if (!callValueInRegisters(callee, argCount)) {
+                    FINISH(InterpretResult::RUNTIME_ERROR);
+                }
+                if (tail && frames.size() > frameCount) replaceCaller();
+                LOAD_FRAME();
+                DISPATCH();
+            }
+            CASE(INVOKE):
+            CASE(TAIL_INVOKE): {
+                SAFEPOINT();
+                auto tail = RegisterOp(ip[-1]) == RegisterOp::TAIL_INVOKE;
+                auto callee = frame->stackOffset + READ_BYTE();
+                auto method = READ_STRING();
+                int argCount = READ_BYTE();
+                auto& cache = READ_CACHE();
+                auto frameCount = frames.size();
+                STORE_FRAME();
+
+                auto receiver = stack[callee];
+                if (!receiver.is<InstanceObject>()) {
+                    RUNTIME_ERROR("Only instances have methods.");
+                }
+
+                auto property = findProperty(cache, receiver.as<InstanceObject>(), method);
+                if (property.field != nullptr) {
+                    auto value = *property.field;
+                    stack[callee] = value;
+                    if (!callValueInRegisters(callee, argCount)) {
+                        FINISH(InterpretResult::RUNTIME_ERROR);
+                    }
+                } else if (property.method == nullptr) {
+                    RUNTIME_ERROR("Undefined property '%s'.", method->chars.c_str());
+                } else if (!callInRegisters(property.method, callee, argCount)) {
+                    FINISH(InterpretResult::RUNTIME_ERROR);
+                }
+                if (tail && frames.size() > frameCount) replaceCaller();
+                LOAD_FRAME();
+                DISPATCH();
+            }
+            CASE(SUPER_INVOKE): {
+                SAFEPOINT();
+                auto callee = frame->stackOffset + READ_BYTE();
+                auto selector = READ_SHORT();
+                int argCount = READ_BYTE();
+                auto superclass = stack[callee + argCount + 1].as<ClassObject>();
+                STORE_FRAME();
+                auto closure = superclass->findMethod(selector);
+                if (closure == nullptr) {
+                    RUNTIME_ERROR("Undefined property '%s'.", selectors.names[selector]->chars.c_str());
+                }
+                if (!callInRegisters(closure, callee, argCount)) {
+                    FINISH(InterpretResult::RUNTIME_ERROR);
+                }
+                LOAD_FRAME();
+                DISPATCH();
+            }
+
+            CASE(CLOSURE): {
+                auto dest = READ_BYTE();
+                auto function = READ_CONSTANT().as<FunctionObject>();
+                auto closure = heap.allocate<ClosureObject>(function);
+                regs[dest] = closure;
+                captureUpvalues(closure, ip, regs, frame->closure);
+                ip += 2 * closure->upvalues.size();
+                DISPATCH();
+            }
+            CASE(CLOSE_UPVALUE):
+                closeUpvalues(&READ_REGISTER());
+                DISPATCH();
+
+            CASE(RETURN):
+            CASE(RETURN_NIL): {
+                auto result = RegisterOp(ip[-1]) == RegisterOp::RETURN_NIL ? Value() : READ_REGISTER();
+                closeUpvalues(regs);
+
+                auto lastOffset = frame->stackOffset;
+                frames.pop();
+                if (frames.empty()) {
+                    stack.clear();
+                    FINISH(InterpretResult::OK);
+                }
+
+                auto& caller = frames.back();
+                stack[lastOffset] = result;
+                stack.resize(caller.stackOffset + caller.closure->function->getRegisterCode().frameSize);
+                LOAD_FRAME();
+                DISPATCH();
+            }
+
+            CASE(CLASS): {
+                auto dest = READ_BYTE();
+                regs[dest] = heap.allocate<ClassObject>(READ_STRING());
+                DISPATCH();
+            }
+            CASE(INHERIT): {
+                auto superclass = READ_REGISTER();
+                auto subclass = READ_REGISTER().as<ClassObject>();
+                if (!superclass.is<ClassObject>()) {
+                    RUNTIME_ERROR("Superclass must be a class.");
+                }
+
+                subclass->methods = superclass.as<ClassObject>()->methods;
+                heap.writeBarrier(subclass);
+                DISPATCH();
+            }
+            CASE(METHOD): {
+                auto klass = READ_REGISTER().as<ClassObject>();
+                auto method = READ_REGISTER().as<ClosureObject>();
+                defineMethod(klass, READ_SHORT(), method);
+                DISPATCH();
+            }
+#ifndef COMPUTED_GOTO
+        }
+    }
+#endif
 
+#undef FINISH
+#undef LOAD_FRAME
+#undef STORE_FRAME
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_REGISTER
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef READ_CACHE
 #undef BINARY_OP
+#undef ADD_OP
+#undef EQUAL_OP
+#undef COMPARE_AND_JUMP
+#undef EQUAL_AND_JUMP
+#undef SAFEPOINT
+#undef RUNTIME_ERROR
+#undef TRACE_EXECUTION
+#undef CASE
+#undef DISPATCH
 }
@@ -11,10 +11,24 @@
 
 #include "value.hpp"
 #include "compiler.hpp"
+#include "jit.hpp"
+#include "memory.hpp"
+#include "profile.hpp"
+#include "registers.hpp"
+#include "stack.hpp"
+#include <cmath>
+#include <deque>
+#include <optional>
 #include <unordered_map>
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// How deep calls can nest by default. Every frame gets room for as many
+// slots as a function can have locals, plus one more frame's worth for the
+// temporaries and arguments on top of the deepest one.
+#define FRAMES_MAX 65536
+#define STACK_SLOTS(frames) (((frames) + 1) * UINT8_COUNT)
+
+// A runtime error's stack trace shows this many frames at either end.
+#define TRACE_EDGE_FRAMES 32
 
 enum class InterpretResult {
     OK,
@@ -22,65 +36,174 @@ enum class InterpretResult {
     RUNTIME_ERROR
 };
 
-struct CallFrame {
-    Closure closure;
-    unsigned ip;
-    unsigned long stackOffset;
+// Which code the VM runs: the stack bytecode the compiler emits, or the
+// register code translateToRegisters makes from it.
+enum class Backend {
+    STACK,
+    REGISTERS
+};
+
+struct InlineCacheStats {
+    size_t hits = 0;
+    size_t misses = 0;
+    // Misses at sites that had already seen INLINE_CACHE_SIZE classes.
+    size_t megamorphic = 0;
 };
 
-static Value clockNative(int argCount, std::vector<Value>::iterator args) {
-    return (double)clock() / CLOCKS_PER_SEC;
+static const char* clockNative(const Value* args, Value& result) {
+    result = (double)clock() / CLOCKS_PER_SEC;
+    return nullptr;
 }
 
-struct CallVisitor;
+static const char* sqrtNative(const Value* args, Value& result) {
+    if (!args[0].isNumber()) return "Argument must be a number.";
+    result = std::sqrt(args[0].asNumber());
+    return nullptr;
+}
 
 class VM {
-    // TODO: Switch to a fixed array to prevent pointer invalidation
-    std::vector<Value> stack;
-    std::vector<CallFrame> frames;
-    std::unordered_map<std::string, Value> globals;
+    Heap heap;
+    ValueStack stack;
+    CallStack frames;
+    GlobalTable globals;
+    SelectorTable selectors;
     UpvalueValue openUpvalues;
-    std::string initString = "init";
+    uint16_t initSelector = 0;
+    // Bound methods the compiler proved never outlive their frame, one per
+    // stack slot. A deque so they stay put as it grows.
+    std::deque<BoundMethodObject> inFrameBoundMethods;
+    // Likewise the upvalues of closures that never outlive the frame whose
+    // locals they capture.
+    std::deque<UpvalueObject> inFrameUpvalues;
+    InlineCacheStats cacheStats;
+    Backend backend = Backend::STACK;
+    size_t instructionCount = 0;
+    // Only compiles for the stack backend.
+    Jit jit;
+    bool jitEnabled = true;
+#ifdef DEBUG_PROFILE_OPCODES
+    OpcodeProfile opcodeProfile;
+#endif
     
     inline void resetStack() {
         stack.clear();
+        stack.releaseUnused();
         frames.clear();
-        stack.reserve(STACK_MAX);
         openUpvalues = nullptr;
     }
     
     void runtimeError(const char* format, ...);
-    void defineNative(const std::string& name, NativeFn function);
+    void defineNative(const std::string& name, NativeFn function, int arity, bool isPure);
     template <typename F>
     bool binaryOp(F op);
     void popTwoAndPush(const Value& v);
     
-    inline void push(const Value& v) { stack.push_back(v); }
-    inline Value pop() {
-        auto v = std::move(stack.back());
-        stack.pop_back();
-        return v;
+    inline void push(const Value& v) { stack.push(v); }
+    inline Value pop() { return stack.pop(); }
+    inline const Value& peek(int distance) { return stack.end()[-1 - distance]; }
+    bool callValue(Value callee, int argCount);
+    bool callNative(NativeFunction native, int argCount);
+    bool invoke(StringObject* name, int argCount, InlineCache& cache);
+    bool invokeFromClass(ClassValue klass, uint16_t selector, int argCount);
+
+    // What a property name means on an instance: one of its fields, or else
+    // a method of its class, or neither.
+    struct Property {
+        Value* field;
+        Closure method;
+    };
+
+    Property findProperty(InlineCache& cache, InstanceValue instance, StringObject* name) {
+        if (instance->shape != nullptr) {
+            if (auto entry = cache.find(instance->shape)) {
+                cacheStats.hits++;
+                return { entry->slot == -1 ? nullptr : &instance->field(entry->slot), entry->method };
+            }
+        }
+        return findPropertySlow(cache, instance, name);
     }
-    inline const Value& peek(int distance) { return stack[stack.size() - 1 - distance]; }
-    bool callValue(const Value& callee, int argCount);
-    bool invoke(const std::string& name, int argCount);
-    bool invokeFromClass(ClassValue klass, const std::string& name, int argCount);
-    bool bindMethod(ClassValue klass, const std::string& name);
+    void setProperty(InlineCache& cache, InstanceValue instance, StringObject* name, Value value) {
+        if (instance->shape != nullptr) {
+            if (auto entry = cache.find(instance->shape)) {
+                cacheStats.hits++;
+                if (entry->transition != nullptr) {
+                    instance->addField(entry->transition, value);
+                } else {
+                    instance->field(entry->slot) = value;
+                }
+                heap.writeBarrier(instance, value);
+                return;
+            }
+        }
+        setPropertySlow(cache, instance, name, value);
+    }
+    Property findPropertySlow(InlineCache& cache, InstanceValue instance, StringObject* name);
+    void setPropertySlow(InlineCache& cache, InstanceValue instance, StringObject* name, Value value);
+    void fillCache(InlineCache& cache, const InlineCache::Entry& entry);
+    Closure findMethod(ClassValue klass, StringObject* name);
+    bool bindMethod(ClassValue klass, uint16_t selector, bool inFrame);
+    void pushBoundMethod(Closure method, bool inFrame);
+    BoundMethodValue bindMethodInFrame(Value receiver, Closure method);
     UpvalueValue captureUpvalue(Value* local);
+    UpvalueValue upvalueInFrame(Value* local);
+    void captureUpvalues(Closure closure, const uint8_t* ip, Value* slots, Closure enclosing);
     void closeUpvalues(Value* last);
-    void defineMethod(const std::string& name);
+    void defineMethod(ClassValue klass, uint16_t selector, Closure method);
     bool call(const Closure& closure, int argCount);
+    void replaceCaller();
+    bool translate(FunctionObject* function);
+    bool callInRegisters(const Closure& closure, size_t callee, int argCount);
+    bool callValueInRegisters(size_t callee, int argCount);
+    void enterRegisterFrame();
+    void markRoots();
+    void markStackRoots();
+    void evacuateRoots();
     
 public:
-    explicit VM() {
-        stack.reserve(STACK_MAX);
+    explicit VM(): heap(*this), stack(STACK_SLOTS(FRAMES_MAX)), frames(FRAMES_MAX), jit(*this) {
+        Heap::Scope scope(heap);
+        setJitEnabled(true);
         openUpvalues = nullptr;
-        defineNative("clock", clockNative);
+        initSelector = static_cast<uint16_t>(selectors.resolve(heap.copyString("init")));
+        defineNative("clock", clockNative, 0, true);
+        defineNative("sqrt", sqrtNative, 1, false);
     }
     InterpretResult interpret(const std::string& source);
     InterpretResult run();
-    
-    friend CallVisitor;
+    InterpretResult runRegisters();
+    Heap& getHeap() { return heap; }
+    void setBackend(Backend backend) {
+        this->backend = backend;
+        setJitEnabled(jitEnabled);
+    }
+    // Whether hot functions are compiled to machine code, in builds that
+    // can. Only the stack backend runs it.
+    void setJitEnabled(bool enabled) {
+        jitEnabled = enabled;
+        jit.setEnabled(enabled && backend == Backend::STACK);
+    }
+    void setJitThreshold(uint32_t threshold) { jit.setThreshold(threshold); }
+    // Whether hot loops in compiled functions get traced, too.
+    void setTracing(bool tracing) { jit.setTracing(tracing); }
+    void printJitStats(std::ostream& os) const { jit.printStats(os); }
+    // How many instructions either backend has dispatched so far.
+    size_t getInstructionCount() const { return instructionCount; }
+    // How deeply calls can nest before "Stack overflow.". Reserves address
+    // space for the stack accordingly, so it can only change between
+    // scripts.
+    void setMaxFrames(size_t frames);
+    const InlineCacheStats& getCacheStats() const { return cacheStats; }
+    void printCacheStats(std::ostream& os) const;
+#ifdef DEBUG_PROFILE_OPCODES
+    void printOpcodeProfile(std::ostream& os) const;
+#endif
+    // Lets the host keep a global's current value alive after the script
+    // has moved on.
+    std::optional<Handle> getGlobal(const std::string& name);
+
+    friend Heap;
+    friend Jit;
+    friend struct JitRuntime;
 };
 
 #endif /* vm_hpp */
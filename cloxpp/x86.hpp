@@ -0,0 +1,382 @@
+//
+//  x86.hpp
+//  cloxpp
+//
+
+#ifndef x86_hpp
+#define x86_hpp
+
+#include "stack.hpp"
+#include "value.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+// What the JIT's compilers share: where things are in the VM for native
+// code, and how to assemble it. Only included where X86_64_JIT is defined.
+
+// The bit patterns of values, and where the fields of the VM's structures
+// are, for native code to test, build and follow them with. Some of the
+// objects are not standard layout, but the compilers the JIT is built with
+// lay them out as if they were.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+struct JitLayout {
+    static constexpr uint64_t QNAN = Value::QNAN;
+    static constexpr uint64_t NIL = Value::NIL_BITS;
+    static constexpr uint64_t FALSE = Value::FALSE_BITS;
+    static constexpr uint64_t TRUE = Value::TRUE_BITS;
+    static constexpr uint64_t UNDEFINED = Value::UNDEFINED_BITS;
+
+    static constexpr int32_t OBJ_TYPE = offsetof(Obj, type);
+    static constexpr int32_t INSTANCE_SHAPE = offsetof(InstanceObject, shape);
+    static constexpr int32_t INSTANCE_FIELDS = offsetof(InstanceObject, inlineFields);
+    static constexpr int32_t CLOSURE_FUNCTION = offsetof(ClosureObject, function);
+    static constexpr int32_t FUNCTION_ARITY = offsetof(FunctionObject, arity);
+    static constexpr int32_t FUNCTION_ENTRY = offsetof(FunctionObject, nativeEntry);
+    static constexpr int32_t FUNCTION_STACK_SIZE = offsetof(FunctionObject, stackSize);
+    static constexpr int32_t UPVALUE_LOCATION = offsetof(UpvalueObject, location);
+    static constexpr int32_t NATIVE_ARITY = offsetof(NativeFunctionObject, arity);
+    static constexpr int32_t NATIVE_IS_PURE = offsetof(NativeFunctionObject, isPure);
+    static constexpr int32_t CALL_STACK_TOP = offsetof(CallStack, top);
+    static constexpr int32_t CALL_STACK_LIMIT = offsetof(CallStack, limit);
+    static constexpr int32_t LOOP_COUNT = offsetof(NativeLoop, count);
+    static constexpr int32_t LOOP_ENTRY = offsetof(NativeLoop, entry);
+
+    static uint64_t of(const Value& value) { return value.bits; }
+};
+#pragma GCC diagnostic pop
+
+// Native code keeps nil in a register and makes the others from it.
+static_assert(JitLayout::FALSE == JitLayout::NIL + 1 && JitLayout::TRUE == JitLayout::NIL + 2,
+              "Native code tests for falsiness with one comparison and makes booleans by adding to false.");
+
+enum Reg: uint8_t { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+enum Xmm: uint8_t {
+    XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7,
+    XMM8, XMM9, XMM10, XMM11, XMM12, XMM13, XMM14, XMM15,
+};
+
+enum class Condition: uint8_t {
+    ABOVE_OR_EQUAL = 0x3,
+    EQUAL = 0x4,
+    NOT_EQUAL = 0x5,
+    BELOW_OR_EQUAL = 0x6,
+    ABOVE = 0x7,
+    SIGN = 0x8,
+    NOT_PARITY = 0xb,
+};
+
+// What native code keeps where. The rest are scratch.
+constexpr Reg STATE = RBX;
+constexpr Reg SLOTS = R12;
+constexpr Reg TOP = R13;
+constexpr Reg QNAN = R14;
+constexpr Reg NIL = R15;
+
+constexpr int32_t VALUE_SIZE = sizeof(Value);
+
+// Just enough of an x86-64 assembler for the JIT.
+class Assembler {
+    std::vector<uint8_t> code;
+
+    void rex(bool wide, int reg, int base, int index = 0) {
+        uint8_t prefix = 0x40 | (wide ? 8 : 0) | (reg >= 8 ? 4 : 0) | (index >= 8 ? 2 : 0) | (base >= 8 ? 1 : 0);
+        if (prefix != 0x40) byte(prefix);
+    }
+    void registers(int reg, int rm) { byte(static_cast<uint8_t>(0xc0 | (reg & 7) << 3 | (rm & 7))); }
+    void memory(int reg, Reg base, int32_t disp) {
+        auto mod = disp == 0 && (base & 7) != RBP ? 0 : disp >= -128 && disp <= 127 ? 1 : 2;
+        byte(static_cast<uint8_t>(mod << 6 | (reg & 7) << 3 | (base & 7)));
+        if ((base & 7) == RSP) byte(0x24);
+        if (mod == 1) byte(static_cast<uint8_t>(disp));
+        if (mod == 2) int32(disp);
+    }
+    // `op dst, src` for the ALU instructions that take a register source.
+    void alu(uint8_t opcode, Reg dst, Reg src) {
+        rex(true, src, dst);
+        byte(opcode);
+        registers(src, dst);
+    }
+    // [base + index * 8 + disp]
+    void memory(int reg, Reg base, Reg index, int32_t disp) {
+        auto mod = disp >= -128 && disp <= 127 ? 1 : 2;
+        byte(static_cast<uint8_t>(mod << 6 | (reg & 7) << 3 | RSP));
+        byte(static_cast<uint8_t>(3 << 6 | (index & 7) << 3 | (base & 7)));
+        if (mod == 1) byte(static_cast<uint8_t>(disp));
+        if (mod == 2) int32(disp);
+    }
+    // `op dst, imm` for the group of ALU instructions that take an immediate.
+    void aluImmediate(int extension, Reg dst, int32_t value) {
+        rex(true, 0, dst);
+        if (value >= -128 && value <= 127) {
+            byte(0x83);
+            registers(extension, dst);
+            byte(static_cast<uint8_t>(value));
+        } else {
+            byte(0x81);
+            registers(extension, dst);
+            int32(value);
+        }
+    }
+
+public:
+    size_t position() const { return code.size(); }
+    const std::vector<uint8_t>& bytes() const { return code; }
+
+    void byte(uint8_t value) { code.push_back(value); }
+    void int32(int32_t value) {
+        for (auto i = 0; i < 4; i++) byte(static_cast<uint8_t>(value >> (8 * i)));
+    }
+    void int64(uint64_t value) {
+        for (auto i = 0; i < 8; i++) byte(static_cast<uint8_t>(value >> (8 * i)));
+    }
+    void align(size_t alignment) {
+        while (position() % alignment != 0) byte(0xcc);
+    }
+
+    void movImmediate(Reg dst, uint64_t value) {
+        if (value <= UINT32_MAX) {
+            // mov r32, imm32 zero extends.
+            if (dst >= 8) byte(0x41);
+            byte(0xb8 + (dst & 7));
+            int32(static_cast<int32_t>(value));
+            return;
+        }
+        rex(true, 0, dst);
+        byte(0xb8 + (dst & 7));
+        int64(value);
+    }
+    void mov(Reg dst, Reg src) { alu(0x89, dst, src); }
+    void load(Reg dst, Reg base, int32_t disp) {
+        rex(true, dst, base);
+        byte(0x8b);
+        memory(dst, base, disp);
+    }
+    void store(Reg base, int32_t disp, Reg src) {
+        rex(true, src, base);
+        byte(0x89);
+        memory(src, base, disp);
+    }
+    void load(Reg dst, Reg base, Reg index, int32_t disp) {
+        rex(true, dst, base, index);
+        byte(0x8b);
+        memory(dst, base, index, disp);
+    }
+    void store(Reg base, Reg index, int32_t disp, Reg src) {
+        rex(true, src, base, index);
+        byte(0x89);
+        memory(src, base, index, disp);
+    }
+    // Sign extends a 32-bit value.
+    void load32(Reg dst, Reg base, int32_t disp) {
+        rex(true, dst, base);
+        byte(0x63);
+        memory(dst, base, disp);
+    }
+    // dst = base + disp
+    void lea(Reg dst, Reg base, int32_t disp) {
+        rex(true, dst, base);
+        byte(0x8d);
+        memory(dst, base, disp);
+    }
+    // dst = base + index + disp
+    void lea(Reg dst, Reg base, Reg index, int8_t disp) {
+        rex(true, dst, base, index);
+        byte(0x8d);
+        byte(static_cast<uint8_t>(0x44 | (dst & 7) << 3));
+        byte(static_cast<uint8_t>((index & 7) << 3 | (base & 7)));
+        byte(static_cast<uint8_t>(disp));
+    }
+    // dst = the address of the next instruction plus a displacement,
+    // patched like a jump's.
+    size_t leaRip(Reg dst) {
+        rex(true, dst, 0);
+        byte(0x8d);
+        byte(static_cast<uint8_t>((dst & 7) << 3 | RBP));
+        int32(0);
+        return position() - 4;
+    }
+    void addImmediate(Reg dst, int32_t value) { aluImmediate(0, dst, value); }
+    void subImmediate(Reg dst, int32_t value) { aluImmediate(5, dst, value); }
+    void cmpImmediate(Reg dst, int32_t value) { aluImmediate(7, dst, value); }
+    void cmp(Reg a, Reg base, int32_t disp) {
+        rex(true, a, base);
+        byte(0x3b);
+        memory(a, base, disp);
+    }
+    void cmp32(Reg base, int32_t disp, int32_t value) {
+        rex(false, 0, base);
+        if (value >= -128 && value <= 127) {
+            byte(0x83);
+            memory(7, base, disp);
+            byte(static_cast<uint8_t>(value));
+        } else {
+            byte(0x81);
+            memory(7, base, disp);
+            int32(value);
+        }
+    }
+    void cmp8(Reg base, int32_t disp, uint8_t value) {
+        rex(false, 0, base);
+        byte(0x80);
+        memory(7, base, disp);
+        byte(value);
+    }
+    void increment(Reg base, int32_t disp) {
+        rex(true, 0, base);
+        byte(0xff);
+        memory(0, base, disp);
+    }
+    // shl (4), shr (5) or sar (7).
+    void shift(int extension, Reg dst, uint8_t count) {
+        rex(true, 0, dst);
+        byte(0xc1);
+        registers(extension, dst);
+        byte(count);
+    }
+    void add(Reg dst, Reg src) { alu(0x01, dst, src); }
+    void sub(Reg dst, Reg src) { alu(0x29, dst, src); }
+    void andRegister(Reg dst, Reg src) { alu(0x21, dst, src); }
+    void xorRegister(Reg dst, Reg src) { alu(0x31, dst, src); }
+    void cmp(Reg a, Reg b) { alu(0x39, a, b); }
+    void test(Reg reg) { alu(0x85, reg, reg); }
+    // Flips one bit of `dst`.
+    void btc(Reg dst, uint8_t bit) {
+        rex(true, 0, dst);
+        byte(0x0f);
+        byte(0xba);
+        registers(7, dst);
+        byte(bit);
+    }
+
+    // Byte-sized operations on the low byte of RAX, RCX or RDX.
+    void setcc(Condition condition, Reg dst) {
+        byte(0x0f);
+        byte(0x90 | static_cast<uint8_t>(condition));
+        registers(0, dst);
+    }
+    void and8(Reg dst, Reg src) {
+        byte(0x20);
+        registers(src, dst);
+    }
+    void test8(Reg reg) {
+        byte(0x84);
+        registers(reg, reg);
+    }
+    void movzx8(Reg dst, Reg src) {
+        byte(0x0f);
+        byte(0xb6);
+        registers(dst, src);
+    }
+
+    void movq(Xmm dst, Reg src) {
+        byte(0x66);
+        rex(true, dst, src);
+        byte(0x0f);
+        byte(0x6e);
+        registers(dst, src);
+    }
+    void movq(Reg dst, Xmm src) {
+        byte(0x66);
+        rex(true, src, dst);
+        byte(0x0f);
+        byte(0x7e);
+        registers(src, dst);
+    }
+    // addsd (0x58), mulsd (0x59), subsd (0x5c) or divsd (0x5e).
+    void arithmetic(uint8_t opcode, Xmm dst, Xmm src) {
+        byte(0xf2);
+        rex(false, dst, src);
+        byte(0x0f);
+        byte(opcode);
+        registers(dst, src);
+    }
+    void ucomisd(Xmm a, Xmm b) {
+        byte(0x66);
+        rex(false, a, b);
+        byte(0x0f);
+        byte(0x2e);
+        registers(a, b);
+    }
+    void movapd(Xmm dst, Xmm src) {
+        byte(0x66);
+        rex(false, dst, src);
+        byte(0x0f);
+        byte(0x28);
+        registers(dst, src);
+    }
+
+    void push(Reg reg) {
+        if (reg >= 8) byte(0x41);
+        byte(0x50 + (reg & 7));
+    }
+    void pop(Reg reg) {
+        if (reg >= 8) byte(0x41);
+        byte(0x58 + (reg & 7));
+    }
+    void ret() { byte(0xc3); }
+    void jump(Reg reg) {
+        byte(0xff);
+        registers(4, reg);
+    }
+
+    // Calls and jumps through an address stored elsewhere in the code, and
+    // jumps with a 32-bit displacement. The displacement is patched by
+    // `bind` or `patch`; they return where it is.
+    size_t callIndirect() {
+        byte(0xff);
+        byte(0x15);
+        int32(0);
+        return position() - 4;
+    }
+    size_t jumpIndirect() {
+        byte(0xff);
+        byte(0x25);
+        int32(0);
+        return position() - 4;
+    }
+    size_t jump() {
+        byte(0xe9);
+        int32(0);
+        return position() - 4;
+    }
+    size_t jump(Condition condition) {
+        byte(0x0f);
+        byte(0x80 | static_cast<uint8_t>(condition));
+        int32(0);
+        return position() - 4;
+    }
+    void patch(size_t at, size_t target) {
+        auto displacement = static_cast<int32_t>(target - (at + 4));
+        std::memcpy(&code[at], &displacement, sizeof(displacement));
+    }
+    void bind(size_t at) { patch(at, position()); }
+
+    // The calls and jumps that go through a table of addresses, which
+    // `table` appends once the code is done, with each address once.
+    struct Indirect {
+        size_t at;
+        const void* address;
+    };
+    void table(const std::vector<Indirect>& indirects) {
+        align(sizeof(uint64_t));
+        std::unordered_map<const void*, size_t> entries;
+        for (auto& indirect : indirects) {
+            auto entry = entries.find(indirect.address);
+            if (entry == entries.end()) {
+                entry = entries.emplace(indirect.address, position()).first;
+                int64(reinterpret_cast<uint64_t>(indirect.address));
+            }
+            patch(indirect.at, entry->second);
+        }
+    }
+};
+
+// Copies what `as` assembled into a mapping of its own that can run but no
+// longer be written.
+bool mapCode(const Assembler& as, NativeCode& native);
+
+#endif /* x86_hpp */
@@ -3,12 +3,26 @@ import 'dart:io';
 
 import 'package:path/path.dart' as p;
 
+/// The flags that select each of clox's backends. The stack backend runs
+/// without the JIT so that both count every instruction they dispatch.
+const backends = {
+  "stack": ["--no-jit"],
+  "registers": ["--registers"],
+};
+
 void main(List<String> arguments) {
   if (arguments.isEmpty) {
     print('Usage: benchmark.py [interpreters...] <benchmark>');
+    print('       benchmark.py --backends [interpreter] <benchmark>');
     exit(1);
   }
 
+  if (arguments.first == "--backends") {
+    var interpreter = arguments.length > 2 ? arguments[1] : 'build/clox';
+    runBackends(interpreter, arguments.last);
+    return;
+  }
+
   var interpreters = ['build/clox'];
   var benchmark = arguments.last;
   if (arguments.length > 1) {
@@ -38,8 +52,16 @@ void runBenchmark(String interpreter, String benchmark) {
 
 /// Runs the benchmark once and returns the elapsed time.
 double runTrial(String interpreter, String benchmark) {
-  var result = Process.runSync(
-      interpreter, [p.join("test", "benchmark", "$benchmark.lox")]);
+  return elapsedTime(runInterpreter(interpreter, [], benchmark));
+}
+
+ProcessResult runInterpreter(
+    String interpreter, List<String> flags, String benchmark) {
+  return Process.runSync(interpreter,
+      [...flags, p.join("test", "benchmark", "$benchmark.lox")]);
+}
+
+double elapsedTime(ProcessResult result) {
   var outLines = const LineSplitter().convert(result.stdout as String);
 
   // Remove the trailing last empty line.
@@ -49,6 +71,47 @@ double runTrial(String interpreter, String benchmark) {
   return double.parse(outLines.last);
 }
 
+/// How many instructions a run with `--instruction-count` dispatched.
+int instructionCount(ProcessResult result) {
+  var errLines = const LineSplitter().convert(result.stderr as String);
+  var prefix = "instructions: ";
+  var line = errLines.lastWhere((line) => line.startsWith(prefix));
+  return int.parse(line.substring(prefix.length));
+}
+
+/// Runs [benchmark] on each of [interpreter]'s backends and compares their
+/// best times and how many instructions each ran to the stack backend's.
+void runBackends(String interpreter, String benchmark) {
+  var trial = 1;
+  var best = {for (var backend in backends.keys) backend: 9999.0};
+  var instructions = <String, int>{};
+
+  for (;;) {
+    backends.forEach((backend, flags) {
+      var result = runInterpreter(
+          interpreter, [...flags, "--instruction-count"], benchmark);
+      var elapsed = elapsedTime(result);
+      if (elapsed < best[backend]) best[backend] = elapsed;
+
+      // The count is the same every time.
+      instructions[backend] = instructionCount(result);
+    });
+
+    print("trial #$trial");
+    for (var backend in backends.keys) {
+      var bestString = best[backend].toStringAsFixed(4);
+      var timeRatio = best[backend] / best["stack"];
+      var countRatio = instructions[backend] / instructions["stack"];
+      print("  ${backend.padRight(10)}   best ${bestString}s  "
+          "${instructions[backend].toString().padLeft(12)} instructions  "
+          "${timeRatio.toStringAsFixed(4)}x time, "
+          "${countRatio.toStringAsFixed(4)}x instructions of stack");
+    }
+
+    trial++;
+  }
+}
+
 void runComparison(List<String> interpreters, String benchmark) {
   var trial = 1;
   var best = {for (var interpreter in interpreters) interpreter: 9999.0};
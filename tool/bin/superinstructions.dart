@@ -0,0 +1,96 @@
+import 'dart:convert';
+import 'dart:io';
+
+import 'package:glob/glob.dart';
+import 'package:path/path.dart' as p;
+
+/// Instructions that leave the straight line of code, so a superinstruction
+/// can only end with one of them.
+const branches = {
+  "JUMP",
+  "JUMP_IF_FALSE",
+  "LOOP",
+  "CALL",
+  "INVOKE",
+  "SUPER_INVOKE",
+  "TAIL_CALL",
+  "TAIL_INVOKE",
+  "RETURN",
+  "CLOSURE",
+};
+
+/// Runs an interpreter built with DEBUG_PROFILE_OPCODES over every benchmark
+/// and ranks the instruction sequences it saw by how many dispatches fusing
+/// each into a superinstruction would have saved, then prints the best ones
+/// as a SUPERINSTRUCTIONS list for cloxpp/opcode.hpp.
+///
+/// Each benchmark counts the same however long it runs: a sequence scores the
+/// share of its benchmark's dispatches it would have saved, summed over the
+/// benchmarks.
+void main(List<String> arguments) {
+  if (arguments.isEmpty || arguments.length > 2) {
+    print('Usage: superinstructions.dart <profiling interpreter> [count]');
+    exit(1);
+  }
+
+  var interpreter = arguments[0];
+  var count = arguments.length > 1 ? int.parse(arguments[1]) : 10;
+
+  var scores = <String, double>{};
+  var benchmarks = Glob(p.join("test", "benchmark", "*.lox")).listSync()
+    ..sort((a, b) => a.path.compareTo(b.path));
+  for (var benchmark in benchmarks) {
+    stderr.writeln("Profiling ${p.basename(benchmark.path)}...");
+    profile(interpreter, benchmark.path).forEach((sequence, score) {
+      scores[sequence] = (scores[sequence] ?? 0.0) + score;
+    });
+  }
+
+  var ranked = scores.keys.toList()
+    ..sort((a, b) => scores[b].compareTo(scores[a]));
+
+  print("#define SUPERINSTRUCTIONS(X) \\");
+  var picked = ranked.take(count).toList();
+  for (var i = 0; i < picked.length; i++) {
+    var parts = picked[i].split(" ");
+    var line = "    X(${parts.join("_")}, ${parts.join(", ")})";
+    if (i < picked.length - 1) line += " \\";
+    print(line.padRight(80) + "// ${scores[picked[i]].toStringAsFixed(3)}");
+  }
+}
+
+/// Maps each fusable sequence in the profile of one run of [benchmark] to
+/// the share of the run's dispatches fusing it would have saved.
+Map<String, double> profile(String interpreter, String benchmark) {
+  var result = Process.runSync(interpreter, [benchmark]);
+  if (result.exitCode != 0) {
+    stderr.writeln("$benchmark failed with exit code ${result.exitCode}.");
+    exit(1);
+  }
+
+  // The profile is the lines of stderr that start with a count.
+  var counts = <List<String>, int>{};
+  var dispatches = 0;
+  for (var line in const LineSplitter().convert(result.stderr as String)) {
+    var fields = line.split(" ");
+    var count = int.tryParse(fields[0]);
+    if (count == null) continue;
+
+    var sequence = fields.sublist(1);
+    if (sequence.length == 1) {
+      dispatches += count;
+    } else {
+      counts[sequence] = count;
+    }
+  }
+
+  var scores = <String, double>{};
+  counts.forEach((sequence, count) {
+    var leading = sequence.sublist(0, sequence.length - 1);
+    if (leading.any(branches.contains)) return;
+
+    var saved = count * (sequence.length - 1);
+    scores[sequence.join(" ")] = saved / dispatches;
+  });
+  return scores;
+}
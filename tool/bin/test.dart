@@ -429,9 +429,10 @@ class Test {
 }
 
 void _defineTestSuites() {
-  void c(String name, Map<String, String> tests) {
-    var executable = name == "clox" ? "build/cloxd" : "build/$name";
-    _allSuites[name] = Suite(name, "c", executable, [], tests);
+  void c(String name, Map<String, String> tests,
+      {String executable, List<String> args = const []}) {
+    executable ??= name == "clox" ? "build/cloxd" : "build/$name";
+    _allSuites[name] = Suite(name, "c", executable, args, tests);
     _cSuites.add(name);
   }
 
@@ -689,6 +690,20 @@ void _defineTestSuites() {
     ...earlyChapters,
   });
 
+  // The same tests with the collector marking and sweeping in the shortest
+  // slices it takes.
+  c("clox_incremental_gc", {
+    "test": "pass",
+    ...earlyChapters,
+  }, executable: "build/cloxd", args: ["--gc-pause=1"]);
+
+  // And with the interpreter running everything, so the tests reach its
+  // paths as well as the JIT's.
+  c("clox_no_jit", {
+    "test": "pass",
+    ...earlyChapters,
+  }, executable: "build/cloxd", args: ["--no-jit"]);
+
   c("chap17_compiling", {
     // No real interpreter yet.
     "test": "skip",